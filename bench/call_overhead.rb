@@ -0,0 +1,103 @@
+# bench/call_overhead.rb - the cost of a call of each DevHandle method.
+#
+# The transfers are the smallest ones, so that the time is the Ruby to C
+# call, the argument checks and the GVL release more than the transfer
+# itself.  usb_reset is not measured as it re-enumerates the device.
+
+module Bench
+  def self.call_overhead(target)
+    g = "call"
+    n = 20_000
+    measure(g, "Device#usb_open+usb_close", iterations: n / 4) { target.device.usb_open.usb_close }
+    measure(g, "Device#open {}", iterations: n / 4) { target.device.open {} }
+    pool = USB::HandlePool.new(interfaces: [target.interface], configuration: target.configuration)
+    measure(g, "HandlePool#with {}", iterations: n) { pool.with(target.device) {} }
+    pool.close
+
+    target.device.open {|h|
+      measure(g, "usb_set_configuration", iterations: n / 4) { h.usb_set_configuration(target.configuration) }
+      measure(g, "set_configuration", iterations: n / 4) { h.set_configuration(target.configuration) }
+      measure(g, "usb_claim_interface+usb_release_interface", iterations: n) {
+        h.usb_claim_interface(target.interface)
+        h.usb_release_interface(target.interface)
+      }
+      measure(g, "claim_interface+release_interface", iterations: n) {
+        h.claim_interface(target.interface)
+        h.release_interface(target.interface)
+      }
+      h.usb_claim_interface(target.interface)
+      call_overhead_claimed(target, h, g, n)
+      h.usb_release_interface(target.interface)
+    }
+  end
+
+  def self.call_overhead_claimed(target, h, g, n)
+    measure(g, "usb_set_altinterface", iterations: n) { h.usb_set_altinterface(0) }
+    measure(g, "set_altinterface", iterations: n) { h.set_altinterface(0) }
+    measure(g, "usb_clear_halt", iterations: n) { h.usb_clear_halt(target.bulk_in) }
+    measure(g, "clear_halt", iterations: n) { h.clear_halt(target.bulk_in) }
+
+    empty = "".b
+    buf8 = "\0".b * 8
+    measure(g, "usb_control_msg out 0", iterations: n) { h.usb_control_msg(0x40, 0x5b, 0, 0, empty, 1000) }
+    measure(g, "usb_control_msg in 8", iterations: n) { h.usb_control_msg(0xc0, 0x5c, 0, 0, buf8, 1000) }
+    requests = Array.new(16) { [0x40, 0x5b, 0, 0, buf8] }
+    measure(g, "control_batch 16", iterations: n / 16, items: 16) { h.control_batch(requests, 1000) }
+
+    devdesc = "\0".b * USB::USB_DT_DEVICE_SIZE
+    measure(g, "usb_get_descriptor", iterations: n) { h.usb_get_descriptor(USB::USB_DT_DEVICE, 0, devdesc) }
+    measure(g, "usb_get_descriptor_by_endpoint", iterations: n) {
+      h.usb_get_descriptor_by_endpoint(0, USB::USB_DT_DEVICE, 0, devdesc)
+    }
+    index = target.device.iProduct
+    if index != 0
+      strbuf = "\0".b * 255
+      measure(g, "usb_get_string", iterations: n) { h.usb_get_string(index, 0x0409, strbuf) }
+      measure(g, "usb_get_string_simple", iterations: n) { h.usb_get_string_simple(index, strbuf) }
+      measure(g, "get_string_simple", iterations: n) { h.get_string_simple(index) }
+    end
+
+    if target.bulk_in
+      buf = "\0".b * 64
+      into = String.new(capacity: 64)
+      measure(g, "usb_bulk_read 64", iterations: n) { h.usb_bulk_read(target.bulk_in, buf, 1000) }
+      measure(g, "bulk_read_into 64", iterations: n) { h.bulk_read_into(target.bulk_in, into, 1000) }
+      measure(g, "bulk_read 64", iterations: n) { h.bulk_read(target.bulk_in, into, timeout: 1000) }
+      measure(g, "submit_bulk in 64+result", iterations: n / 4) { h.submit_bulk(target.bulk_in, buf, 1000).result }
+      measure(g, "submit_bulk in 64+reap", iterations: n / 4) {
+        h.submit_bulk(target.bulk_in, buf, 1000)
+        h.reap
+      }
+    end
+    if target.bulk_out
+      data = "\0".b * 64
+      measure(g, "usb_bulk_write 64", iterations: n) { h.usb_bulk_write(target.bulk_out, data, 1000) }
+      items = Array.new(16, data)
+      measure(g, "bulk_write_batch 16x64", iterations: n / 16, items: 16) { h.bulk_write_batch(target.bulk_out, items, 1000) }
+    end
+    if target.interrupt_in
+      buf = "\0".b * 8
+      into = String.new(capacity: 8)
+      measure(g, "usb_interrupt_read 8", iterations: n) { h.usb_interrupt_read(target.interrupt_in, buf, 1000) }
+      measure(g, "interrupt_read_into 8", iterations: n) { h.interrupt_read_into(target.interrupt_in, into, 1000) }
+      measure(g, "interrupt_read 8", iterations: n) { h.interrupt_read(target.interrupt_in, into, timeout: 1000) }
+    end
+    if target.interrupt_out
+      data = "\0".b * 8
+      measure(g, "usb_interrupt_write 8", iterations: n) { h.usb_interrupt_write(target.interrupt_out, data, 1000) }
+    end
+
+    if h.respond_to?(:usb_get_driver_np)
+      name = "\0".b * 256
+      measure(g, "usb_get_driver_np (raises)", iterations: n / 4) {
+        begin
+          h.usb_get_driver_np(target.interface, name)
+        rescue Errno::ENODATA
+        end
+      }
+    end
+    measure(g, "stats", iterations: n) { h.stats }
+    measure(g, "reset_stats", iterations: n) { h.reset_stats }
+    measure(g, "pending_transfers", iterations: n) { h.pending_transfers }
+  end
+end
@@ -0,0 +1,47 @@
+# bench/compare.rb - compares two results of bench/run.rb.
+#
+# usage: ruby bench/compare.rb [--threshold=0.2] baseline.json current.json
+#
+# A benchmark regresses if its time per call grows by more than the
+# threshold, or if it allocates more objects per call,
+# beyond 5% for those depending on the GC.
+# It exits with 1 if a benchmark regresses, so that CI can gate on it.
+# The benchmarks missing in either result are listed but not failed.
+
+require 'json'
+require 'optparse'
+
+threshold = 0.2
+OptionParser.new {|opts|
+  opts.banner = "usage: ruby bench/compare.rb [--threshold=0.2] baseline.json current.json"
+  opts.on("--threshold=RATIO", Float) {|v| threshold = v }
+}.parse!(ARGV)
+abort "usage: ruby bench/compare.rb [--threshold=0.2] baseline.json current.json" if ARGV.length != 2
+
+load = lambda {|path|
+  JSON.parse(File.read(path), symbolize_names: true)[:results].to_h {|r| [[r[:group], r[:name]], r] }
+}
+baseline = load.(ARGV[0])
+current = load.(ARGV[1])
+
+regressions = 0
+(baseline.keys | current.keys).each {|key|
+  b = baseline[key]
+  c = current[key]
+  unless b && c
+    printf("%-12s %-44s %s\n", *key, b ? "removed" : "new")
+    next
+  end
+  ratio = c[:ns_per_op] / b[:ns_per_op]
+  slower = 1 + threshold < ratio
+  allocating = b[:allocations_per_op] * 1.05 + 0.5 < c[:allocations_per_op]
+  regressions += 1 if slower || allocating
+  printf("%-12s %-44s %10.0f -> %10.0f ns/op %+6.1f%% %6.1f -> %6.1f allocs/op%s\n",
+         *key, b[:ns_per_op], c[:ns_per_op], (ratio - 1) * 100,
+         b[:allocations_per_op], c[:allocations_per_op],
+         slower || allocating ? "  REGRESSION" : "")
+}
+if regressions != 0
+  puts "#{regressions} regressions above #{(threshold * 100).round}%"
+  exit 1
+end
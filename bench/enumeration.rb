@@ -0,0 +1,77 @@
+# bench/enumeration.rb - enumeration, lookups and inspect on large topologies.
+#
+# On the emulator, each topology is plugged as _busses_ busses of
+# _per_bus_ devices: a root hub, a hub on each of its ports up to 8,
+# and devices with strings on the ports of the hubs.
+# On other targets, the devices attached are measured as they are.
+
+module Bench
+  # [busses, devices per bus]
+  TOPOLOGIES = [[1, 8], [4, 32], [16, 127]]
+
+  def self.enumeration(target)
+    if target.name == "emulator"
+      TOPOLOGIES.each {|busses, per_bus|
+        USB::Emulator.reset
+        USB::Emulator.load(topology(busses, per_bus))
+        USB.rescan
+        enumeration_on("#{busses}x#{per_bus}")
+      }
+    else
+      USB.rescan
+      enumeration_on("attached")
+    end
+  end
+
+  def self.topology(busses, per_bus)
+    specs = []
+    hubs = [(per_bus - 1) / 9, 8].min
+    (1..busses).each {|bus|
+      specs << {bus: bus, address: 1, class: USB::USB_CLASS_HUB, configurations: []}
+      address = 2
+      (1..hubs).each {|port|
+        specs << {bus: bus, address: address, parent: 1, port: port,
+                  class: USB::USB_CLASS_HUB, vendor: 0x1d6b, product: 0x0002, configurations: []}
+        address += 1
+      }
+      leaf = 0
+      while address <= per_bus
+        parent, port = hubs == 0 ? [1, leaf + 1] : [2 + leaf % hubs, 1 + leaf / hubs]
+        specs << {bus: bus, address: address, parent: parent, port: port,
+                  vendor: 0x1234, product: address,
+                  manufacturer: "ACME", product_name: "Widget #{address}", serial_number: "#{bus}-#{address}"}
+        address += 1
+        leaf += 1
+      end
+    }
+    specs
+  end
+
+  def self.enumeration_on(label)
+    g = "enumeration"
+    devices = USB.devices
+    count = devices.length
+    paths = devices.map(&:port_path).compact
+    path = paths[paths.length / 2]
+    some = devices[count / 2]
+    n = 2000
+    measure(g, "USB.rescan unchanged #{label}", iterations: n, items: count) { USB.rescan }
+    measure(g, "USB.find_busses+find_devices #{label}", iterations: n / 10, items: count) {
+      USB.find_busses
+      USB.find_devices
+    }
+    devices = USB.devices
+    some = devices[count / 2]
+    measure(g, "USB.devices #{label}", iterations: n, items: count) { USB.devices }
+    measure(g, "USB.each_device #{label}", iterations: n, items: count) { USB.each_device {} }
+    measure(g, "USB.endpoints #{label}", iterations: n, items: count) { USB.endpoints }
+    measure(g, "USB.devices_by_ids #{label}", iterations: n * 10) { USB.devices_by_ids(some.idVendor, some.idProduct) }
+    measure(g, "USB.find_device_by_port_path #{label}", iterations: n * 10) { USB.find_device_by_port_path(path) } if path
+    measure(g, "Device#descriptor #{label}", iterations: n / 10, items: count) { devices.each {|d| d.descriptor } }
+    measure(g, "Device#inspect cached #{label}", iterations: n / 10, items: count) { devices.each {|d| d.inspect } }
+    measure(g, "Device#inspect uncached #{label}", iterations: n / 20, items: count) {
+      USB.clear_string_cache
+      devices.each {|d| d.inspect }
+    }
+  end
+end
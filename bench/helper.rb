@@ -0,0 +1,154 @@
+# bench/helper.rb - measurement and targets of the benchmarks.
+
+require 'usb'
+require 'json'
+require 'time'
+
+module Bench
+  # vendor and product IDs of g_zero, the Gadget Zero of the Linux kernel.
+  GZERO_VENDOR = 0x0525
+  GZERO_PRODUCT = 0xa4a0
+
+  @results = []
+  @skipped = []
+  @scale = Float(ENV["BENCH_SCALE"] || 1)
+
+  class << self
+    attr_reader :results, :skipped
+    attr_accessor :scale
+  end
+
+  # rounds of each benchmark; the fastest one is reported,
+  # as the slower ones are disturbed by the rest of the system.
+  ROUNDS = 5
+
+  # runs the block _iterations_ times, scaled by BENCH_SCALE, after a warm-up,
+  # in ROUNDS rounds.
+  # The result has the time per call of the fastest round and the median one,
+  # the objects allocated per call,
+  # the throughput if a call transfers _bytes_,
+  # and the time per item if a call handles _items_.
+  #
+  # A SystemCallError skips the benchmark, as a target may not support it.
+  def self.measure(group, name, iterations:, bytes: nil, items: nil)
+    per_round = [(iterations * @scale / ROUNDS).round, 1].max
+    [per_round / 2, 1].max.times { yield }
+    GC.start
+    allocated = GC.stat(:total_allocated_objects)
+    times = Array.new(ROUNDS) {
+      t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      i = 0
+      while i < per_round
+        yield
+        i += 1
+      end
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+    }
+    allocated = GC.stat(:total_allocated_objects) - allocated
+    times.sort!
+    r = {
+      group: group,
+      name: name,
+      iterations: per_round * ROUNDS,
+      seconds: times.sum,
+      ns_per_op: times.first * 1e9 / per_round,
+      ns_per_op_median: times[ROUNDS / 2] * 1e9 / per_round,
+      allocations_per_op: allocated.fdiv(per_round * ROUNDS),
+    }
+    r[:mb_per_sec] = bytes * per_round / times.first / 1e6 if bytes
+    r[:ns_per_item] = r[:ns_per_op] / items if items
+    @results << r
+    report(r)
+    r
+  rescue SystemCallError => e
+    @skipped << {group: group, name: name, reason: e.message}
+    $stdout.printf("%-12s %-44s skipped: %s\n", group, name, e.message)
+    nil
+  end
+
+  def self.report(r)
+    line = format("%-12s %-44s %12.0f ns/op %8.1f allocs/op", r[:group], r[:name], r[:ns_per_op], r[:allocations_per_op])
+    line << format(" %10.1f MB/s", r[:mb_per_sec]) if r[:mb_per_sec]
+    line << format(" %10.0f ns/item", r[:ns_per_item]) if r[:ns_per_item]
+    $stdout.puts line
+  end
+
+  def self.write(path, target)
+    doc = {
+      target: target,
+      backend: USB::BACKEND,
+      ruby: RUBY_DESCRIPTION,
+      scale: @scale,
+      time: Time.now.utc.iso8601,
+      results: @results,
+      skipped: @skipped,
+    }
+    File.write(path, JSON.pretty_generate(doc) << "\n")
+  end
+
+  # the device benchmarked, with its endpoints.
+  Target = Struct.new(:name, :device, :configuration, :interface,
+                      :bulk_in, :bulk_out, :interrupt_in, :interrupt_out)
+
+  # plugs a source/sink device on the emulator, without latency,
+  # with the endpoints of g_zero and interrupt endpoints.
+  def self.emulator_target
+    USB::Emulator.reset
+    USB::Emulator.plug(bus: 1, address: 1, vendor: GZERO_VENDOR, product: GZERO_PRODUCT,
+                       manufacturer: "ruby-usb", product_name: "bench", serial_number: "0",
+                       configurations: [{interfaces: [{endpoints: [
+                         {address: 0x81, type: :bulk, max_packet_size: 512},
+                         {address: 0x01, type: :bulk, max_packet_size: 512},
+                         {address: 0x82, type: :interrupt, max_packet_size: 64, interval: 1},
+                         {address: 0x02, type: :interrupt, max_packet_size: 64, interval: 1}]}]}])
+    USB.rescan
+    find_target("emulator")
+  end
+
+  # finds g_zero, loaded on dummy_hcd by
+  #
+  #   # modprobe dummy_hcd
+  #   # modprobe g_zero
+  #
+  # Its first configuration is the source/sink one:
+  # the IN endpoint returns zeros and the OUT endpoint accepts zeros.
+  def self.gadget_target
+    USB.rescan
+    find_target("gadget")
+  end
+
+  def self.find_target(name)
+    device = USB.devices_by_ids(GZERO_VENDOR, GZERO_PRODUCT).first
+    abort "no device #{'%04x:%04x' % [GZERO_VENDOR, GZERO_PRODUCT]}: load dummy_hcd and g_zero" unless device
+    configuration = device.configurations.first
+    setting = configuration.settings.find {|s| s.endpoints.any? {|ep| bulk?(ep) } }
+    abort "no bulk endpoints on #{device.inspect}" unless setting
+    eps = setting.endpoints
+    find = lambda {|type, dir|
+      ep = eps.find {|e| e.bmAttributes & USB::USB_ENDPOINT_TYPE_MASK == type && e.bEndpointAddress & USB::USB_ENDPOINT_IN == dir }
+      ep && ep.bEndpointAddress
+    }
+    Target.new(name, device, configuration.bConfigurationValue, setting.bInterfaceNumber,
+               find.(USB::USB_ENDPOINT_TYPE_BULK, USB::USB_ENDPOINT_IN),
+               find.(USB::USB_ENDPOINT_TYPE_BULK, 0),
+               find.(USB::USB_ENDPOINT_TYPE_INTERRUPT, USB::USB_ENDPOINT_IN),
+               find.(USB::USB_ENDPOINT_TYPE_INTERRUPT, 0))
+  end
+
+  def self.bulk?(ep)
+    ep.bmAttributes & USB::USB_ENDPOINT_TYPE_MASK == USB::USB_ENDPOINT_TYPE_BULK
+  end
+
+  # opens the target, yielding the handle with its interface claimed.
+  def self.open(target)
+    target.device.open {|h|
+      h.usb_set_configuration(target.configuration)
+      h.usb_claim_interface(target.interface)
+      begin
+        yield h
+      ensure
+        h.usb_release_interface(target.interface)
+      end
+    }
+  end
+end
@@ -0,0 +1,55 @@
+# bench/run.rb - runs the benchmarks.
+#
+# usage: ruby -I<dir of usb.so> -Ilib bench/run.rb [--target=emulator|gadget]
+#          [--only=call,throughput,enumeration] [--output=results.json] [--scale=N]
+#
+# "rake bench" and "rake bench:gadget" run it.
+# The emulator target needs usb.so built with --enable-emulator,
+# the gadget target g_zero on dummy_hcd (or on a real UDC).
+#
+# The iterations are multiplied by --scale, or BENCH_SCALE.
+# The gadget target runs 1/100 of them by default,
+# as dummy_hcd transfers take about a frame.
+
+require 'optparse'
+require_relative 'helper'
+require_relative 'call_overhead'
+require_relative 'throughput'
+require_relative 'enumeration'
+
+GROUPS = {
+  "call" => :call_overhead,
+  "throughput" => :throughput,
+  "enumeration" => :enumeration,
+}
+
+target_name = USB::BACKEND == "emulator" ? "emulator" : "gadget"
+only = GROUPS.keys
+output = ENV["BENCH_OUTPUT"]
+scale = nil
+OptionParser.new {|opts|
+  opts.on("--target=NAME", %w[emulator gadget]) {|v| target_name = v }
+  opts.on("--only=GROUPS", Array) {|v| only = v }
+  opts.on("--output=FILE") {|v| output = v }
+  opts.on("--scale=N", Float) {|v| scale = v }
+}.parse!(ARGV)
+
+unknown = only - GROUPS.keys
+abort "unknown groups: #{unknown.join(', ')}" unless unknown.empty?
+if target_name == "emulator" && USB::BACKEND != "emulator"
+  abort "the emulator target needs usb.so built by: ruby extconf.rb --enable-emulator"
+end
+Bench.scale = scale if scale
+Bench.scale /= 100 if target_name == "gadget" && !scale && !ENV["BENCH_SCALE"]
+
+$stdout.sync = true
+puts "# #{RUBY_DESCRIPTION}, #{USB::BACKEND}, target #{target_name}, scale #{Bench.scale}"
+only.each {|group|
+  target = target_name == "emulator" ? Bench.emulator_target : Bench.gadget_target
+  Bench.send(GROUPS.fetch(group), target)
+}
+USB::Emulator.reset if target_name == "emulator"
+if output
+  Bench.write(output, target_name)
+  puts "# results written to #{output}"
+end
@@ -0,0 +1,54 @@
+# bench/throughput.rb - bulk transfer rates by buffer size.
+#
+# Each size moves about 64 MB, scaled by BENCH_SCALE,
+# at least 100 transfers.
+#
+# The OUT endpoints of the emulator discard the bytes without copying them,
+# so the writes on the emulator report their time per call only:
+# a rate would grow with the size without measuring anything.
+
+module Bench
+  THROUGHPUT_SIZES = [64, 512, 4096, 16384, 65536, 262144, 1 << 20]
+  THROUGHPUT_BYTES = 64 << 20
+
+  def self.throughput(target)
+    g = "throughput"
+    Bench.open(target) {|h|
+      THROUGHPUT_SIZES.each {|size|
+        n = [THROUGHPUT_BYTES / size, 100 / @scale].max.ceil
+        n = 20_000 if 20_000 < n
+        if target.bulk_in
+          buf = "\0".b * size
+          into = String.new(capacity: size)
+          measure(g, "usb_bulk_read #{size}", iterations: n, bytes: size) { h.usb_bulk_read(target.bulk_in, buf, 1000) }
+          measure(g, "bulk_read_into #{size}", iterations: n, bytes: size) { h.bulk_read_into(target.bulk_in, into, 1000) }
+        end
+        if target.bulk_out
+          data = "\0".b * size
+          written = target.name == "emulator" ? nil : size
+          measure(g, "usb_bulk_write #{size}", iterations: n, bytes: written) { h.usb_bulk_write(target.bulk_out, data, 1000) }
+          items = Array.new(16, data)
+          measure(g, "bulk_write_batch 16x#{size}", iterations: (n / 16.0).ceil, bytes: written && written * 16, items: 16) {
+            h.bulk_write_batch(target.bulk_out, items, 1000)
+          }
+        end
+      }
+      if target.bulk_in
+        buf = "\0".b * 512
+        begin
+          USB.stats_enabled = true
+          measure(g, "usb_bulk_read 512 with stats", iterations: THROUGHPUT_BYTES / 512 / 16, bytes: 512) {
+            h.usb_bulk_read(target.bulk_in, buf, 1000)
+          }
+        ensure
+          USB.stats_enabled = false
+        end
+        h.trace_start(snaplen: 64) {
+          measure(g, "usb_bulk_read 512 traced", iterations: THROUGHPUT_BYTES / 512 / 16, bytes: 512) {
+            h.usb_bulk_read(target.bulk_in, buf, 1000)
+          }
+        }
+      end
+    }
+  end
+end
@@ -23,7 +23,37 @@
 
 require 'mkmf'
 
-have_library("usb", "usb_init")
+# libusb-1.0 is used if available.  --disable-libusb1 selects libusb-0.1.
+# --enable-emulator builds with emulated devices instead of libusb.
+if enable_config("emulator", false)
+  have_header("ruby/thread_native.h") or
+    abort "ruby/thread_native.h is needed for the emulator"
+  $defs << "-DRUSB_EMULATOR"
+elsif enable_config("libusb1", true) &&
+   (pkg_config("libusb-1.0"); have_header("libusb.h")) &&
+   have_library("usb-1.0", "libusb_init") &&
+   have_header("ruby/thread_native.h")
+  $defs << "-DHAVE_LIBUSB_1_0"
+  have_func("libusb_get_parent", "libusb.h")
+  have_func("libusb_get_port_numbers", "libusb.h")
+  have_func("libusb_alloc_streams", "libusb.h")
+  have_func("libusb_interrupt_event_handler", "libusb.h")
+  have_func("libusb_free_pollfds", "libusb.h")
+  have_func("libusb_hotplug_register_callback", "libusb.h")
+  have_header("poll.h")
+else
+  have_library("usb", "usb_init")
+end
 have_header("ruby/st.h")
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h") ||
+have_func("rb_thread_blocking_region")
+have_func("rb_str_modify_expand")
+have_func("rb_str_set_len")
+have_func("rb_str_capacity")
+have_func("rb_utf8_str_new")
+have_func("rb_gc_mark_movable")
+have_header("ruby/io/buffer.h") &&
+have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
 
 create_makefile('usb')
@@ -61,29 +61,105 @@ require 'usb.so'
 #
 
 module USB
-  def USB.busses
-    result = []
-    bus = USB.first_bus
-    while bus
-      result << bus
-      bus = bus.next
+  autoload :Emulator, 'usb/emulator'
+  autoload :Trace, 'usb/trace'
+  autoload :Recorder, 'usb/replay'
+  autoload :Replay, 'usb/replay'
+
+  # USB.busses, USB.devices, etc. walk the tree once in C.
+  # The each_* forms yield the objects without building an array.
+  def USB.busses() USB.usb_enumerate(nil, :busses) end
+  def USB.devices() USB.usb_enumerate(nil, :devices) end
+  def USB.configurations() USB.usb_enumerate(nil, :configurations) end
+  def USB.interfaces() USB.usb_enumerate(nil, :interfaces) end
+  def USB.settings() USB.usb_enumerate(nil, :settings) end
+  def USB.endpoints() USB.usb_enumerate(nil, :endpoints) end
+
+  def USB.each_bus(&b) b ? USB.usb_enumerate(nil, :busses, &b) : enum_for(:each_bus) end
+  def USB.each_device(&b) b ? USB.usb_enumerate(nil, :devices, &b) : enum_for(:each_device) end
+  def USB.each_configuration(&b) b ? USB.usb_enumerate(nil, :configurations, &b) : enum_for(:each_configuration) end
+  def USB.each_interface(&b) b ? USB.usb_enumerate(nil, :interfaces, &b) : enum_for(:each_interface) end
+  def USB.each_setting(&b) b ? USB.usb_enumerate(nil, :settings, &b) : enum_for(:each_setting) end
+  def USB.each_endpoint(&b) b ? USB.usb_enumerate(nil, :endpoints, &b) : enum_for(:each_endpoint) end
+
+  def USB.find_bus(n)
+    USB.usb_lookup(:bus, n)
+  end
+
+  # returns the devices with the vendor ID and, if given, the product ID.
+  #
+  #   USB.devices_by_ids(0x0925, 0x1234) #=> [#<USB::Device ...>]
+  #
+  # The lookups use an index built once after the device lists change.
+  def USB.devices_by_ids(vendor, product=nil)
+    if product
+      devs = USB.usb_lookup(:ids, (vendor << 16) | product)
+    else
+      devs = USB.usb_lookup(:vendor, vendor)
     end
-    result.sort_by {|b| b.dirname }
+    devs || []
+  end
+
+  def USB.each_device_by_ids(vendor, product=nil, &block) # :yields: device
+    USB.devices_by_ids(vendor, product).each(&block)
+    nil
   end
 
-  def USB.devices() USB.busses.map {|b| b.devices }.flatten end
-  def USB.configurations() USB.devices.map {|d| d.configurations }.flatten end
-  def USB.interfaces() USB.configurations.map {|d| d.interfaces }.flatten end
-  def USB.settings() USB.interfaces.map {|d| d.settings }.flatten end
-  def USB.endpoints() USB.settings.map {|d| d.endpoints }.flatten end
+  # returns the device at the port path such as "1-2.3", or nil.
+  # It needs libusb-1.0.
+  def USB.find_device_by_port_path(path)
+    USB.usb_lookup(:port, path)
+  end
 
-  def USB.find_bus(n)
-    bus = USB.first_bus
-    while bus
-      return bus if n == bus.dirname.to_i
-      bus = bus.next
+  # probes the devices in _concurrency_ threads and returns an inventory,
+  # an Array of Hash for USB.devices:
+  #
+  #   {:device => USB::Device, :bus => "001", :filename => "002",
+  #    :port_path => "1-2" or nil, :descriptor => USB::Device::Descriptor,
+  #    :manufacturer => String or nil, :product => ..., :serial_number => ...,
+  #    :drivers => {interface number => driver name or nil},
+  #    :error => nil or the exception}
+  #
+  # Each device is opened once, with the GVL released, to read the strings
+  # not cached yet and the drivers bound to the interfaces.
+  # Each request waits at most _timeout_ milliseconds
+  # and an unresponsive device is given up after its first timeout,
+  # so the probe takes about the slowest device rather than the sum.
+  def USB.probe_all(concurrency: 8, timeout: 1000)
+    devices = USB.devices
+    queue = Queue.new
+    devices.each_index {|i| queue << i }
+    queue.close
+    result = Array.new(devices.length)
+    threads = [concurrency, devices.length].min.times.map {
+      Thread.new {
+        while i = queue.pop
+          result[i] = USB.probe_device(devices[i], timeout)
+        end
+      }
+    }
+    threads.each {|t| t.join }
+    result
+  end
+
+  def USB.probe_device(dev, timeout) # :nodoc:
+    info = { :device => dev }
+    begin
+      desc = dev.descriptor
+      info[:bus] = dev.bus.dirname
+      info[:filename] = dev.filename
+      info[:port_path] = dev.respond_to?(:port_path) ? dev.port_path : nil
+      info[:descriptor] = desc
+      strings, drivers, errno = dev.usb_probe(timeout)
+      info[:manufacturer] = strings[desc.iManufacturer] && strings[desc.iManufacturer].strip
+      info[:product] = strings[desc.iProduct] && strings[desc.iProduct].strip
+      info[:serial_number] = strings[desc.iSerialNumber] && strings[desc.iSerialNumber].strip
+      info[:drivers] = drivers
+      info[:error] = errno && SystemCallError.new("usb_probe", errno)
+    rescue StandardError => e
+      info[:error] = e
     end
-    return nil
+    info
   end
 
   # searches devices by USB device class, subclass and protocol.
@@ -100,23 +176,218 @@ module USB
   #   # find Hi-speed Hubs with multiple TT
   #   USB.each_device_by_class(USB::USB_CLASS_HUB, 0, 2) {|d| p d }'
   #
+  # The devices are yielded in the order of USB.devices.
   def USB.each_device_by_class(devclass, subclass=nil, protocol=nil)
-    USB.devices.each {|dev|
-      if dev.bDeviceClass == USB::USB_CLASS_PER_INTERFACE
-        found = dev.settings.any? {|s|
-                  s.bInterfaceClass == devclass &&
-                  (!subclass || s.bInterfaceSubClass == subclass) &&
-                  (!protocol || s.bInterfaceProtocol == protocol) }
-      else
-        found = dev.bDeviceClass == devclass &&
-                (!subclass || dev.bDeviceSubClass == subclass) &&
-                (!protocol || dev.bDeviceProtocol == protocol)
-      end
-      yield dev if found
+    if !subclass
+      devs = USB.usb_lookup(:class, devclass)
+    elsif !protocol
+      devs = USB.usb_lookup(:class, 0x10000 | (devclass << 8) | subclass)
+    else
+      devs = USB.usb_lookup(:class, 0x1000000 | (devclass << 16) | (subclass << 8) | protocol)
+    end
+    return nil unless devs
+    if protocol && !subclass
+      devs = devs.select {|dev|
+        if dev.bDeviceClass == USB::USB_CLASS_PER_INTERFACE
+          dev.settings.any? {|s|
+            s.bInterfaceClass == devclass && s.bInterfaceProtocol == protocol }
+        else
+          dev.bDeviceProtocol == protocol
+        end
+      }
+    end
+    devs.each {|dev| yield dev }
+    nil
+  end
+
+  # handles libusb-1.0 events at most _timeout_ seconds
+  # and finishes the transfers completed meanwhile.
+  # The default zero _timeout_ only handles the events already occurred.
+  #
+  # Transfer#submit starts a thread calling this while transfers are pending,
+  # unless USB.event_thread is set false.
+  # It is not available with libusb-0.1.
+  def USB.handle_events(timeout: 0)
+    USB.usb_handle_events(timeout).each {|t, actual_length, errno, iso|
+      t.native_complete(actual_length, errno, iso)
     }
+    USB.dispatch_hotplug if USB.respond_to?(:usb_hotplug_events)
     nil
   end
 
+  def USB.dispatch_hotplug # :nodoc:
+    USB.usb_hotplug_events.each {|id, event, dev|
+      callback = HOTPLUG_LOCK.synchronize { @hotplug_callbacks[id] }
+      callback[1].call(event, dev) if callback
+    }
+  end
+
+  HOTPLUG_LOCK = Mutex.new # :nodoc:
+  @hotplug_callbacks = {}
+  @hotplug_serial = 0
+
+  # calls the block with :arrived or :left and the USB::Device
+  # when a device matching _vendor_, _product_ and _class_ is attached or detached.
+  # nil matches any.
+  # If _enumerate_ is true, the devices already attached are reported as :arrived first.
+  #
+  #   USB.on_hotplug(vendor: 0x0925) {|event, dev|
+  #     p [event, dev]
+  #   }
+  #
+  # The device list is updated without revoking objects,
+  # so USB::Device objects in hand stay valid.
+  # A device detached is valid until the next USB.find_busses or USB.rescan.
+  #
+  # The block is called by USB.handle_events, in the event thread by default.
+  # The devices enumerated are reported before USB.on_hotplug returns.
+  # It returns an id for USB.remove_hotplug.
+  # Hotplug needs libusb-1.0.
+  def USB.on_hotplug(vendor: nil, product: nil, class: nil, enumerate: false, &block)
+    raise ArgumentError, "no block given" unless block
+    unless USB.respond_to?(:usb_hotplug_register)
+      raise NotImplementedError, "hotplug is not supported by #{USB::BACKEND}"
+    end
+    devclass = binding.local_variable_get(:class)
+    id = HOTPLUG_LOCK.synchronize {
+      id = @hotplug_serial += 1
+      handle = USB.usb_hotplug_register(id, vendor || -1, product || -1, devclass || -1, enumerate)
+      @hotplug_callbacks[id] = [handle, block]
+      id
+    }
+    USB.hold_events
+    USB.dispatch_hotplug if enumerate
+    id
+  end
+
+  # removes the hotplug callback registered by USB.on_hotplug.
+  def USB.remove_hotplug(id)
+    handle, = HOTPLUG_LOCK.synchronize { @hotplug_callbacks.delete(id) }
+    return nil unless handle
+    USB.usb_hotplug_deregister(handle)
+    USB.release_events
+    nil
+  end
+
+  # returns the file descriptors to watch for USB.handle_events,
+  # as [[io, interest], ...].
+  # _interest_ is :r, :w or :rw.
+  # The IO objects don't close the descriptors, which libusb owns.
+  #
+  # An application with its own event loop can handle libusb events
+  # without the event thread:
+  #
+  #   USB.event_thread = false
+  #   selector = NIO::Selector.new
+  #   USB.pollfds.each {|io, interest| selector.register(io, interest) }
+  #   loop {
+  #     selector.select(USB.next_timeout) { ... }
+  #     USB.handle_events(timeout: 0)
+  #   }
+  #
+  # The descriptors may change when a device is opened or closed.
+  def USB.pollfds
+    POLLFD_LOCK.synchronize {
+      USB.usb_pollfds.map {|fd, interest|
+        io = @pollfd_ios[fd] ||= IO.for_fd(fd, autoclose: false)
+        [io, interest]
+      }
+    }
+  end
+
+  # returns the seconds until USB.handle_events should be called for a
+  # timeout of libusb, or nil if none is pending.
+  def USB.next_timeout
+    USB.usb_next_timeout
+  end
+
+  # returns the deadline _seconds_ from now, for the deadline: arguments.
+  #
+  #   deadline = USB.deadline(0.5)
+  #   h.bulk_read(0x81, header, deadline: deadline)
+  #   h.bulk_read(0x81, body, deadline: deadline)
+  #
+  # A deadline is the seconds of Process::CLOCK_MONOTONIC,
+  # so that it doesn't move with the wall clock.
+  # A Time is accepted as a deadline too.
+  def USB.deadline(seconds)
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+  end
+
+  # returns the timeout in milliseconds, at least 1, until _deadline_.
+  # It raises Errno::ETIMEDOUT if _deadline_ is passed.
+  def USB.deadline_timeout(deadline) # :nodoc:
+    if deadline.is_a? Time
+      rest = deadline - Time.now
+    else
+      rest = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+    raise Errno::ETIMEDOUT, "deadline passed" if rest <= 0
+    (rest * 1000).ceil.clamp(1, 0x7fffffff)
+  end
+
+  # true in a non-blocking fiber run by a Fiber.scheduler.
+  def USB.nonblocking_fiber? # :nodoc:
+    Fiber.respond_to?(:scheduler) && Fiber.scheduler && !Fiber.current.blocking?
+  end
+
+  POLLFD_LOCK = Mutex.new # :nodoc:
+  @pollfd_ios = {}
+
+  EVENT_THREAD_LOCK = Mutex.new # :nodoc:
+  @event_thread = nil
+  @event_thread_enabled = true
+  @event_holders = 0
+
+  # whether Transfer#submit starts a thread handling libusb-1.0 events.
+  # Set false when the application calls USB.handle_events by itself.
+  def USB.event_thread?
+    EVENT_THREAD_LOCK.synchronize { @event_thread_enabled }
+  end
+
+  def USB.event_thread=(enabled)
+    EVENT_THREAD_LOCK.synchronize {
+      @event_thread_enabled = enabled
+      if enabled && 0 < @event_holders
+        @event_thread ||= Thread.new { USB.event_thread_loop }
+      end
+    }
+  end
+
+  # runs a thread handling events while native transfers are pending
+  # or hotplug callbacks are registered.
+  def USB.hold_events # :nodoc:
+    EVENT_THREAD_LOCK.synchronize {
+      @event_holders += 1
+      if @event_thread_enabled
+        @event_thread ||= Thread.new { USB.event_thread_loop }
+      end
+    }
+  end
+
+  def USB.release_events # :nodoc:
+    EVENT_THREAD_LOCK.synchronize { @event_holders -= 1 }
+  end
+
+  def USB.event_thread_loop # :nodoc:
+    while true
+      begin
+        USB.handle_events(timeout: 1)
+      rescue StandardError => e
+        warn "USB event thread: #{e.class}: #{e.message}"
+      end
+      EVENT_THREAD_LOCK.synchronize {
+        if @event_holders == 0 || !@event_thread_enabled
+          @event_thread = nil
+          return
+        end
+      }
+    end
+  rescue Exception
+    EVENT_THREAD_LOCK.synchronize { @event_thread = nil }
+    raise
+  end
+
   class Bus
     def inspect
       if self.revoked?
@@ -126,28 +397,21 @@ module USB
       end
     end
 
-    def devices
-      result = []
-      device = self.first_device
-      while device
-        result << device
-        device = device.next
-      end
-      result.sort_by {|d| d.filename }
-    end
+    def devices() USB.usb_enumerate(self, :devices) end
+    def configurations() USB.usb_enumerate(self, :configurations) end
+    def interfaces() USB.usb_enumerate(self, :interfaces) end
+    def settings() USB.usb_enumerate(self, :settings) end
+    def endpoints() USB.usb_enumerate(self, :endpoints) end
 
-    def configurations() self.devices.map {|d| d.configurations }.flatten end
-    def interfaces() self.configurations.map {|d| d.interfaces }.flatten end
-    def settings() self.interfaces.map {|d| d.settings }.flatten end
-    def endpoints() self.settings.map {|d| d.endpoints }.flatten end
+    def each_device(&b) b ? USB.usb_enumerate(self, :devices, &b) : enum_for(:each_device) end
+    def each_configuration(&b) b ? USB.usb_enumerate(self, :configurations, &b) : enum_for(:each_configuration) end
+    def each_interface(&b) b ? USB.usb_enumerate(self, :interfaces, &b) : enum_for(:each_interface) end
+    def each_setting(&b) b ? USB.usb_enumerate(self, :settings, &b) : enum_for(:each_setting) end
+    def each_endpoint(&b) b ? USB.usb_enumerate(self, :endpoints, &b) : enum_for(:each_endpoint) end
 
     def find_device(n)
-      device = self.first_device
-      while device
-        return device if n == device.filename.to_i
-        device = device.next
-      end
-      return nil
+      return nil unless Integer === n && 0 <= n && n <= 0xffff
+      USB.usb_lookup(:device, (self.dirname.to_i << 16) | n)
     end
   end
 
@@ -225,6 +489,9 @@ module USB
   # :startdoc:
 
   class Device
+    # returns all descriptor fields as a Hash, copied by one call of #descriptor.
+    def to_h() self.descriptor.to_h end
+
     def inspect
       if self.revoked?
         "\#<#{self.class} revoked>"
@@ -248,25 +515,30 @@ module USB
       end
     end
 
+    # returns the string descriptor _index_ as an UTF-8 String, or nil.
+    # _langid_ is the first language of the device by default.
+    #
+    # The strings are cached by device identity, across USB.find_busses
+    # and USB.rescan, until USB.clear_string_cache.
+    # At the first miss, all strings referred by the descriptors of the
+    # device are read with one open, each request within _timeout_ milliseconds.
+    def string(index, langid=nil, timeout: 1000)
+      self.usb_string(index, langid || 0, timeout)
+    end
+
     def manufacturer
-      return @manufacturer if defined? @manufacturer
-      @manufacturer = self.open {|h| h.get_string_simple(self.iManufacturer) }
-      @manufacturer.strip! if @manufacturer
-      @manufacturer
+      s = self.string(self.iManufacturer)
+      s && s.strip
     end
 
     def product
-      return @product if defined? @product
-      @product = self.open {|h| h.get_string_simple(self.iProduct) }
-      @product.strip! if @product
-      @product
+      s = self.string(self.iProduct)
+      s && s.strip
     end
 
     def serial_number
-      return @serial_number if defined? @serial_number
-      @serial_number = self.open {|h| h.get_string_simple(self.iSerialNumber) }
-      @serial_number.strip! if @serial_number
-      @serial_number
+      s = self.string(self.iSerialNumber)
+      s && s.strip
     end
 
     def open
@@ -282,12 +554,20 @@ module USB
       end
     end
 
-    def interfaces() self.configurations.map {|d| d.interfaces }.flatten end
-    def settings() self.interfaces.map {|d| d.settings }.flatten end
-    def endpoints() self.settings.map {|d| d.endpoints }.flatten end
+    def interfaces() USB.usb_enumerate(self, :interfaces) end
+    def settings() USB.usb_enumerate(self, :settings) end
+    def endpoints() USB.usb_enumerate(self, :endpoints) end
+
+    def each_configuration(&b) b ? USB.usb_enumerate(self, :configurations, &b) : enum_for(:each_configuration) end
+    def each_interface(&b) b ? USB.usb_enumerate(self, :interfaces, &b) : enum_for(:each_interface) end
+    def each_setting(&b) b ? USB.usb_enumerate(self, :settings, &b) : enum_for(:each_setting) end
+    def each_endpoint(&b) b ? USB.usb_enumerate(self, :endpoints, &b) : enum_for(:each_endpoint) end
   end
 
   class Configuration
+    # returns all descriptor fields as a Hash, copied by one call of #descriptor.
+    def to_h() self.descriptor.to_h end
+
     def inspect
       if self.revoked?
         "\#<#{self.class} revoked>"
@@ -304,14 +584,17 @@ module USB
     end
 
     def description
-      return @description if defined? @description
-      @description = self.device.open {|h| h.get_string_simple(self.iConfiguration) }
+      self.device.string(self.iConfiguration)
     end
 
     def bus() self.device.bus end
 
-    def settings() self.interfaces.map {|d| d.settings }.flatten end
-    def endpoints() self.settings.map {|d| d.endpoints }.flatten end
+    def settings() USB.usb_enumerate(self, :settings) end
+    def endpoints() USB.usb_enumerate(self, :endpoints) end
+
+    def each_interface(&b) b ? USB.usb_enumerate(self, :interfaces, &b) : enum_for(:each_interface) end
+    def each_setting(&b) b ? USB.usb_enumerate(self, :settings, &b) : enum_for(:each_setting) end
+    def each_endpoint(&b) b ? USB.usb_enumerate(self, :endpoints, &b) : enum_for(:each_endpoint) end
   end
 
   class Interface
@@ -326,10 +609,16 @@ module USB
     def bus() self.configuration.device.bus end
     def device() self.configuration.device end
 
-    def endpoints() self.settings.map {|d| d.endpoints }.flatten end
+    def endpoints() USB.usb_enumerate(self, :endpoints) end
+
+    def each_setting(&b) b ? USB.usb_enumerate(self, :settings, &b) : enum_for(:each_setting) end
+    def each_endpoint(&b) b ? USB.usb_enumerate(self, :endpoints, &b) : enum_for(:each_endpoint) end
   end
 
   class Setting
+    # returns all descriptor fields as a Hash, copied by one call of #descriptor.
+    def to_h() self.descriptor.to_h end
+
     def inspect
       if self.revoked?
         "\#<#{self.class} revoked>"
@@ -345,16 +634,20 @@ module USB
     end
 
     def description
-      return @description if defined? @description
-      @description = self.device.open {|h| h.get_string_simple(self.iInterface) }
+      self.device.string(self.iInterface)
     end
 
     def bus() self.interface.configuration.device.bus end
     def device() self.interface.configuration.device end
     def configuration() self.interface.configuration end
+
+    def each_endpoint(&b) b ? USB.usb_enumerate(self, :endpoints, &b) : enum_for(:each_endpoint) end
   end
 
   class Endpoint
+    # returns all descriptor fields as a Hash, copied by one call of #descriptor.
+    def to_h() self.descriptor.to_h end
+
     def inspect
       if self.revoked?
         "\#<#{self.class} revoked>"
@@ -380,7 +673,9 @@ module USB
     def interface() self.setting.interface end
   end
 
-  class DevHandle
+  # The methods of USB::DevHandle written on its usb_* methods,
+  # also included by USB::Replay, which serves a recorded session.
+  module DevHandleMethods
     def set_configuration(configuration)
       configuration = configuration.bConfigurationValue if configuration.respond_to? :bConfigurationValue
       self.usb_set_configuration(configuration)
@@ -416,5 +711,905 @@ module USB
       result.delete!("\0")
       result
     end
+
+    # reads bulk endpoint _ep_ into _buffer_ at _offset_ without allocating.
+    #
+    # _buffer_ is a String or an IO::Buffer.
+    # At most _length_ bytes are read, up to the capacity of a String or
+    # the end of an IO::Buffer by default.
+    # A String is resized to _offset_ + the number of bytes read.
+    # It returns the number of bytes read.
+    #
+    #   buf = String.new(capacity: 64)
+    #   loop { n = h.bulk_read(0x81, buf, timeout: 1000); ... }
+    #
+    # _deadline_ is an absolute limit instead of _timeout_, see USB.deadline.
+    # Errno::ETIMEDOUT is raised when it is passed, before reading if already.
+    #
+    # In a non-blocking fiber with Fiber.scheduler,
+    # the read is submitted as a Transfer and the fiber waits its completion,
+    # so other fibers run meanwhile.
+    #
+    # A read waits its timeout, forever by default,
+    # and a reader thread can't be stopped sooner in general.
+    # A read to be stopped by another thread is a Transfer instead:
+    #
+    #   t = h.submit_bulk(0x81, buf)
+    #   n = t.result        # raises Errno::ECANCELED when cancelled
+    #
+    #   t.cancel            # or h.cancel_transfers, in another thread
+    def bulk_read(ep, buffer, offset=0, length=nil, timeout: 0, deadline: nil)
+      ep = ep.bEndpointAddress if ep.respond_to? :bEndpointAddress
+      timeout = USB.deadline_timeout(deadline) if deadline
+      if USB.nonblocking_fiber?
+        read_transfer(:bulk, ep, buffer, offset, length, timeout)
+      else
+        self.bulk_read_into(ep, buffer, timeout, offset, length)
+      end
+    end
+
+    # reads interrupt endpoint _ep_ into _buffer_.  See bulk_read.
+    def interrupt_read(ep, buffer, offset=0, length=nil, timeout: 0, deadline: nil)
+      ep = ep.bEndpointAddress if ep.respond_to? :bEndpointAddress
+      timeout = USB.deadline_timeout(deadline) if deadline
+      if USB.nonblocking_fiber?
+        read_transfer(:interrupt, ep, buffer, offset, length, timeout)
+      else
+        self.interrupt_read_into(ep, buffer, timeout, offset, length)
+      end
+    end
+
+    # the transfer is cancelled if the fiber is interrupted while waiting,
+    # as the fiber doesn't reap it.
+    def read_transfer(type, ep, buffer, offset, length, timeout) # :nodoc:
+      t = Transfer.new(self, type, ep, buffer, timeout)
+      t.offset = offset
+      t.length = length
+      t.reapable = false
+      t.submit
+      begin
+        t.result
+      ensure
+        t.cancel if t.pending?
+      end
+    end
+
+    # submits a bulk transfer on endpoint _ep_ and returns a USB::Transfer
+    # without waiting for its completion.
+    # The transfer reads into _buffer_ if _ep_ is an IN endpoint
+    # and writes _buffer_ otherwise.
+    #
+    # _stream_id_ puts the transfer on a bulk stream allocated by alloc_streams.
+    # _deadline_ replaces _timeout_, see Transfer#deadline.
+    def submit_bulk(ep, buffer, timeout=0, stream_id: nil, deadline: nil)
+      ep = ep.bEndpointAddress if ep.respond_to? :bEndpointAddress
+      t = Transfer.new(self, :bulk, ep, buffer, timeout)
+      t.stream_id = stream_id
+      t.deadline = deadline
+      t.submit
+    end
+
+    # submits an interrupt transfer.  See submit_bulk.
+    def submit_interrupt(ep, buffer, timeout=0, deadline: nil)
+      ep = ep.bEndpointAddress if ep.respond_to? :bEndpointAddress
+      t = Transfer.new(self, :interrupt, ep, buffer, timeout)
+      t.deadline = deadline
+      t.submit
+    end
+
+    # submits a control transfer.  The arguments are same as usb_control_msg.
+    def submit_control(requesttype, request, value, index, buffer, timeout=0, deadline: nil)
+      t = Transfer.new(self, :control, 0, buffer, timeout)
+      t.setup(requesttype, request, value, index)
+      t.deadline = deadline
+      t.submit
+    end
+
+    # submits an isochronous transfer on endpoint _ep_.
+    #
+    # _packets_ is the number of packets or an array of packet lengths.
+    # A number of packets divides _buffer_ evenly.
+    # Each packet is reported by Transfer#iso_packets after the completion.
+    #
+    #   mps = ep.wMaxPacketSize
+    #   8.times { h.submit_iso(ep, "\0" * (mps * 32), 32) }
+    #   while t = h.reap
+    #     t.each_iso_packet {|pkt, data| out << data if pkt.status == 0 }
+    #     t.submit
+    #   end
+    #
+    # Isochronous transfers need libusb-1.0.
+    # libusb-0.1 has no asynchronous transfers,
+    # so Transfer#submit raises NotImplementedError with it.
+    def submit_iso(ep, buffer, packets, timeout=0)
+      ep = ep.bEndpointAddress if ep.respond_to? :bEndpointAddress
+      t = Transfer.new(self, :isochronous, ep, buffer, timeout)
+      t.iso_setup(packets)
+      t.submit
+    end
+
+    # reads bulk endpoint _ep_ continuously.
+    #
+    # It keeps _depth_ reads of _buffer_size_ bytes in flight
+    # and yields each received chunk in order,
+    # or writes it to _io_ if given.
+    # It returns when the block breaks and raises if a read fails.
+    #
+    #   File.open("adc.raw", "wb") {|f|
+    #     h.bulk_stream(0x82, f, buffer_size: 65536, depth: 8)
+    #   }
+    #
+    # The buffers are reused: each chunk is yielded as the buffer itself,
+    # which is valid only in the block.
+    #
+    # With libusb-1.0, the reads are submitted transfers completed in order.
+    # Otherwise a reader thread reads into up to _depth_ buffers ahead,
+    # one read after another, so that the chunks keep the order of the bytes.
+    # The reads still in flight are cancelled when the method returns.
+    def bulk_stream(ep, io=nil, buffer_size: 16384, depth: 4, timeout: 0, &block)
+      ep = ep.bEndpointAddress if ep.respond_to? :bEndpointAddress
+      raise ArgumentError, "no block or IO given" if !io && !block
+      raise ArgumentError, "depth must be positive" if depth < 1
+      block ||= lambda {|chunk| io.write chunk }
+      if respond_to?(:usb_submit)
+        bulk_stream_transfers(ep, buffer_size, depth, timeout, block)
+      else
+        bulk_stream_thread(ep, buffer_size, depth, timeout, block)
+      end
+    end
+
+    def bulk_stream_transfers(ep, buffer_size, depth, timeout, block) # :nodoc:
+      ring = Array.new(depth) {
+        Transfer.new(self, :bulk, ep, "\0" * buffer_size, timeout)
+      }
+      begin
+        ring.each {|t| t.submit }
+        i = 0
+        while true
+          t = ring[i]
+          t.result
+          block.call t.buffer
+          t.submit
+          i = (i + 1) % depth
+        end
+      ensure
+        ring.each {|t| t.cancel }
+        ring.each {|t| t.wait }
+      end
+    end
+
+    # the reader thread gets the free buffers from _free_
+    # and passes them filled, or the exception of a read, to _full_.
+    def bulk_stream_thread(ep, buffer_size, depth, timeout, block) # :nodoc:
+      free = Queue.new
+      full = Queue.new
+      depth.times { free << String.new(capacity: buffer_size) }
+      reader = Thread.new {
+        begin
+          while buf = free.pop
+            self.bulk_read_into(ep, buf, timeout, 0, buffer_size)
+            full << buf
+          end
+        rescue StandardError => e
+          full << e
+        end
+      }
+      begin
+        while true
+          buf = full.pop
+          raise buf if buf.is_a? Exception
+          block.call buf
+          free << buf
+        end
+      ensure
+        free.close
+        reader.kill
+        reader.join
+      end
+    end
+
+    # allocates _num_ bulk streams on each of _endpoints_ of a USB 3.0 device.
+    # It returns the number of streams allocated,
+    # numbered from 1 for Transfer#stream_id.
+    # It needs libusb-1.0.
+    def alloc_streams(num, endpoints)
+      eps = endpoints.map {|ep| ep.respond_to?(:bEndpointAddress) ? ep.bEndpointAddress : ep }
+      self.usb_alloc_streams(num, eps)
+    end
+
+    # frees the bulk streams of _endpoints_.
+    def free_streams(endpoints)
+      eps = endpoints.map {|ep| ep.respond_to?(:bEndpointAddress) ? ep.bEndpointAddress : ep }
+      self.usb_free_streams(eps)
+    end
+
+    # returns a completed transfer submitted on this handle.
+    # Transfers are returned in the order of their completion.
+    #
+    # It waits at most _timeout_ seconds, forever if _timeout_ is nil.
+    # It returns nil if no transfer completes in time or no transfer is pending.
+    def reap(timeout=nil)
+      transfer_queue.reap(timeout)
+    end
+
+    # returns the number of submitted transfers which are not reaped yet.
+    def pending_transfers
+      transfer_queue.size
+    end
+
+    # cancels the pending transfers of this handle, such as the reads of
+    # reader threads to be stopped.  See Transfer#cancel.
+    # It returns the number of transfers asked to cancel.
+    def cancel_transfers
+      transfer_queue.pending.count {|t| t.cancel }
+    end
+
+    # starts tracing the transfers of this handle in memory,
+    # keeping the last _records_ transfers with their first _snaplen_ bytes.
+    # A previous trace is discarded.
+    #
+    # With a block, the transfers of the block are traced
+    # and the USB::Trace is returned.
+    #
+    #   trace = h.trace_start(snaplen: 16) { h.bulk_read(0x81, buf) }
+    #   File.open("usb.pcapng", "wb") {|f| trace.write_pcapng(f) }
+    #
+    # A transfer not traced costs a test of the trace.
+    def trace_start(records: 4096, snaplen: 64)
+      self.usb_trace_start(records, snaplen)
+      return self unless block_given?
+      begin
+        yield
+      ensure
+        self.usb_trace_stop
+      end
+      self.trace
+    end
+
+    # stops tracing and returns the USB::Trace.
+    def trace_stop
+      self.usb_trace_stop
+      self.trace
+    end
+
+    # returns the USB::Trace of the transfers traced so far.
+    def trace
+      USB::Trace.new(*self.usb_trace_records)
+    end
+
+    TRANSFER_QUEUE_LOCK = Mutex.new # :nodoc:
+
+    def transfer_queue # :nodoc:
+      TRANSFER_QUEUE_LOCK.synchronize { @transfer_queue ||= TransferQueue.new }
+    end
+
+    def transfer_carrier(ep) # :nodoc:
+      TRANSFER_QUEUE_LOCK.synchronize {
+        (@transfer_carriers ||= {})[ep] ||= TransferCarrier.new
+      }
+    end
+  end
+
+  class DevHandle
+    include DevHandleMethods
+  end
+
+  # USB::Transfer is a transfer submitted without waiting for its completion.
+  # Several transfers can be pending on one endpoint at a time
+  # so that the endpoint is not idle between transfers.
+  #
+  #   h.claim_interface(0)
+  #   4.times { h.submit_bulk(0x81, "\0" * 4096, 1000) }
+  #   while t = h.reap
+  #     p t.result
+  #     t.submit
+  #   end
+  #
+  # With libusb-1.0, a transfer is submitted to libusb asynchronously
+  # and finished by a thread handling libusb events.
+  # libusb-0.1 has only synchronous transfers.
+  # So the pending transfers of an endpoint are carried one at a time,
+  # in the order of their submission, by a Ruby thread which waits in libusb
+  # without the GVL.
+  class Transfer
+    TYPES = { # :nodoc:
+      :control => USB::USB_ENDPOINT_TYPE_CONTROL,
+      :isochronous => USB::USB_ENDPOINT_TYPE_ISOCHRONOUS,
+      :bulk => USB::USB_ENDPOINT_TYPE_BULK,
+      :interrupt => USB::USB_ENDPOINT_TYPE_INTERRUPT,
+    }
+
+    # a packet of an isochronous transfer.
+    # _actual_length_ and _status_ (0 or an errno) are set by the completion.
+    IsoPacket = Struct.new(:length, :actual_length, :status)
+
+    def initialize(devhandle, type, endpoint, buffer, timeout=0)
+      @devhandle = devhandle
+      @type = type
+      @endpoint = endpoint
+      @buffer = buffer
+      @offset = 0
+      @length = buffer.respond_to?(:bytesize) ? buffer.bytesize : buffer.size
+      @timeout = timeout
+      @reapable = true
+      @status = nil
+      @actual_length = nil
+      @error = nil
+    end
+
+    attr_reader :devhandle, :type, :endpoint, :timeout
+    attr_reader :requesttype, :request, :value, :index
+
+    # the buffer read into or written from.
+    # A String read into by a bulk or interrupt transfer
+    # is resized to the number of bytes received.
+    attr_accessor :buffer
+
+    # the offset of the data in the buffer, 0 by default.
+    attr_accessor :offset
+
+    # the maximum number of bytes to transfer.
+    # It is the initial size of the buffer by default.
+    # nil is the rest of the buffer after the offset,
+    # up to the capacity of a String read into.
+    attr_accessor :length
+
+    attr_writer :reapable # :nodoc:
+
+    # false for a transfer internal to a blocking call,
+    # which DevHandle#reap doesn't return.
+    def reapable?() @reapable end # :nodoc:
+
+    # nil (not submitted yet), :pending, :completed, :timed_out, :cancelled or :error.
+    attr_reader :status
+
+    # the number of bytes transferred, nil unless completed.
+    attr_reader :actual_length
+
+    # the exception raised by the transfer, nil unless failed.
+    attr_reader :error
+
+    def setup(requesttype, request, value, index) # :nodoc:
+      @requesttype = requesttype
+      @request = request
+      @value = value
+      @index = index
+    end
+
+    # the bulk stream of the transfer, nil for none.  See DevHandle#alloc_streams.
+    attr_accessor :stream_id
+
+    # the deadline of the transfer, nil for none.  See USB.deadline.
+    # #submit replaces the timeout by the time left until the deadline
+    # and raises Errno::ETIMEDOUT if it is passed.
+    attr_accessor :deadline
+
+    # the array of IsoPacket of an isochronous transfer.
+    attr_reader :iso_packets
+
+    def iso_setup(packets) # :nodoc:
+      if packets.respond_to? :to_ary
+        lengths = packets.to_ary
+      else
+        raise ArgumentError, "no packets" if packets < 1
+        lengths = [@length / packets] * packets
+      end
+      if @length < lengths.inject(0) {|s, n| s + n }
+        raise ArgumentError, "packets exceed the buffer"
+      end
+      @iso_packets = lengths.map {|n| IsoPacket.new(n, nil, nil) }
+    end
+
+    # yields each packet of an isochronous transfer and its data in the buffer.
+    def each_iso_packet
+      offset = 0
+      @iso_packets.each {|pkt|
+        yield pkt, @buffer.byteslice(offset, pkt.actual_length || 0)
+        offset += pkt.length
+      }
+    end
+
+    def in?
+      if @type == :control
+        (@requesttype & USB::USB_ENDPOINT_DIR_MASK) == USB::USB_ENDPOINT_IN
+      else
+        (@endpoint & USB::USB_ENDPOINT_DIR_MASK) == USB::USB_ENDPOINT_IN
+      end
+    end
+
+    def pending?() @status == :pending end
+    def completed?() @status == :completed end
+
+    # submits the transfer.  A reaped transfer can be submitted again.
+    def submit
+      raise ArgumentError, "transfer already pending" if @status == :pending
+      native = @devhandle.respond_to?(:usb_submit)
+      if !native && @type == :isochronous
+        raise NotImplementedError, "isochronous transfers are not supported by libusb-0.1"
+      end
+      if !native && @stream_id
+        raise NotImplementedError, "bulk streams are not supported by libusb-0.1"
+      end
+      @timeout = USB.deadline_timeout(@deadline) if @deadline
+      @status = :pending
+      @actual_length = nil
+      @error = nil
+      queue = @devhandle.transfer_queue
+      queue.submitted(self)
+      if native
+        submit_native(queue)
+      else
+        @devhandle.transfer_carrier(@endpoint).push(self)
+      end
+      self
+    end
+
+    Cancel = Class.new(Exception) # :nodoc:
+
+    # cancels the pending transfer, which completes as :cancelled
+    # with Errno::ECANCELED as its error.
+    # It returns true if the transfer was pending, false otherwise.
+    # A transfer completing meanwhile completes as usual.
+    #
+    # With libusb-1.0, libusb cancels the transfer on the device.
+    # Otherwise, a transfer queued behind others of its endpoint completes
+    # at once, and the thread carrying the transfer is interrupted:
+    # libusb-0.1 still waits the timeout of the transfer in the kernel,
+    # while the emulator and USB::Replay stop at once.
+    def cancel
+      return false unless @status == :pending
+      if @devhandle.respond_to?(:usb_cancel)
+        @devhandle.usb_cancel(self)
+      else
+        @devhandle.transfer_carrier(@endpoint).cancel(self)
+      end
+    end
+
+    # waits the completion of the transfer at most _timeout_ seconds.
+    # It returns self if the transfer is finished, nil otherwise.
+    # A waited transfer is not returned by DevHandle#reap.
+    def wait(timeout=nil)
+      return nil if @status.nil?
+      return nil unless @devhandle.transfer_queue.wait(self, timeout)
+      self
+    end
+
+    # waits the transfer and returns the number of bytes transferred.
+    # It raises the error of the transfer if failed.
+    def result
+      wait
+      raise @error if @error
+      @actual_length
+    end
+
+    def inspect
+      "\#<#{self.class} #{@type} #{'%02x' % @endpoint} #{@status || 'idle'}>"
+    end
+
+    def native_complete(actual_length, errno, iso) # :nodoc:
+      if iso
+        iso.each_with_index {|(n, e), i|
+          @iso_packets[i].actual_length = n
+          @iso_packets[i].status = e || 0
+        }
+      end
+      if !errno
+        @actual_length = actual_length
+        @status = :completed
+      else
+        @error = SystemCallError.new("usb_submit", errno)
+        @status = case @error
+                  when Errno::ETIMEDOUT then :timed_out
+                  when Errno::ECANCELED then :cancelled
+                  else :error
+                  end
+      end
+    ensure
+      USB.release_events
+      @devhandle.transfer_queue.completed(self)
+    end
+
+    # carries the transfer in the thread of its TransferCarrier.
+    def run # :nodoc:
+      @timeout = USB.deadline_timeout(@deadline) if @deadline
+      @actual_length = Thread.handle_interrupt(Cancel => :immediate) { carry }
+      @status = :completed
+    rescue Cancel
+      cancelled
+    rescue Errno::ETIMEDOUT => e
+      @error = e
+      @status = :timed_out
+    rescue StandardError => e
+      @error = e
+      @status = :error
+    ensure
+      @devhandle.transfer_queue.completed(self) unless @status == :cancelled
+    end
+
+    # completes the transfer cancelled before or while carried.
+    def cancelled # :nodoc:
+      @error = Errno::ECANCELED.new("usb transfer")
+      @status = :cancelled
+      @devhandle.transfer_queue.completed(self)
+    end
+
+    private
+
+    def submit_native(queue)
+      setup = [@requesttype, @request, @value, @index] if @type == :control
+      iso = @iso_packets.map {|pkt| pkt.length } if @type == :isochronous
+      type = TYPES.fetch(@type) {
+        raise ArgumentError, "unexpected transfer type: #{@type.inspect}"
+      }
+      @devhandle.usb_submit(self, type, @endpoint, @buffer, @offset, @length, @timeout,
+                            setup, iso, @stream_id)
+      USB.hold_events
+    rescue Exception
+      @status = nil
+      queue.withdrawn(self)
+      raise
+    end
+
+    def carry
+      h = @devhandle
+      case @type
+      when :control
+        h.usb_control_msg(@requesttype, @request, @value, @index, @buffer, @timeout)
+      when :bulk
+        in? ? h.bulk_read_into(@endpoint, @buffer, @timeout, @offset, @length) :
+              h.usb_bulk_write(@endpoint, out_data, @timeout)
+      when :interrupt
+        in? ? h.interrupt_read_into(@endpoint, @buffer, @timeout, @offset, @length) :
+              h.usb_interrupt_write(@endpoint, out_data, @timeout)
+      else
+        raise ArgumentError, "unexpected transfer type: #{@type.inspect}"
+      end
+    end
+
+    def out_data
+      if @offset == 0 && (@length.nil? || @length == @buffer.bytesize)
+        @buffer
+      else
+        @buffer.byteslice(@offset, @length || @buffer.bytesize - @offset)
+      end
+    end
   end
+
+  # A pool of DevHandles kept opened with interfaces claimed,
+  # to save opening the device and claiming the interfaces per request.
+  #
+  #   pool = USB::HandlePool.new(interfaces: [0])
+  #   pool.with(dev) {|h| h.usb_control_msg(0xc0, 1, 0, 0, buf, 1000) }
+  #
+  # A handle is used by one thread at a time:
+  # #checkout waits while _max_per_device_ handles of the device are checked out.
+  # As an interface is claimed by one handle only, the default is one
+  # handle per device.
+  #
+  # Handles idle for _idle_timeout_ seconds and handles of revoked devices,
+  # detached and removed by USB.rescan or USB.find_busses,
+  # are closed at the next #checkout, #checkin or #evict.
+  class HandlePool
+    Entry = Struct.new(:device, :handle, :used_at) # :nodoc:
+
+    def initialize(interfaces: [], configuration: nil, max_per_device: 1, idle_timeout: 60)
+      @interfaces = interfaces
+      @configuration = configuration
+      @max_per_device = max_per_device
+      @idle_timeout = idle_timeout
+      @mutex = Mutex.new
+      @cond = ConditionVariable.new
+      @idle = {}.compare_by_identity            # device => [Entry, ...]
+      @opened = Hash.new(0).compare_by_identity # device => number of handles
+      @busy = {}.compare_by_identity            # handle => Entry
+      @closed = false
+    end
+
+    # returns the number of handles opened, idle or checked out.
+    def size
+      @mutex.synchronize { @opened.values.sum }
+    end
+
+    # returns a handle of _device_, idle or newly opened, for the calling thread.
+    # It waits at most _timeout_ seconds, forever by default, while all
+    # handles of _device_ are checked out, and returns nil on timeout.
+    # It raises Errno::ENODEV if _device_ is revoked.
+    def checkout(device, timeout: nil)
+      deadline = timeout && now + timeout
+      stale = []
+      entry = slot = nil
+      @mutex.synchronize {
+        loop {
+          raise IOError, "closed USB::HandlePool" if @closed
+          raise Errno::ENODEV, "revoked USB::Device" if device.revoked?
+          collect_stale(stale)
+          if (idle = @idle[device]) && (entry = idle.pop)
+            @busy[entry.handle] = entry
+            break
+          end
+          if @opened[device] < @max_per_device
+            @opened[device] += 1
+            slot = true
+            break
+          end
+          if deadline
+            rest = deadline - now
+            break if rest <= 0
+            @cond.wait(@mutex, rest)
+          else
+            @cond.wait(@mutex)
+          end
+        }
+      }
+      stale.each {|e| close_handle(e.handle) }
+      return entry.handle if entry
+      slot ? open_entry(device) : nil
+    end
+
+    # returns _handle_ checked out by #checkout to the pool.
+    # The handle is closed instead if its device is revoked.
+    def checkin(handle)
+      stale = []
+      @mutex.synchronize {
+        entry = @busy.delete(handle) or raise ArgumentError, "USB::DevHandle not checked out from this pool"
+        entry.used_at = now
+        if @closed || entry.device.revoked?
+          forget(entry)
+          stale << entry
+        else
+          (@idle[entry.device] ||= []) << entry
+        end
+        collect_stale(stale)
+        @cond.broadcast
+      }
+      stale.each {|e| close_handle(e.handle) }
+      nil
+    end
+
+    # closes _handle_ checked out by #checkout instead of returning it,
+    # for a handle in an unknown state after an error.
+    def discard(handle)
+      entry = @mutex.synchronize {
+        entry = @busy.delete(handle) or raise ArgumentError, "USB::DevHandle not checked out from this pool"
+        forget(entry)
+        @cond.broadcast
+        entry
+      }
+      close_handle(entry.handle)
+      nil
+    end
+
+    # calls the block with a handle of _device_ checked out.
+    # The handle is discarded if the block raises Errno::ENODEV,
+    # and returned to the pool otherwise.
+    def with(device, timeout: nil)
+      handle = checkout(device, timeout: timeout)
+      raise Errno::ETIMEDOUT, "USB::HandlePool#checkout" unless handle
+      begin
+        r = yield handle
+      rescue Errno::ENODEV
+        discard(handle)
+        raise
+      rescue Exception
+        checkin(handle)
+        raise
+      end
+      checkin(handle)
+      r
+    end
+
+    # closes the idle handles expired or of revoked devices.
+    def evict
+      stale = []
+      @mutex.synchronize {
+        collect_stale(stale)
+        @cond.broadcast unless stale.empty?
+      }
+      stale.each {|e| close_handle(e.handle) }
+      stale.length
+    end
+
+    # closes the idle handles.
+    # The handles checked out are closed when they are checked in.
+    def close
+      stale = []
+      @mutex.synchronize {
+        @closed = true
+        @idle.each_value {|idle|
+          idle.each {|e| forget(e); stale << e }
+        }
+        @idle.clear
+        @cond.broadcast
+      }
+      stale.each {|e| close_handle(e.handle) }
+      nil
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # called with @mutex locked.
+    def collect_stale(stale)
+      limit = now - @idle_timeout
+      @idle.delete_if {|device, idle|
+        revoked = device.revoked?
+        idle.reject! {|e|
+          next false unless revoked || e.used_at < limit
+          forget(e)
+          stale << e
+        }
+        idle.empty?
+      }
+    end
+
+    # called with @mutex locked.
+    def forget(entry)
+      if (@opened[entry.device] -= 1) <= 0
+        @opened.delete(entry.device)
+      end
+    end
+
+    # opens a handle for the slot counted by #checkout.
+    def open_entry(device)
+      handle = nil
+      begin
+        handle = device.usb_open
+        handle.set_configuration(@configuration) if @configuration
+        @interfaces.each {|i| handle.claim_interface(i) }
+      rescue Exception
+        close_handle(handle) if handle
+        @mutex.synchronize {
+          forget(Entry.new(device))
+          @cond.broadcast
+        }
+        raise
+      end
+      @mutex.synchronize { @busy[handle] = Entry.new(device, handle) }
+      handle
+    end
+
+    def close_handle(handle)
+      @interfaces.each {|i|
+        begin
+          handle.release_interface(i)
+        rescue SystemCallError, ArgumentError
+        end
+      }
+      begin
+        handle.usb_close
+      rescue SystemCallError, ArgumentError
+      end
+    end
+  end
+
+  # completed transfers of a device handle.
+  class TransferQueue # :nodoc:
+    def initialize
+      @mutex = Mutex.new
+      @cond = ConditionVariable.new
+      @completed = []
+      @pending = {}.compare_by_identity
+    end
+
+    def size
+      @mutex.synchronize { @pending.size + @completed.length }
+    end
+
+    def submitted(t)
+      @mutex.synchronize { @pending[t] = true }
+    end
+
+    def withdrawn(t)
+      @mutex.synchronize { @pending.delete(t) }
+    end
+
+    def pending
+      @mutex.synchronize { @pending.keys }
+    end
+
+    def completed(t)
+      @mutex.synchronize {
+        @pending.delete(t)
+        @completed << t if t.reapable?
+        @cond.broadcast
+      }
+    end
+
+    # waits _t_ and removes it from the completed transfers.
+    def wait(t, timeout)
+      deadline = timeout && USB.deadline(timeout)
+      @mutex.synchronize {
+        while @pending.include?(t)
+          if deadline
+            rest = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+            return false if rest <= 0
+            @cond.wait(@mutex, rest)
+          else
+            @cond.wait(@mutex)
+          end
+        end
+        @completed.delete(t)
+        true
+      }
+    end
+
+    def reap(timeout)
+      deadline = timeout && USB.deadline(timeout)
+      @mutex.synchronize {
+        while @completed.empty? && !@pending.empty?
+          if deadline
+            rest = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+            break if rest <= 0
+            @cond.wait(@mutex, rest)
+          else
+            @cond.wait(@mutex)
+          end
+        end
+        @completed.shift
+      }
+    end
+  end
+
+  # carries the transfers of an endpoint submitted without usb_submit,
+  # one at a time in the order of their submission.
+  # Its thread runs while transfers are queued.
+  class TransferCarrier # :nodoc:
+    def initialize
+      @mutex = Mutex.new
+      @queued = []
+      @current = nil
+      @thread = nil
+    end
+
+    def push(t)
+      @mutex.synchronize {
+        @queued << t
+        # Cancel is deferred until the thread is in a transfer.
+        @thread ||= Thread.handle_interrupt(Transfer::Cancel => :never) { Thread.new { carry } }
+      }
+    end
+
+    # cancels _t_ queued or carried.  It returns false if _t_ is neither.
+    def cancel(t)
+      queued = nil
+      @mutex.synchronize {
+        if @queued.delete(t)
+          queued = true
+        elsif @current.equal?(t)
+          @thread.raise(Transfer::Cancel)
+          queued = false
+        end
+      }
+      t.cancelled if queued
+      !queued.nil?
+    end
+
+    private
+
+    def carry
+      while t = take
+        t.run
+        @mutex.synchronize { @current = nil }
+        # a Cancel raised as the transfer finished is not for the next one.
+        if Thread.pending_interrupt?(Transfer::Cancel)
+          begin
+            Thread.handle_interrupt(Transfer::Cancel => :immediate) { Thread.pass }
+          rescue Transfer::Cancel
+          end
+        end
+      end
+    end
+
+    def take
+      @mutex.synchronize {
+        @current = @queued.shift
+        @thread = nil unless @current
+        @current
+      }
+    end
+  end
+
 end
@@ -0,0 +1,167 @@
+# usb/emulator.rb - emulated devices for tests and benchmarks.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+require 'usb'
+
+module USB
+  # USB::Emulator plugs emulated devices, to test and benchmark without
+  # USB devices.  It needs the emulator backend (USB::BACKEND is "emulator"),
+  # built instead of libusb by
+  #
+  #   % ruby extconf.rb --enable-emulator
+  #
+  # A device is described by a Hash:
+  #
+  #   USB::Emulator.plug(bus: 1, address: 1, class: USB::USB_CLASS_HUB)
+  #   USB::Emulator.plug(bus: 1, address: 2, parent: 1, port: 3,
+  #                      vendor: 0x1234, product: 0x5678,
+  #                      manufacturer: "ACME", product_name: "Widget",
+  #                      endpoints: {0x81 => {latency: 0.0001, bandwidth: 40e6}})
+  #   USB.rescan
+  #   USB.find_device_by_port_path("1-3") #=> #<USB::Device 001/002 1234:5678 ACME Widget ...>
+  #
+  # The changes are seen by the next USB.rescan or USB.find_devices,
+  # as the devices attached and detached are.
+  #
+  # Without :configurations, a device has a configuration with a vendor
+  # specific interface with bulk endpoints 0x81 and 0x01 and an interrupt
+  # endpoint 0x82.  :configurations describes the descriptors:
+  #
+  #   configurations: [
+  #     {value: 1, attributes: 0x80, max_power: 50, name: nil, interfaces: [
+  #       {number: 0, alternate: 0, class: 0xff, subclass: 0, protocol: 0, name: nil,
+  #        endpoints: [{address: 0x81, type: :bulk, max_packet_size: 512, interval: 0},
+  #                    ...]}]}]
+  #
+  # :endpoints gives the behavior of the endpoints by address,
+  # 0 for the control endpoint:
+  #
+  # latency:: seconds added to each transfer.
+  # bandwidth:: bytes per second.
+  # error_every:: fails every n-th transfer with _error_, Errno::EIO by default.
+  # loopback:: an IN endpoint returns the bytes written to the OUT endpoint
+  #            of the same number, waiting for them up to its timeout,
+  #            forever for 0.  A write waits as well while the bytes not
+  #            read fill the FIFO of 1MB.
+  #            Otherwise it returns the bytes 0, 1, 2, ... 255, 0, 1, ...
+  #            and an OUT endpoint discards the bytes.
+  #
+  # A vendor or class control request returns the data of the last one
+  # written.  A transfer longer than its timeout fails with Errno::ETIMEDOUT
+  # after the timeout.
+  module Emulator
+    ENDPOINT_TYPES = {
+      control: USB::USB_ENDPOINT_TYPE_CONTROL,
+      isochronous: USB::USB_ENDPOINT_TYPE_ISOCHRONOUS,
+      bulk: USB::USB_ENDPOINT_TYPE_BULK,
+      interrupt: USB::USB_ENDPOINT_TYPE_INTERRUPT,
+    }
+
+    DEFAULT_CONFIGURATIONS = [
+      {interfaces: [
+        {endpoints: [
+          {address: 0x81, type: :bulk, max_packet_size: 512},
+          {address: 0x01, type: :bulk, max_packet_size: 512},
+          {address: 0x82, type: :interrupt, max_packet_size: 64, interval: 1}]}]}]
+
+    module_function
+
+    # plugs a device described by _spec_.
+    def plug(spec)
+      unless USB.respond_to?(:usb_emulator_plug)
+        raise NotImplementedError, "USB::Emulator needs the emulator backend: #{USB::BACKEND}"
+      end
+      descriptors, strings = build_descriptors(spec)
+      endpoints = (spec[:endpoints] || {}).map {|address, behavior|
+        error = behavior[:error] || Errno::EIO
+        error = error::Errno if error.is_a?(Class)
+        [address,
+         ((behavior[:latency] || 0) * 1_000_000).round,
+         (behavior[:bandwidth] || 0).round,
+         behavior[:error_every] || 0,
+         error,
+         behavior[:loopback] || false]
+      }
+      USB.usb_emulator_plug(spec.fetch(:bus, 1), spec.fetch(:address), spec[:parent], spec.fetch(:port, 0),
+                            descriptors, strings, endpoints)
+      nil
+    end
+
+    # unplugs the device at _address_ on _bus_.
+    def unplug(bus: 1, address:)
+      USB.usb_emulator_unplug(bus, address)
+    end
+
+    # unplugs all devices.
+    def reset
+      USB.usb_emulator_unplug_all
+    end
+
+    # plugs the devices described by _specs_, an Array of Hash, such as
+    # a topology loaded from JSON with symbolized names.
+    def load(specs)
+      specs.each {|spec| plug(spec) }
+      nil
+    end
+
+    # returns [descriptors, strings] of _spec_:
+    # the device descriptor followed by the configuration descriptors,
+    # and the string descriptors by index.
+    def build_descriptors(spec)
+      strings = ["\x04\x03\x09\x04".b]
+      string = lambda {|s|
+        next 0 unless s
+        d = s.encode(Encoding::UTF_16LE).b
+        strings << [d.bytesize + 2, USB::USB_DT_STRING].pack("CC") + d
+        strings.length - 1
+      }
+      manufacturer = string.(spec[:manufacturer])
+      product = string.(spec[:product_name])
+      serial_number = string.(spec[:serial_number])
+      configurations = spec[:configurations] || DEFAULT_CONFIGURATIONS
+      descriptors = [
+        USB::USB_DT_DEVICE_SIZE, USB::USB_DT_DEVICE, spec.fetch(:usb, 0x0200),
+        spec.fetch(:class, 0), spec.fetch(:subclass, 0), spec.fetch(:protocol, 0),
+        spec.fetch(:max_packet_size0, 64),
+        spec.fetch(:vendor, 0), spec.fetch(:product, 0), spec.fetch(:release, 0x0100),
+        manufacturer, product, serial_number, configurations.length
+      ].pack("CCvCCCCvvvCCCC")
+      configurations.each_with_index {|c, i|
+        body = "".b
+        numbers = []
+        c.fetch(:interfaces, []).each {|intf|
+          eps = intf.fetch(:endpoints, [])
+          numbers |= [intf.fetch(:number, 0)]
+          body << [USB::USB_DT_INTERFACE_SIZE, USB::USB_DT_INTERFACE,
+                   intf.fetch(:number, 0), intf.fetch(:alternate, 0), eps.length,
+                   intf.fetch(:class, USB::USB_CLASS_VENDOR_SPEC), intf.fetch(:subclass, 0),
+                   intf.fetch(:protocol, 0), string.(intf[:name])].pack("C9")
+          eps.each {|ep|
+            body << [USB::USB_DT_ENDPOINT_SIZE, USB::USB_DT_ENDPOINT, ep.fetch(:address),
+                     ENDPOINT_TYPES.fetch(ep.fetch(:type, :bulk)) | ep.fetch(:attributes, 0),
+                     ep.fetch(:max_packet_size, 64), ep.fetch(:interval, 0)].pack("CCCCvC")
+          }
+        }
+        descriptors << [USB::USB_DT_CONFIG_SIZE, USB::USB_DT_CONFIG,
+                        USB::USB_DT_CONFIG_SIZE + body.bytesize, numbers.length,
+                        c.fetch(:value, i + 1), string.(c[:name]),
+                        c.fetch(:attributes, 0x80), c.fetch(:max_power, 50)].pack("CCvCCCCC")
+        descriptors << body
+      }
+      [descriptors, strings]
+    end
+  end
+end
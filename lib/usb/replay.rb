@@ -0,0 +1,469 @@
+# usb/replay.rb - recording and replaying sessions of a device.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+require 'usb'
+
+module USB
+  # USB::Recorder records the requests made on a DevHandle, with their
+  # results, the data read and the time they took, to a file which
+  # USB::Replay serves back without the device.
+  #
+  #   File.open("session.usbrec", "wb") {|f|
+  #     USB::Recorder.record(h, f) { run_protocol(h) }
+  #   }
+  #
+  # The control, bulk and interrupt transfers, including the batches,
+  # and the configuration requests are recorded.  The transfers submitted
+  # to libusb-1.0 asynchronously are not; those of libusb-0.1 are, as they
+  # run synchronously in threads.
+  #
+  # The file is a header followed by a record by request:
+  # the request code, the microseconds it took, its arguments,
+  # the bytes requested, the result (bytes or -errno) as BER compressed
+  # integers (pack "w", the signed ones zigzag encoded),
+  # and the data read, or written with <tt>data_out: true</tt>.
+  class Recorder
+    MAGIC = "RUSBREC1".b # :nodoc:
+
+    # request code => [name, arguments, IN?]
+    OPS = { # :nodoc:
+      1 => [:control, 4, nil],
+      2 => [:bulk_write, 1, false],
+      3 => [:bulk_read, 1, true],
+      4 => [:interrupt_write, 1, false],
+      5 => [:interrupt_read, 1, true],
+      6 => [:get_descriptor, 2, true],
+      7 => [:get_descriptor_by_endpoint, 3, true],
+      8 => [:get_string, 2, true],
+      9 => [:get_string_simple, 1, true],
+      10 => [:set_configuration, 1, false],
+      11 => [:set_altinterface, 1, false],
+      12 => [:clear_halt, 1, false],
+      13 => [:claim_interface, 1, false],
+      14 => [:release_interface, 1, false],
+      15 => [:reset, 0, false],
+    }
+    CODES = OPS.to_h {|code, (name, _, _)| [name, code] } # :nodoc:
+
+    # A request recorded.  _data_ is the data read, or written if recorded.
+    Record = Struct.new(:op, :usec, :args, :size, :result, :data) # :nodoc:
+
+    # records the requests on _handle_ to _io_ during the block.
+    def self.record(handle, io, data_out: false)
+      recorder = new(handle, io, data_out: data_out)
+      begin
+        yield recorder
+      ensure
+        recorder.stop
+      end
+    end
+
+    # starts recording the requests on _handle_ to _io_.
+    # The data written is recorded if _data_out_ is true,
+    # so that USB::Replay checks it.
+    def initialize(handle, io, data_out: false)
+      @io = io
+      @data_out = data_out
+      @lock = Mutex.new
+      @count = 0
+      @io.write(MAGIC + [data_out ? 1 : 0].pack("C"))
+      @handle = handle
+      handle.singleton_class.prepend(Hooks) unless handle.singleton_class.include?(Hooks)
+      handle.instance_variable_set(:@usb_recorder, self)
+    end
+
+    # the number of requests recorded.
+    attr_reader :count
+
+    # stops recording.
+    def stop
+      @handle.instance_variable_set(:@usb_recorder, nil) if @handle
+      @handle = nil
+      @io.flush if @io.respond_to?(:flush)
+      nil
+    end
+
+    def add(op, usec, args, size, result, data) # :nodoc:
+      code = CODES.fetch(op)
+      read = op == :control ? args[0] & USB::USB_ENDPOINT_IN != 0 : OPS[code][2]
+      if result < 0 || (!read && !@data_out)
+        data = ""
+      elsif read
+        data = data.byteslice(0, result)
+      end
+      rec = [code].pack("C") +
+            ([usec] + args + [size, Recorder.zigzag(result), data.bytesize]).pack("w*") + data.b
+      @lock.synchronize {
+        @io.write(rec)
+        @count += 1
+      }
+      nil
+    end
+
+    def self.zigzag(n) n < 0 ? -n * 2 - 1 : n * 2 end # :nodoc:
+    def self.unzigzag(n) n.odd? ? -(n + 1) / 2 : n / 2 end # :nodoc:
+
+    # reads the records of _io_.
+    def self.load(io) # :nodoc:
+      magic = io.read(MAGIC.bytesize)
+      raise ArgumentError, "not a USB::Recorder file" if magic != MAGIC
+      data_out = io.read(1).unpack1("C") != 0
+      records = []
+      while c = io.read(1)
+        code = c.unpack1("C")
+        name, nargs, _ = OPS.fetch(code) { raise ArgumentError, "unexpected record: #{code}" }
+        ints = Array.new(nargs + 4) { read_ber(io) }
+        data = io.read(ints.last) || ""
+        raise ArgumentError, "truncated record" if data.bytesize != ints.last
+        records << Record.new(name, ints[0], ints[1, nargs], ints[nargs + 1], unzigzag(ints[nargs + 2]), data)
+      end
+      [records, data_out]
+    end
+
+    def self.read_ber(io) # :nodoc:
+      n = 0
+      while true
+        c = io.read(1) or raise ArgumentError, "truncated record"
+        b = c.unpack1("C")
+        n = n << 7 | b & 0x7f
+        return n if b < 0x80
+      end
+    end
+
+    # the hooks prepended to a DevHandle recorded.
+    # The Ruby methods of DevHandleMethods run on these.
+    module Hooks # :nodoc:
+      def usb_recorded(op, args, size, data=nil)
+        r = @usb_recorder
+        return yield unless r
+        t = Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+        begin
+          ret = yield
+        rescue SystemCallError => e
+          r.add(op, Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond) - t, args, size, -e.errno, "")
+          raise
+        end
+        r.add(op, Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond) - t, args, size, ret || 0,
+              data ? data.call(ret) : "")
+        ret
+      end
+
+      def usb_control_msg(requesttype, request, value, index, bytes, timeout)
+        usb_recorded(:control, [requesttype, request, value, index], bytes.bytesize, ->(n) { bytes.b }) { super }
+      end
+
+      def usb_bulk_write(ep, bytes, timeout)
+        usb_recorded(:bulk_write, [ep], bytes.bytesize, ->(n) { bytes.b }) { super }
+      end
+
+      def usb_bulk_read(ep, bytes, timeout)
+        usb_recorded(:bulk_read, [ep], bytes.bytesize, ->(n) { bytes.b }) { super }
+      end
+
+      def usb_interrupt_write(ep, bytes, timeout)
+        usb_recorded(:interrupt_write, [ep], bytes.bytesize, ->(n) { bytes.b }) { super }
+      end
+
+      def usb_interrupt_read(ep, bytes, timeout)
+        usb_recorded(:interrupt_read, [ep], bytes.bytesize, ->(n) { bytes.b }) { super }
+      end
+
+      def bulk_read_into(ep, buffer, timeout, offset=nil, length=nil)
+        usb_recorded(:bulk_read, [ep], Recorder.room(buffer, offset, length),
+                     ->(n) { Recorder.read_back(buffer, offset, n) }) { super }
+      end
+
+      def interrupt_read_into(ep, buffer, timeout, offset=nil, length=nil)
+        usb_recorded(:interrupt_read, [ep], Recorder.room(buffer, offset, length),
+                     ->(n) { Recorder.read_back(buffer, offset, n) }) { super }
+      end
+
+      def usb_get_descriptor(type, index, buf)
+        usb_recorded(:get_descriptor, [type, index], buf.bytesize, ->(n) { buf.b }) { super }
+      end
+
+      def usb_get_descriptor_by_endpoint(ep, type, index, buf)
+        usb_recorded(:get_descriptor_by_endpoint, [ep, type, index], buf.bytesize, ->(n) { buf.b }) { super }
+      end
+
+      def usb_get_string(index, langid, buf)
+        usb_recorded(:get_string, [index, langid], buf.bytesize, ->(n) { buf.b }) { super }
+      end
+
+      def usb_get_string_simple(index, buf)
+        usb_recorded(:get_string_simple, [index], buf.bytesize, ->(n) { buf.b }) { super }
+      end
+
+      def usb_set_configuration(configuration)
+        usb_recorded(:set_configuration, [configuration], 0) { super }
+      end
+
+      def usb_set_altinterface(alternate)
+        usb_recorded(:set_altinterface, [alternate], 0) { super }
+      end
+
+      def usb_clear_halt(ep)
+        usb_recorded(:clear_halt, [ep], 0) { super }
+      end
+
+      def usb_claim_interface(interface)
+        usb_recorded(:claim_interface, [interface], 0) { super }
+      end
+
+      def usb_release_interface(interface)
+        usb_recorded(:release_interface, [interface], 0) { super }
+      end
+
+      def usb_reset
+        usb_recorded(:reset, [], 0) { super }
+      end
+
+      # the transfers of a batch are recorded one by one,
+      # each with an equal part of the time of the batch.
+      def bulk_write_batch(ep, items, timeout)
+        r = @usb_recorder
+        return super unless r
+        t = Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+        results = super
+        usec = (Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond) - t) / [items.length, 1].max
+        items.each_with_index {|bytes, i|
+          res = results[i]
+          break unless res
+          r.add(:bulk_write, usec, [ep], bytes.bytesize, res.is_a?(Integer) ? res : -res.errno, bytes.b)
+        }
+        results
+      end
+
+      def control_batch(items, timeout)
+        r = @usb_recorder
+        return super unless r
+        t = Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond)
+        results = super
+        usec = (Process.clock_gettime(Process::CLOCK_MONOTONIC, :microsecond) - t) / [items.length, 1].max
+        items.each_with_index {|(requesttype, request, value, index, bytes), i|
+          res = results[i]
+          break unless res
+          r.add(:control, usec, [requesttype, request, value, index], bytes.bytesize,
+                res.is_a?(Integer) ? res : -res.errno, bytes.b)
+        }
+        results
+      end
+    end
+
+    # the bytes requested by bulk_read_into: _length_,
+    # or the rest of the buffer up to the capacity of a String.
+    def self.room(buffer, offset, length) # :nodoc:
+      USB.usb_buffer_room(buffer, offset, length)
+    end
+
+    def self.read_back(buffer, offset, n) # :nodoc:
+      offset ||= 0
+      if defined?(IO::Buffer) && buffer.is_a?(IO::Buffer)
+        buffer.get_string(offset, n)
+      else
+        buffer.byteslice(offset, n).b
+      end
+    end
+  end
+
+  # USB::Replay serves a session recorded by USB::Recorder as a DevHandle,
+  # so that the code using the device runs without it.
+  #
+  #   h = USB::Replay.open("session.usbrec", speed: nil)
+  #   run_protocol(h)
+  #
+  # Each request returns the data and result recorded, or raises the
+  # SystemCallError recorded.  The requests are expected in the order
+  # recorded on each endpoint; the control transfers on endpoint 0 and
+  # the configuration requests are kept in their own orders, so that
+  # threads reading several endpoints replay as recorded.
+  # A request which differs from the one recorded raises
+  # USB::Replay::Mismatch, as do the data written if it was recorded
+  # and a read into a buffer with less room than the bytes recorded.
+  #
+  # Each request takes the time it took when recorded divided by _speed_,
+  # or no time if _speed_ is nil.  The time between the requests is the
+  # time taken by the code replayed.
+  class Replay
+    include DevHandleMethods
+
+    # raised by a request which is not the one recorded.
+    class Mismatch < StandardError; end
+
+    # replays the file at _path_.
+    def self.open(path, speed: 1.0)
+      File.open(path, "rb") {|f| new(f, speed: speed) }
+    end
+
+    # replays the records read from _io_.
+    def initialize(io, speed: 1.0)
+      records, @data_out = Recorder.load(io)
+      @speed = speed
+      @lock = Mutex.new
+      @queues = Hash.new {|h, k| h[k] = [] }
+      records.each {|r| @queues[queue_key(r.op, r.args)] << r }
+      @closed = false
+    end
+
+    # the number of requests not replayed yet.
+    def remaining
+      @lock.synchronize { @queues.each_value.sum(&:length) }
+    end
+
+    def inspect
+      "\#<#{self.class} #{remaining} remaining>"
+    end
+
+    def usb_close
+      @closed = true
+      nil
+    end
+
+    def usb_control_msg(requesttype, request, value, index, bytes, timeout)
+      r = replay(:control, [requesttype, request, value, index], bytes.bytesize, "usb_control_msg")
+      if requesttype & USB::USB_ENDPOINT_IN != 0
+        fill(bytes, 0, r.data)
+      else
+        check_out(r, bytes)
+      end
+      r.result
+    end
+
+    def usb_bulk_write(ep, bytes, timeout) write_op(:bulk_write, ep, bytes, "usb_bulk_write") end
+    def usb_interrupt_write(ep, bytes, timeout) write_op(:interrupt_write, ep, bytes, "usb_interrupt_write") end
+    def usb_bulk_read(ep, bytes, timeout) read_op(:bulk_read, [ep], bytes, "usb_bulk_read") end
+    def usb_interrupt_read(ep, bytes, timeout) read_op(:interrupt_read, [ep], bytes, "usb_interrupt_read") end
+
+    def bulk_read_into(ep, buffer, timeout, offset=nil, length=nil)
+      read_into(:bulk_read, ep, buffer, offset, length, "usb_bulk_read")
+    end
+
+    def interrupt_read_into(ep, buffer, timeout, offset=nil, length=nil)
+      read_into(:interrupt_read, ep, buffer, offset, length, "usb_interrupt_read")
+    end
+
+    def usb_get_descriptor(type, index, buf)
+      read_op(:get_descriptor, [type, index], buf, "usb_get_descriptor")
+    end
+
+    def usb_get_descriptor_by_endpoint(ep, type, index, buf)
+      read_op(:get_descriptor_by_endpoint, [ep, type, index], buf, "usb_get_descriptor_by_endpoint")
+    end
+
+    def usb_get_string(index, langid, buf)
+      read_op(:get_string, [index, langid], buf, "usb_get_string")
+    end
+
+    def usb_get_string_simple(index, buf)
+      read_op(:get_string_simple, [index], buf, "usb_get_string_simple")
+    end
+
+    def usb_set_configuration(configuration) replay(:set_configuration, [configuration], 0, "usb_set_configuration"); nil end
+    def usb_set_altinterface(alternate) replay(:set_altinterface, [alternate], 0, "usb_set_altinterface"); nil end
+    def usb_clear_halt(ep) replay(:clear_halt, [ep], 0, "usb_clear_halt"); nil end
+    def usb_claim_interface(interface) replay(:claim_interface, [interface], 0, "usb_claim_interface"); nil end
+    def usb_release_interface(interface) replay(:release_interface, [interface], 0, "usb_release_interface"); nil end
+    def usb_reset() replay(:reset, [], 0, "usb_reset"); nil end
+
+    def bulk_write_batch(ep, items, timeout)
+      batch(items) {|bytes| usb_bulk_write(ep, bytes, timeout) }
+    end
+
+    def control_batch(items, timeout)
+      batch(items) {|item|
+        raise ArgumentError, "control request should be [requesttype, request, value, index, bytes]" if item.length != 5
+        usb_control_msg(*item, timeout)
+      }
+    end
+
+    private
+
+    def queue_key(op, args)
+      case op
+      when :control, :get_descriptor, :get_string, :get_string_simple then :control
+      when :get_descriptor_by_endpoint then [:control, args[0]]
+      when :bulk_write, :bulk_read, :interrupt_write, :interrupt_read then args[0]
+      else :handle
+      end
+    end
+
+    # takes the next record of the queue of the request, waits its time
+    # and raises its error.
+    # The _size_ of a read into a buffer is its room, which only has to
+    # hold the bytes recorded, as the room of a String varies with its capacity.
+    def replay(op, args, size, reason, room: false)
+      raise ArgumentError, "closed USB::Replay" if @closed
+      key = queue_key(op, args)
+      r = @lock.synchronize { @queues[key].first }
+      if !r || r.op != op || r.args != args ||
+         (room ? size < r.data.bytesize : r.size != size)
+        raise Mismatch, "#{op} #{args.inspect} of #{size} bytes, " +
+                        (r ? "recorded #{r.op} #{r.args.inspect} of #{r.size} bytes" : "none recorded")
+      end
+      @lock.synchronize { @queues[key].shift }
+      sleep(r.usec / 1e6 / @speed) if @speed && 0 < r.usec
+      raise SystemCallError.new(reason, -r.result) if r.result < 0
+      r
+    end
+
+    def check_out(r, bytes)
+      if @data_out && r.data != bytes.b
+        raise Mismatch, "data written differs from the recorded one"
+      end
+    end
+
+    def write_op(op, ep, bytes, reason)
+      r = replay(op, [ep], bytes.bytesize, reason)
+      check_out(r, bytes)
+      r.result
+    end
+
+    def read_op(op, args, buf, reason)
+      r = replay(op, args, buf.bytesize, reason)
+      fill(buf, 0, r.data)
+      r.result
+    end
+
+    def read_into(op, ep, buffer, offset, length, reason)
+      r = replay(op, [ep], Recorder.room(buffer, offset, length), reason, room: true)
+      offset ||= 0
+      if defined?(IO::Buffer) && buffer.is_a?(IO::Buffer)
+        buffer.set_string(r.data, offset)
+      else
+        buffer.bytesplice(offset, buffer.bytesize - offset, r.data)
+      end
+      r.result
+    end
+
+    def fill(buf, offset, data)
+      buf.bytesplice(offset, data.bytesize, data) unless data.empty?
+    end
+
+    def batch(items)
+      Array === items or raise TypeError, "wrong argument type #{items.class} (expected Array)"
+      results = []
+      items.each {|item|
+        begin
+          results << yield(item)
+        rescue SystemCallError => e
+          results << e
+          break
+        end
+      }
+      results.fill(nil, results.length, items.length - results.length)
+    end
+  end
+end
@@ -0,0 +1,156 @@
+# usb/trace.rb - transfers traced by USB::DevHandle#trace_start.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+require 'usb'
+
+module USB
+  # USB::Trace is a snapshot of the transfers traced on a DevHandle,
+  # oldest first.
+  #
+  #   h.trace_start(records: 1024, snaplen: 64)
+  #   ...
+  #   trace = h.trace_stop
+  #   trace.each {|r| p [r.endpoint, r.duration, r.result] }
+  #   File.open("usb.pcapng", "wb") {|f| trace.write_pcapng(f) }
+  #
+  # The pcapng file has the usbmon format of Linux, so that Wireshark
+  # dissects it as a capture of usbmon on the bus of the device.
+  class Trace
+    include Enumerable
+
+    TYPES = Transfer::TYPES.invert # :nodoc:
+
+    # a transfer traced.
+    # sequence:: the number of the transfer since the trace started.
+    # time:: when the transfer started, in microseconds since the epoch.
+    # duration:: microseconds.
+    # type:: :control, :bulk, :interrupt or :isochronous.
+    # endpoint:: the endpoint address.  A control transfer has 0 with the
+    #            direction of its setup packet, 0x80 for IN.
+    # length:: the bytes requested.
+    # result:: the bytes transferred or -errno.
+    # setup:: the setup packet of a control transfer, nil for others.
+    # data:: the first bytes written, or read, up to the snaplen.
+    Record = Struct.new(:sequence, :time, :duration, :type, :endpoint, :length, :result, :setup, :data) do
+      def in?() self.endpoint & USB::USB_ENDPOINT_IN != 0 end
+
+      # returns the SystemCallError of a failed transfer, nil otherwise.
+      def error
+        self.result < 0 ? SystemCallError.new("usb transfer", -self.result) : nil
+      end
+    end
+
+    attr_reader :busnum, :devnum, :snaplen, :records
+
+    def initialize(busnum, devnum, snaplen, records)
+      @busnum = busnum
+      @devnum = devnum
+      @snaplen = snaplen
+      @records = records.map {|seq, time, duration, type, ep, length, result, setup, data|
+        Record.new(seq, time, duration, TYPES.fetch(type), ep, length, result, setup, data)
+      }
+    end
+
+    # returns the number of transfers overwritten by newer ones.
+    def overwritten
+      @records.empty? ? 0 : @records.first.sequence
+    end
+
+    def each(&block)
+      @records.each(&block)
+    end
+
+    def size() @records.size end
+
+    def inspect
+      "\#<#{self.class} #{'%03d/%03d' % [@busnum, @devnum]} #{@records.size} records>"
+    end
+
+    LINKTYPE_USB_LINUX_MMAPPED = 220 # :nodoc:
+    USBMON_TYPES = {isochronous: 0, interrupt: 1, control: 2, bulk: 3} # :nodoc:
+    EINPROGRESS = 115 # :nodoc:
+
+    # writes the trace to _io_ as pcapng.
+    # Each transfer is a submission and a completion,
+    # with the data written and read respectively.
+    def write_pcapng(io)
+      io.write(pcapng_block(0x0a0d0d0a, [0x1a2b3c4d, 1, 0, -1].pack("L<S<S<q<")))
+      io.write(pcapng_block(1, [LINKTYPE_USB_LINUX_MMAPPED, 0, 64 + @snaplen].pack("S<S<L<") +
+                               pcapng_option(2, "usbmon#{@busnum}") + pcapng_option(9, [6].pack("C")) +
+                               [0, 0].pack("S<S<")))
+      events = []
+      @records.each {|r|
+        events << [r.time, 0, r]
+        events << [r.time + r.duration, 1, r]
+      }
+      events.sort_by! {|time, completion, r| [time, r.sequence, completion] }
+      events.each {|time, completion, r|
+        packet = usbmon_packet(time, completion == 1, r)
+        io.write(pcapng_block(6, [0, time >> 32, time & 0xffffffff, packet.bytesize, packet.bytesize].pack("L<5") +
+                                 pad4(packet)))
+      }
+      io
+    end
+
+    private
+
+    def usbmon_packet(time, completion, r)
+      data = ""
+      if completion
+        status = r.result < 0 ? r.result : 0
+        length = r.result < 0 ? 0 : r.result
+        data = r.data if r.in? && 0 < length
+        flag_data = data.empty? ? ">" : "\0"
+      else
+        status = -EINPROGRESS
+        length = r.length
+        data = r.data unless r.in?
+        flag_data = data.empty? ? "<" : "\0"
+      end
+      setup = r.setup && !completion
+      [
+        r.sequence,
+        completion ? "C".ord : "S".ord,
+        USBMON_TYPES.fetch(r.type),
+        r.endpoint,
+        @devnum,
+        @busnum,
+        setup ? "\0" : "-",
+        flag_data,
+        time / 1_000_000,
+        time % 1_000_000,
+        status,
+        length,
+        data.bytesize,
+        setup ? r.setup : "\0" * 8,
+        0, 0, 0, 0,
+      ].pack("Q<CCCCS<aaq<l<l<L<L<a8l<l<L<L<") + data
+    end
+
+    def pcapng_block(type, body)
+      len = 12 + body.bytesize
+      [type, len].pack("L<L<") + body + [len].pack("L<")
+    end
+
+    def pcapng_option(code, value)
+      [code, value.bytesize].pack("S<S<") + pad4(value)
+    end
+
+    def pad4(s)
+      s + "\0" * (-s.bytesize % 4)
+    end
+  end
+end
@@ -0,0 +1,69 @@
+# test/test_bulk_stream.rb - DevHandle#bulk_stream on the emulator.
+#
+#   % rake test
+
+require 'minitest/autorun'
+require 'usb'
+
+class TestBulkStream < Minitest::Test
+  def setup
+    USB::Emulator.reset
+    USB::Emulator.plug(bus: 1, address: 1, vendor: 0x1234, product: 0x5678,
+                       endpoints: {0x81 => {latency: 0.0001}})
+    USB.rescan
+    @handle = USB.devices_by_ids(0x1234, 0x5678).first.open
+    @handle.usb_claim_interface(0)
+  end
+
+  def teardown
+    @handle.usb_close
+    USB::Emulator.reset
+  end
+
+  # the pattern endpoint returns 0, 1, ... 255, 0, ... across the reads,
+  # so the chunks concatenated are the sequence only if yielded in order.
+  def test_chunks_in_order
+    bytes = []
+    @handle.bulk_stream(0x81, buffer_size: 1, depth: 8) {|chunk|
+      bytes.concat chunk.bytes
+      break if 600 <= bytes.length
+    }
+    assert_equal Array.new(bytes.length) {|i| i % 256 }, bytes
+  end
+
+  def test_larger_chunks_in_order
+    bytes = []
+    @handle.bulk_stream(0x81, buffer_size: 100, depth: 4) {|chunk|
+      bytes.concat chunk.bytes
+      break if 1000 <= bytes.length
+    }
+    assert_equal Array.new(bytes.length) {|i| i % 256 }, bytes
+  end
+
+  def test_io
+    out = String.new
+    io = Object.new
+    io.define_singleton_method(:write) {|chunk|
+      out << chunk
+      throw :done if 300 <= out.bytesize
+    }
+    catch(:done) { @handle.bulk_stream(0x81, io, buffer_size: 7, depth: 3) }
+    assert_equal Array.new(out.bytesize) {|i| i % 256 }, out.bytes
+  end
+
+  # the reads in flight are cancelled rather than waited for their timeout.
+  def test_break_cancels_reads
+    USB::Emulator.reset
+    USB::Emulator.plug(bus: 1, address: 2, vendor: 0x1234, product: 0x9abc,
+                       endpoints: {0x81 => {latency: 10}})
+    USB.rescan
+    USB.devices_by_ids(0x1234, 0x9abc).first.open {|h|
+      h.usb_claim_interface(0)
+      t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      assert_raises(Errno::ETIMEDOUT) {
+        h.bulk_stream(0x81, buffer_size: 8, depth: 4, timeout: 50) { flunk }
+      }
+      assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - t, :<, 5
+    }
+  end
+end
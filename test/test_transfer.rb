@@ -0,0 +1,74 @@
+# test/test_transfer.rb - USB::Transfer on the emulator.
+#
+#   % rake test
+
+require 'minitest/autorun'
+require 'usb'
+
+class TestTransfer < Minitest::Test
+  def setup
+    USB::Emulator.reset
+  end
+
+  def teardown
+    @handle.usb_close if @handle
+    USB::Emulator.reset
+  end
+
+  def plug(behavior)
+    USB::Emulator.plug(bus: 1, address: 1, vendor: 0x1234, product: 0x5678,
+                       endpoints: {0x81 => behavior})
+    USB.rescan
+    @handle = USB.devices_by_ids(0x1234, 0x5678).first.open
+    @handle.usb_claim_interface(0)
+  end
+
+  # the pattern endpoint returns 0, 1, ... 255, 0, ... across the reads,
+  # so the bytes reaped are the sequence only if the transfers are
+  # carried in the order of their submission.
+  def test_reaped_in_order
+    plug(latency: 0.0001)
+    8.times { @handle.submit_bulk(0x81, "\0".b, 1000) }
+    bytes = []
+    200.times {
+      t = @handle.reap
+      bytes.concat t.buffer.bytes
+      t.submit
+    }
+    assert_equal Array.new(bytes.length) {|i| i % 256 }, bytes
+  ensure
+    @handle.cancel_transfers
+    nil while @handle.reap
+  end
+
+  # a transfer queued behind another is cancelled at once,
+  # and the transfer carried is interrupted without the ones behind it.
+  def test_cancel
+    plug(latency: 0.3)
+    ts = Array.new(3) { @handle.submit_bulk(0x81, "\0".b, 0) }
+    assert ts[1].cancel
+    assert_equal :cancelled, ts[1].status
+    sleep 0.05
+    assert ts[0].cancel
+    ts.each(&:wait)
+    assert_equal [:cancelled, :cancelled, :completed], ts.map(&:status)
+    assert_kind_of Errno::ECANCELED, ts[0].error
+    assert_equal [0], ts[2].buffer.bytes
+    refute ts[2].cancel
+  end
+  # a read without timeout on an idle loopback endpoint waits
+  # until it is cancelled.
+  def test_cancel_read_without_timeout
+    plug(loopback: true)
+    t = @handle.submit_bulk(0x81, "\0".b * 4, 0)
+    refute t.wait(0.2)
+    assert_equal :pending, t.status
+    assert t.cancel
+    t.wait
+    assert_equal :cancelled, t.status
+    t.submit
+    @handle.usb_bulk_write(1, "ab", 100)
+    assert_equal 2, t.result
+    assert_equal "ab", t.buffer
+  end
+end
@@ -24,47 +24,180 @@
 #else
 #include "st.h"
 #endif
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif
+#ifdef HAVE_LIBUSB_1_0
+#include "usb1.h"
+#include "ruby/thread_native.h"
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#else
+# define POLLIN 0x001
+# define POLLOUT 0x004
+#endif
+#elif defined(RUSB_EMULATOR)
+#include "usbemu.h"
+#else
 #include <usb.h>
+#endif
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
 
 #ifndef RSTRING_PTR
 # define RSTRING_PTR(s) (RSTRING(s)->ptr)
 # define RSTRING_LEN(s) (RSTRING(s)->len)
 #endif
 
+#ifndef RB_GC_GUARD
+# define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+
+#ifndef HAVE_RB_STR_MODIFY_EXPAND
+# define rb_str_modify_expand(str, expand) \
+    rb_str_resize((str), RSTRING_LEN(str) + (expand))
+#endif
+#ifndef HAVE_RB_STR_SET_LEN
+# define rb_str_set_len(str, len) rb_str_resize((str), (len))
+#endif
+#ifndef HAVE_RB_UTF8_STR_NEW
+# define rb_utf8_str_new(ptr, len) rb_str_new((ptr), (len))
+#endif
+#ifndef HAVE_RB_STR_CAPACITY
+# define rb_str_capacity(str) RSTRING_LEN(str)
+#endif
+
+/*
+ * rusb_without_gvl(func, arg) runs func(arg) with the interpreter lock
+ * released so that other Ruby threads run while libusb blocks.
+ * RUBY_UBF_IO interrupts the blocking system call on Thread#kill, Thread#raise, etc.
+ * rusb_without_gvl2 takes an unblocking function instead of RUBY_UBF_IO.
+ */
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+# define rusb_without_gvl2(func, arg, ubf, ubfarg) \
+    rb_thread_call_without_gvl((func), (arg), (ubf), (ubfarg))
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+# define rusb_without_gvl2(func, arg, ubf, ubfarg) \
+    ((void *)rb_thread_blocking_region((rb_blocking_function_t *)(func), (arg), (ubf), (ubfarg)))
+#else
+# define rusb_without_gvl2(func, arg, ubf, ubfarg) ((func)(arg))
+#endif
+#define rusb_without_gvl(func, arg) rusb_without_gvl2((func), (arg), RUBY_UBF_IO, NULL)
+
 static VALUE rb_cUSB;
 
-static VALUE rusb_dev_handle_new(usb_dev_handle *h);
+/*
+ * The device index, built at the first lookup after the device lists
+ * change and shared by the lookups until the next change.
+ */
+static VALUE rusb_index = Qnil;
+
+static VALUE rusb_dev_handle_new(usb_dev_handle *h, struct usb_device *device);
+static int check_usb_error(const char *reason, int ret);
+
+/*
+ * The objects of the structures are registered in ObjectSpace::WeakMap,
+ * keyed by the address of the structure, so that a structure gives the
+ * same object while the object is referenced, and the GC needs not mark
+ * every object ever made.  An object marks its parent object.
+ * A revoked object may remain in a registry until it is collected;
+ * it is replaced when the address is reused.
+ */
+typedef struct { void *ptr; VALUE parent; } rusb_wrap_t;
+static ID id_aref, id_aset, id_values;
+#define RUSB_REGISTRY_KEY(p) LONG2FIX((long)((uintptr_t)(p) >> 2))
+
+static VALUE
+rusb_registry_lookup(VALUE registry, void *p)
+{
+  VALUE v = rb_funcall(registry, id_aref, 1, RUSB_REGISTRY_KEY(p));
+  rusb_wrap_t *d;
+  if (NIL_P(v))
+    return Qnil;
+  d = DATA_PTR(v);
+  if (!d || d->ptr != p)
+    return Qnil;
+  return v;
+}
+
+static void
+rusb_registry_add(VALUE registry, void *p, VALUE v)
+{
+  rb_funcall(registry, id_aset, 2, RUSB_REGISTRY_KEY(p), v);
+}
+
+/* returns the objects in the registry, including revoked ones. */
+static VALUE
+rusb_registry_objects(VALUE registry)
+{
+  return rb_funcall(registry, id_values, 0);
+}
+
+static void
+rusb_revoke(VALUE v)
+{
+  void *d = DATA_PTR(v);
+  DATA_PTR(v) = NULL;
+  xfree(d);
+}
+
+/*
+ * The objects are TypedData, freed immediately, and movable by GC.compact.
+ * dcompact exists since Ruby 2.7 as rb_gc_mark_movable.
+ */
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+# define RUSB_DCOMPACT(func) func,
+#else
+# define rb_gc_mark_movable(v) rb_gc_mark(v)
+# define rb_gc_location(v) (v)
+# define RUSB_DCOMPACT(func)
+#endif
 
 #define define_usb_struct(c_name, ruby_name) \
   static VALUE rb_cUSB_ ## ruby_name; \
-  static st_table *c_name ## _objects; \
+  static VALUE c_name ## _objects; \
   typedef struct { struct usb_ ## c_name *ptr; VALUE parent; } rusb_ ## c_name ## _t; \
+  static void rusb_ ## c_name ## _mark(void *p) { \
+    rb_gc_mark_movable(((rusb_ ## c_name ## _t *)p)->parent); \
+  } \
   static void rusb_ ## c_name ## _free(void *p) { \
-    if (p) free(p); \
+    if (p) xfree(p); \
+  } \
+  static size_t rusb_ ## c_name ## _memsize(const void *p) { \
+    return sizeof(rusb_ ## c_name ## _t); \
   } \
+  static void rusb_ ## c_name ## _compact(void *p) { \
+    rusb_ ## c_name ## _t *d = (rusb_ ## c_name ## _t *)p; \
+    d->parent = rb_gc_location(d->parent); \
+  } \
+  static const rb_data_type_t rusb_ ## c_name ## _type = { \
+    "USB::" #ruby_name, \
+    { rusb_ ## c_name ## _mark, rusb_ ## c_name ## _free, rusb_ ## c_name ## _memsize, \
+      RUSB_DCOMPACT(rusb_ ## c_name ## _compact) }, \
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY \
+  }; \
   static VALUE rusb_ ## c_name ## _make(struct usb_ ## c_name *p, VALUE parent) \
   { \
     VALUE v; \
     rusb_ ## c_name ## _t *d; \
     if (p == NULL) { return Qnil; } \
-    if (st_lookup(c_name ## _objects, (st_data_t)p, (st_data_t *)&v)) \
+    v = rusb_registry_lookup(c_name ## _objects, p); \
+    if (!NIL_P(v)) \
       return v; \
     d = (rusb_ ## c_name ## _t *)xmalloc(sizeof(*d)); \
     d->ptr = p; \
     d->parent = parent; \
-    v = Data_Wrap_Struct(rb_cUSB_ ## ruby_name, 0, rusb_ ## c_name ## _free, d); \
-    st_add_direct(c_name ## _objects, (st_data_t)p, (st_data_t)v); \
+    v = TypedData_Wrap_Struct(rb_cUSB_ ## ruby_name, &rusb_ ## c_name ## _type, d); \
+    rusb_registry_add(c_name ## _objects, p, v); \
     return v; \
   } \
   static rusb_ ## c_name ## _t *check_usb_ ## c_name(VALUE v) \
   { \
-    Check_Type(v, T_DATA); \
-    if (RDATA(v)->dfree != rusb_ ## c_name ## _free) { \
-      rb_raise(rb_eTypeError, "wrong argument type %s (expected USB::" #ruby_name ")", \
-               rb_class2name(CLASS_OF(v))); \
-    } \
-    return DATA_PTR(v); \
+    return (rusb_ ## c_name ## _t *)rb_check_typeddata(v, &rusb_ ## c_name ## _type); \
   } \
   static rusb_ ## c_name ## _t *get_rusb_ ## c_name(VALUE v) \
   { \
@@ -90,40 +223,49 @@ define_usb_struct(interface, Interface)
 define_usb_struct(interface_descriptor, Setting)
 define_usb_struct(endpoint_descriptor, Endpoint)
 
-static int mark_data_i(st_data_t key, st_data_t val, st_data_t arg)
-{
-  if (DATA_PTR((VALUE)val))
-    rb_gc_mark((VALUE)val);
-  return ST_CONTINUE;
-}
+/* -------- USB::Bus -------- */
 
-VALUE rusb_gc_root;
-static void rusb_gc_mark(void *p) {
-  st_foreach(bus_objects, mark_data_i, 0);
-  st_foreach(device_objects, mark_data_i, 0);
-  st_foreach(config_descriptor_objects, mark_data_i, 0);
-  st_foreach(interface_objects, mark_data_i, 0);
-  st_foreach(interface_descriptor_objects, mark_data_i, 0);
-  st_foreach(endpoint_descriptor_objects, mark_data_i, 0);
+/* revokes all objects in the registry. */
+static void
+rusb_registry_revoke_all(VALUE registry)
+{
+  VALUE objs = rusb_registry_objects(registry);
+  long i;
+  for (i = 0; i < RARRAY_LEN(objs); i++) {
+    VALUE v = RARRAY_AREF(objs, i);
+    if (DATA_PTR(v))
+      rusb_revoke(v);
+  }
 }
 
-/* -------- USB::Bus -------- */
-static int revoke_data_i(st_data_t key, st_data_t val, st_data_t arg)
+/*
+ * the string reads in progress without the GVL.  They use a struct usb_device
+ * which a scan may free, so USB.find_busses, USB.find_devices and USB.rescan
+ * wait for them.
+ */
+static int rusb_strings_reading = 0;
+
+static void
+rusb_strings_wait(void)
 {
-  DATA_PTR((VALUE)val) = NULL;
-  return ST_DELETE;
+  while (rusb_strings_reading) {
+    struct timeval tv = { 0, 1000 };
+    rb_thread_wait_for(tv);
+  }
 }
 
 /* USB.find_busses */
 static VALUE
 rusb_find_busses(VALUE cUSB)
 {
-  st_foreach(bus_objects, revoke_data_i, 0);
-  st_foreach(device_objects, revoke_data_i, 0);
-  st_foreach(config_descriptor_objects, revoke_data_i, 0);
-  st_foreach(interface_objects, revoke_data_i, 0);
-  st_foreach(interface_descriptor_objects, revoke_data_i, 0);
-  st_foreach(endpoint_descriptor_objects, revoke_data_i, 0);
+  rusb_strings_wait();
+  rusb_registry_revoke_all(bus_objects);
+  rusb_registry_revoke_all(device_objects);
+  rusb_registry_revoke_all(config_descriptor_objects);
+  rusb_registry_revoke_all(interface_objects);
+  rusb_registry_revoke_all(interface_descriptor_objects);
+  rusb_registry_revoke_all(endpoint_descriptor_objects);
+  rusb_index = Qnil;
   return INT2NUM(usb_find_busses());
 }
 
@@ -131,9 +273,628 @@ rusb_find_busses(VALUE cUSB)
 static VALUE
 rusb_find_devices(VALUE cUSB)
 {
+  rusb_strings_wait();
+  rusb_index = Qnil;
   return INT2NUM(usb_find_devices());
 }
 
+/* -------- incremental rescan -------- */
+
+/* what identifies a device across rescans. */
+typedef struct {
+  struct usb_bus *bus;
+  unsigned char devnum;
+  unsigned short idVendor, idProduct, bcdDevice;
+  char *filename;
+} rusb_device_id_t;
+
+static void
+rusb_device_id_set(rusb_device_id_t *id, struct usb_device *d)
+{
+  id->bus = d->bus;
+  id->devnum = d->devnum;
+  id->idVendor = d->descriptor.idVendor;
+  id->idProduct = d->descriptor.idProduct;
+  id->bcdDevice = d->descriptor.bcdDevice;
+  id->filename = ALLOC_N(char, strlen(d->filename) + 1);
+  strcpy(id->filename, d->filename);
+}
+
+static int
+rusb_device_id_eq(rusb_device_id_t *id, struct usb_device *d)
+{
+  return id->bus == d->bus &&
+         id->devnum == d->devnum &&
+         id->idVendor == d->descriptor.idVendor &&
+         id->idProduct == d->descriptor.idProduct &&
+         id->bcdDevice == d->descriptor.bcdDevice &&
+         strcmp(id->filename, d->filename) == 0;
+}
+
+static int
+free_device_id_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  rusb_device_id_t *id = (rusb_device_id_t *)val;
+  xfree(id->filename);
+  xfree(id);
+  return ST_DELETE;
+}
+
+/*
+ * The objects below a device are found by their parent object,
+ * not by the structures, which may be freed already by libusb-0.1.
+ * revokes the objects in the registry whose parent is in parents
+ * and returns them, or NULL if last.
+ */
+static st_table *
+rusb_revoke_children(VALUE registry, st_table *parents, int last)
+{
+  st_table *revoked = last ? NULL : st_init_numtable();
+  if (parents->num_entries) {
+    VALUE objs = rusb_registry_objects(registry);
+    long i;
+    for (i = 0; i < RARRAY_LEN(objs); i++) {
+      VALUE v = RARRAY_AREF(objs, i);
+      rusb_wrap_t *d = DATA_PTR(v);
+      if (!d || !st_lookup(parents, (st_data_t)d->parent, 0))
+        continue;
+      rusb_revoke(v);
+      if (revoked)
+        st_add_direct(revoked, (st_data_t)v, 0);
+    }
+    RB_GC_GUARD(objs);
+  }
+  st_free_table(parents);
+  return revoked;
+}
+
+/*
+ * revokes the USB::Device object of d, if any, with all objects below it.
+ * d is used as a key only.
+ */
+static VALUE
+rusb_revoke_device(struct usb_device *d)
+{
+  VALUE v = rusb_registry_lookup(device_objects, d);
+  st_table *revoked;
+  if (NIL_P(v))
+    return Qnil;
+  rusb_revoke(v);
+  revoked = st_init_numtable();
+  st_add_direct(revoked, (st_data_t)v, 0);
+  revoked = rusb_revoke_children(config_descriptor_objects, revoked, 0);
+  revoked = rusb_revoke_children(interface_objects, revoked, 0);
+  revoked = rusb_revoke_children(interface_descriptor_objects, revoked, 0);
+  rusb_revoke_children(endpoint_descriptor_objects, revoked, 1);
+  return v;
+}
+
+static int
+revoke_device_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  VALUE v = rusb_revoke_device((struct usb_device *)key);
+  if (!NIL_P(v))
+    rb_ary_push((VALUE)arg, v);
+  free_device_id_i(key, val, 0);
+  return ST_DELETE;
+}
+
+#ifndef HAVE_LIBUSB_1_0
+/* revokes the USB::Bus objects of the busses removed. */
+static void
+rusb_revoke_busses(void)
+{
+  VALUE objs = rusb_registry_objects(bus_objects);
+  long i;
+  for (i = 0; i < RARRAY_LEN(objs); i++) {
+    VALUE v = RARRAY_AREF(objs, i);
+    rusb_bus_t *b = DATA_PTR(v);
+    struct usb_bus *bus;
+    if (!b)
+      continue;
+    for (bus = usb_get_busses(); bus; bus = bus->next)
+      if (bus == b->ptr)
+        break;
+    if (!bus)
+      rusb_revoke(v);
+  }
+}
+#endif
+
+/*
+ * USB.rescan
+ *
+ * updates the bus and device lists and returns [added, removed],
+ * the USB::Device objects of the devices attached and detached since
+ * the last scan.
+ *
+ * Unlike USB.find_busses, the objects of the devices still attached
+ * are kept valid.
+ * Only the objects of the devices detached are revoked,
+ * with their configurations, interfaces, settings and endpoints.
+ * removed contains the objects which existed before the rescan.
+ *
+ * A device is considered the same if libusb keeps its structure and
+ * its bus, device number, filename, vendor, product and release number
+ * are not changed.
+ */
+static VALUE
+rusb_rescan(VALUE cUSB)
+{
+  st_table *before = st_init_numtable();
+  struct usb_bus *bus;
+  struct usb_device *d;
+  rusb_device_id_t *id;
+  VALUE added = rb_ary_new(), removed = rb_ary_new();
+  int ret;
+
+  rusb_strings_wait();
+  for (bus = usb_get_busses(); bus; bus = bus->next)
+    for (d = bus->devices; d; d = d->next) {
+      id = ALLOC(rusb_device_id_t);
+      rusb_device_id_set(id, d);
+      st_add_direct(before, (st_data_t)d, (st_data_t)id);
+    }
+
+#ifdef HAVE_LIBUSB_1_0
+  ret = rusb1_update();
+#else
+  ret = usb_find_busses();
+  if (0 <= ret)
+    ret = usb_find_devices();
+#endif
+  if (ret < 0) {
+    st_foreach(before, free_device_id_i, 0);
+    st_free_table(before);
+    check_usb_error("usb_find_devices", ret);
+  }
+
+  for (bus = usb_get_busses(); bus; bus = bus->next)
+    for (d = bus->devices; d; d = d->next) {
+      st_data_t key = (st_data_t)d, val;
+      if (st_delete(before, &key, &val)) {
+        int same = rusb_device_id_eq((rusb_device_id_t *)val, d);
+        free_device_id_i(key, val, 0);
+        if (same)
+          continue;
+        /* a new device allocated at the address of a device removed. */
+        val = (st_data_t)rusb_revoke_device(d);
+        if (!NIL_P((VALUE)val))
+          rb_ary_push(removed, (VALUE)val);
+      }
+      rb_ary_push(added, rusb_device_make(d, rusb_bus_make(d->bus, Qnil)));
+    }
+  st_foreach(before, revoke_device_i, (st_data_t)removed);
+  st_free_table(before);
+
+#ifdef HAVE_LIBUSB_1_0
+  /* including the devices reported as :left by hotplug already. */
+  for (d = rusb1_get_removed(); d; d = d->next)
+    rusb_revoke_device(d);
+  rusb1_free_removed();
+#else
+  rusb_revoke_busses();
+#endif
+
+  if (RARRAY_LEN(added) || RARRAY_LEN(removed) || ret)
+    rusb_index = Qnil;
+  return rb_assoc_new(added, removed);
+}
+
+/* -------- device index -------- */
+
+static int
+rusb_bus_cmp(const void *a, const void *b)
+{
+  return strcmp((*(struct usb_bus **)a)->dirname, (*(struct usb_bus **)b)->dirname);
+}
+
+static int
+rusb_device_cmp(const void *a, const void *b)
+{
+  return strcmp((*(struct usb_device **)a)->filename, (*(struct usb_device **)b)->filename);
+}
+
+/*
+ * The index refers to the structures by their registry keys, so that it
+ * doesn't keep the objects alive; USB.usb_lookup makes the objects
+ * through the registries.  The structures are valid while the index is,
+ * as it is dropped when the device lists change.
+ */
+#define RUSB_INDEX_PTR(k) ((void *)((uintptr_t)FIX2LONG(k) << 2))
+
+#define RUSB_INDEX_KEY_CLASS(c) (c)
+#define RUSB_INDEX_KEY_SUBCLASS(c, s) (0x10000 | ((c) << 8) | (s))
+#define RUSB_INDEX_KEY_PROTOCOL(c, s, p) (0x1000000 | ((c) << 16) | ((s) << 8) | (p))
+
+static void
+rusb_index_push(VALUE hash, long key, VALUE vdev)
+{
+  VALUE k = LONG2NUM(key);
+  VALUE ary = rb_hash_lookup(hash, k);
+  if (NIL_P(ary)) {
+    rb_hash_aset(hash, k, rb_ary_new3(1, vdev));
+    return;
+  }
+  if (rb_ary_entry(ary, -1) != vdev)
+    rb_ary_push(ary, vdev);
+}
+
+static void
+rusb_index_class(VALUE hash, int c, int s, int p, VALUE vdev)
+{
+  rusb_index_push(hash, RUSB_INDEX_KEY_CLASS(c), vdev);
+  rusb_index_push(hash, RUSB_INDEX_KEY_SUBCLASS(c, s), vdev);
+  rusb_index_push(hash, RUSB_INDEX_KEY_PROTOCOL(c, s, p), vdev);
+}
+
+#ifdef HAVE_LIBUSB_GET_PORT_NUMBERS
+/* returns the port path as "bus-port.port...", or nil for a root hub. */
+static VALUE
+rusb_port_path(struct usb_device *d)
+{
+  uint8_t ports[8];
+  int n = libusb_get_port_numbers(d->dev, ports, (int)sizeof(ports)), i;
+  VALUE path;
+  if (n <= 0)
+    return Qnil;
+  path = rb_sprintf("%u-%u", d->bus->location, ports[0]);
+  for (i = 1; i < n; i++)
+    rb_str_catf(path, ".%u", ports[i]);
+  return path;
+}
+
+/* USB::Device#port_path */
+static VALUE
+rusb_device_port_path(VALUE v)
+{
+  return rusb_port_path(get_usb_device(v));
+}
+#endif
+
+static VALUE
+rusb_index_build(void)
+{
+  VALUE index = rb_hash_new();
+  VALUE busses = rb_hash_new(), devices = rb_hash_new();
+  VALUE vendors = rb_hash_new(), ids = rb_hash_new();
+  VALUE classes = rb_hash_new(), ports = rb_hash_new();
+  struct usb_bus *bus, **bs;
+  struct usb_device *d, **ds;
+  long nb = 0, nd, b, k;
+  int c, i, j;
+  VALUE tmp, tmp2;
+
+  rb_hash_aset(index, ID2SYM(rb_intern("bus")), busses);
+  rb_hash_aset(index, ID2SYM(rb_intern("device")), devices);
+  rb_hash_aset(index, ID2SYM(rb_intern("vendor")), vendors);
+  rb_hash_aset(index, ID2SYM(rb_intern("ids")), ids);
+  rb_hash_aset(index, ID2SYM(rb_intern("class")), classes);
+  rb_hash_aset(index, ID2SYM(rb_intern("port")), ports);
+
+  /* in the order of USB.devices: busses by dirname, devices by filename. */
+  for (bus = usb_get_busses(); bus; bus = bus->next)
+    nb++;
+  bs = ALLOCV_N(struct usb_bus *, tmp, nb);
+  for (bus = usb_get_busses(), b = 0; bus; bus = bus->next)
+    bs[b++] = bus;
+  qsort(bs, nb, sizeof(*bs), rusb_bus_cmp);
+  for (b = 0; b < nb; b++) {
+    long busnum;
+    bus = bs[b];
+    busnum = atol(bus->dirname);
+    if (NIL_P(rb_hash_lookup(busses, LONG2NUM(busnum))))
+      rb_hash_aset(busses, LONG2NUM(busnum), RUSB_REGISTRY_KEY(bus));
+    for (d = bus->devices, nd = 0; d; d = d->next)
+      nd++;
+    ds = ALLOCV_N(struct usb_device *, tmp2, nd);
+    for (d = bus->devices, k = 0; d; d = d->next)
+      ds[k++] = d;
+    qsort(ds, nd, sizeof(*ds), rusb_device_cmp);
+    for (k = 0; k < nd; k++) {
+      VALUE vdev, key;
+      struct usb_device_descriptor *desc;
+      d = ds[k];
+      vdev = RUSB_REGISTRY_KEY(d);
+      desc = &d->descriptor;
+      key = LONG2NUM((busnum << 16) | (atol(d->filename) & 0xffff));
+      if (NIL_P(rb_hash_lookup(devices, key)))
+        rb_hash_aset(devices, key, vdev);
+      rusb_index_push(vendors, desc->idVendor, vdev);
+      rusb_index_push(ids, ((long)desc->idVendor << 16) | desc->idProduct, vdev);
+      if (desc->bDeviceClass != USB_CLASS_PER_INTERFACE) {
+        rusb_index_class(classes, desc->bDeviceClass, desc->bDeviceSubClass, desc->bDeviceProtocol, vdev);
+      }
+      else if (d->config) {
+        for (c = 0; c < desc->bNumConfigurations; c++) {
+          struct usb_config_descriptor *config = &d->config[c];
+          for (i = 0; i < config->bNumInterfaces; i++) {
+            struct usb_interface *interface = &config->interface[i];
+            for (j = 0; j < interface->num_altsetting; j++) {
+              struct usb_interface_descriptor *s = &interface->altsetting[j];
+              rusb_index_class(classes, s->bInterfaceClass, s->bInterfaceSubClass, s->bInterfaceProtocol, vdev);
+            }
+          }
+        }
+      }
+#ifdef HAVE_LIBUSB_GET_PORT_NUMBERS
+      key = rusb_port_path(d);
+      if (!NIL_P(key))
+        rb_hash_aset(ports, key, vdev);
+#endif
+    }
+    ALLOCV_END(tmp2);
+  }
+  ALLOCV_END(tmp);
+  return index;
+}
+
+static VALUE
+rusb_index_device(VALUE k)
+{
+  struct usb_device *d = RUSB_INDEX_PTR(k);
+  return rusb_device_make(d, rusb_bus_make(d->bus, Qnil));
+}
+
+/*
+ * USB.usb_lookup(kind, key)
+ *
+ * looks up the device index:
+ *   :bus => {busnum => bus}
+ *   :device => {busnum << 16 | devnum => device}
+ *   :vendor => {vendor => [device, ...]}
+ *   :ids => {vendor << 16 | product => [device, ...]}
+ *   :class => {class-key => [device, ...]}
+ *   :port => {"bus-port.port..." => device}
+ * busnum and devnum are the numbers of the dirname and the filename.
+ * The class keys are made by RUSB_INDEX_KEY_* from the device class or,
+ * for a device with per-interface class, the classes of its settings.
+ * It returns the bus, the device, a new Array of the devices in the
+ * order of USB.devices, or nil if the key is not found.
+ */
+static VALUE
+rusb_usb_lookup(VALUE cUSB, VALUE vkind, VALUE vkey)
+{
+  VALUE table, v, result;
+  long i;
+  if (NIL_P(rusb_index))
+    rusb_index = rusb_index_build();
+  table = rb_hash_lookup(rusb_index, vkind);
+  if (NIL_P(table))
+    rb_raise(rb_eArgError, "unknown index: %"PRIsVALUE, rb_inspect(vkind));
+  v = rb_hash_lookup(table, vkey);
+  if (NIL_P(v))
+    return Qnil;
+  if (vkind == ID2SYM(rb_intern("bus")))
+    return rusb_bus_make(RUSB_INDEX_PTR(v), Qnil);
+  if (!RB_TYPE_P(v, T_ARRAY))
+    return rusb_index_device(v);
+  result = rb_ary_new2(RARRAY_LEN(v));
+  for (i = 0; i < RARRAY_LEN(v); i++)
+    rb_ary_push(result, rusb_index_device(RARRAY_AREF(v, i)));
+  return result;
+}
+
+/* -------- flattened enumeration -------- */
+
+enum {
+  RUSB_LEVEL_BUS,
+  RUSB_LEVEL_DEVICE,
+  RUSB_LEVEL_CONFIG,
+  RUSB_LEVEL_INTERFACE,
+  RUSB_LEVEL_SETTING,
+  RUSB_LEVEL_ENDPOINT
+};
+
+/*
+ * The objects are pushed to result, or yielded if result is nil.
+ * A block may revoke the objects, so the walk of an object stops when
+ * it is revoked after a yield.  The walk functions return 0 then.
+ * The structures are not freed before the objects are revoked.
+ */
+#define RUSB_EMIT(result, v, valive) \
+  do { \
+    if (NIL_P(result)) { \
+      rb_yield(v); \
+      if (!DATA_PTR(valive)) return 0; \
+    } \
+    else { \
+      rb_ary_push((result), (v)); \
+    } \
+  } while (0)
+
+static int
+rusb_walk_setting(VALUE vs, int level, VALUE result, VALUE valive)
+{
+  struct usb_interface_descriptor *s = ((rusb_interface_descriptor_t *)DATA_PTR(vs))->ptr;
+  int i;
+  if (level == RUSB_LEVEL_SETTING) {
+    RUSB_EMIT(result, vs, valive);
+    return 1;
+  }
+  for (i = 0; i < s->bNumEndpoints; i++)
+    RUSB_EMIT(result, rusb_endpoint_descriptor_make(&s->endpoint[i], vs), valive);
+  return 1;
+}
+
+static int
+rusb_walk_interface(VALUE vi, int level, VALUE result, VALUE valive)
+{
+  struct usb_interface *interface = ((rusb_interface_t *)DATA_PTR(vi))->ptr;
+  int i;
+  if (level == RUSB_LEVEL_INTERFACE) {
+    RUSB_EMIT(result, vi, valive);
+    return 1;
+  }
+  for (i = 0; i < interface->num_altsetting; i++) {
+    VALUE vs = rusb_interface_descriptor_make(&interface->altsetting[i], vi);
+    if (!rusb_walk_setting(vs, level, result, valive))
+      return 0;
+  }
+  return 1;
+}
+
+static int
+rusb_walk_config(VALUE vc, int level, VALUE result, VALUE valive)
+{
+  struct usb_config_descriptor *config = ((rusb_config_descriptor_t *)DATA_PTR(vc))->ptr;
+  int i;
+  if (level == RUSB_LEVEL_CONFIG) {
+    RUSB_EMIT(result, vc, valive);
+    return 1;
+  }
+  for (i = 0; i < config->bNumInterfaces; i++) {
+    VALUE vi = rusb_interface_make(&config->interface[i], vc);
+    if (!rusb_walk_interface(vi, level, result, valive))
+      return 0;
+  }
+  return 1;
+}
+
+static int
+rusb_walk_device(VALUE vdev, int level, VALUE result, VALUE valive)
+{
+  struct usb_device *d = ((rusb_device_t *)DATA_PTR(vdev))->ptr;
+  int i;
+  if (level == RUSB_LEVEL_DEVICE) {
+    RUSB_EMIT(result, vdev, valive);
+    return 1;
+  }
+  if (!d->config)
+    return 1;
+  for (i = 0; i < d->descriptor.bNumConfigurations; i++) {
+    VALUE vc = rusb_config_descriptor_make(&d->config[i], vdev);
+    if (!rusb_walk_config(vc, level, result, valive))
+      return 0;
+  }
+  return 1;
+}
+
+/* returns the devices of the bus sorted by filename. */
+static VALUE
+rusb_bus_sorted_devices(VALUE vbus)
+{
+  struct usb_bus *bus = ((rusb_bus_t *)DATA_PTR(vbus))->ptr;
+  struct usb_device *d, **ds;
+  long n = 0, i;
+  VALUE tmp, ary;
+  for (d = bus->devices; d; d = d->next)
+    n++;
+  ds = ALLOCV_N(struct usb_device *, tmp, n);
+  for (d = bus->devices, i = 0; d; d = d->next)
+    ds[i++] = d;
+  qsort(ds, n, sizeof(*ds), rusb_device_cmp);
+  ary = rb_ary_new2(n);
+  for (i = 0; i < n; i++)
+    rb_ary_push(ary, rusb_device_make(ds[i], vbus));
+  ALLOCV_END(tmp);
+  return ary;
+}
+
+static void
+rusb_walk_bus(VALUE vbus, int level, VALUE result)
+{
+  VALUE devices;
+  long i;
+  if (level == RUSB_LEVEL_BUS) {
+    if (NIL_P(result))
+      rb_yield(vbus);
+    else
+      rb_ary_push(result, vbus);
+    return;
+  }
+  devices = rusb_bus_sorted_devices(vbus);
+  for (i = 0; i < RARRAY_LEN(devices); i++) {
+    VALUE vdev = RARRAY_AREF(devices, i);
+    if (!DATA_PTR(vbus))
+      return;
+    if (DATA_PTR(vdev))
+      rusb_walk_device(vdev, level, result, vdev);
+  }
+}
+
+/* returns the busses sorted by dirname. */
+static VALUE
+rusb_sorted_busses(void)
+{
+  struct usb_bus *bus, **bs;
+  long n = 0, i;
+  VALUE tmp, ary;
+  for (bus = usb_get_busses(); bus; bus = bus->next)
+    n++;
+  bs = ALLOCV_N(struct usb_bus *, tmp, n);
+  for (bus = usb_get_busses(), i = 0; bus; bus = bus->next)
+    bs[i++] = bus;
+  qsort(bs, n, sizeof(*bs), rusb_bus_cmp);
+  ary = rb_ary_new2(n);
+  for (i = 0; i < n; i++)
+    rb_ary_push(ary, rusb_bus_make(bs[i], Qnil));
+  ALLOCV_END(tmp);
+  return ary;
+}
+
+static int
+rusb_enumerate_level(VALUE vlevel)
+{
+  ID id = SYM2ID(vlevel);
+  if (id == rb_intern("busses")) return RUSB_LEVEL_BUS;
+  if (id == rb_intern("devices")) return RUSB_LEVEL_DEVICE;
+  if (id == rb_intern("configurations")) return RUSB_LEVEL_CONFIG;
+  if (id == rb_intern("interfaces")) return RUSB_LEVEL_INTERFACE;
+  if (id == rb_intern("settings")) return RUSB_LEVEL_SETTING;
+  if (id == rb_intern("endpoints")) return RUSB_LEVEL_ENDPOINT;
+  rb_raise(rb_eArgError, "unexpected level: %s", rb_id2name(id));
+}
+
+/*
+ * USB.usb_enumerate(root, level)
+ *
+ * returns the objects at level below root, walking the tree once.
+ * root is nil for all busses, or a USB::Bus, USB::Device,
+ * USB::Configuration, USB::Interface or USB::Setting.
+ * level is :busses, :devices, :configurations, :interfaces, :settings
+ * or :endpoints.
+ * Busses are sorted by dirname and devices by filename.
+ * If a block is given, the objects are yielded one by one instead
+ * and nil is returned.
+ */
+static VALUE
+rusb_enumerate(VALUE cUSB, VALUE root, VALUE vlevel)
+{
+  int level = rusb_enumerate_level(vlevel), root_level;
+  VALUE result = rb_block_given_p() ? Qnil : rb_ary_new();
+
+  if (NIL_P(root)) {
+    VALUE busses = rusb_sorted_busses();
+    long i;
+    for (i = 0; i < RARRAY_LEN(busses); i++) {
+      VALUE vbus = RARRAY_AREF(busses, i);
+      if (DATA_PTR(vbus))
+        rusb_walk_bus(vbus, level, result);
+    }
+    return result;
+  }
+
+  if (rb_typeddata_is_kind_of(root, &rusb_bus_type)) { get_rusb_bus(root); root_level = RUSB_LEVEL_BUS; }
+  else if (rb_typeddata_is_kind_of(root, &rusb_device_type)) { get_rusb_device(root); root_level = RUSB_LEVEL_DEVICE; }
+  else if (rb_typeddata_is_kind_of(root, &rusb_config_descriptor_type)) { get_rusb_config_descriptor(root); root_level = RUSB_LEVEL_CONFIG; }
+  else if (rb_typeddata_is_kind_of(root, &rusb_interface_type)) { get_rusb_interface(root); root_level = RUSB_LEVEL_INTERFACE; }
+  else if (rb_typeddata_is_kind_of(root, &rusb_interface_descriptor_type)) { get_rusb_interface_descriptor(root); root_level = RUSB_LEVEL_SETTING; }
+  else
+    rb_raise(rb_eTypeError, "wrong argument type %s", rb_class2name(CLASS_OF(root)));
+  if (level <= root_level)
+    rb_raise(rb_eArgError, "no %s below %s", rb_id2name(SYM2ID(vlevel)), rb_class2name(CLASS_OF(root)));
+
+  switch (root_level) {
+    case RUSB_LEVEL_BUS: rusb_walk_bus(root, level, result); break;
+    case RUSB_LEVEL_DEVICE: rusb_walk_device(root, level, result, root); break;
+    case RUSB_LEVEL_CONFIG: rusb_walk_config(root, level, result, root); break;
+    case RUSB_LEVEL_INTERFACE: rusb_walk_interface(root, level, result, root); break;
+    case RUSB_LEVEL_SETTING: rusb_walk_setting(root, level, result, root); break;
+  }
+  return result;
+}
+
 /* USB.first_bus */
 static VALUE
 rusb_first_bus(VALUE cUSB)
@@ -264,7 +1025,7 @@ rusb_device_open(VALUE vdevice)
 {
   struct usb_device *device = get_usb_device(vdevice);
   usb_dev_handle *h = usb_open(device);
-  return rusb_dev_handle_new(h);
+  return rusb_dev_handle_new(h, device);
 }
 
 /* -------- USB::Configuration -------- */
@@ -429,113 +1190,2408 @@ static VALUE rusb_endpoint_bRefresh(VALUE v) { return INT2FIX(get_usb_endpoint_d
 /* USB::Endpoint#bSynchAddress */
 static VALUE rusb_endpoint_bSynchAddress(VALUE v) { return INT2FIX(get_usb_endpoint_descriptor(v)->bSynchAddress); }
 
-/* -------- USB::DevHandle -------- */
+/* -------- descriptor snapshots -------- */
 
-static VALUE rb_cUSB_DevHandle;
+static VALUE rb_cUSB_DeviceDescriptor;
+static VALUE rb_cUSB_ConfigDescriptor;
+static VALUE rb_cUSB_SettingDescriptor;
+static VALUE rb_cUSB_EndpointDescriptor;
 
-void rusb_devhandle_free(void *_h)
+/* USB::Device#descriptor */
+static VALUE
+rusb_device_descriptor(VALUE v)
 {
-  usb_dev_handle *h = (usb_dev_handle *)_h;
-  if (h) usb_close(h);
+  struct usb_device_descriptor *p = &get_usb_device(v)->descriptor;
+  return rb_obj_freeze(rb_struct_new(rb_cUSB_DeviceDescriptor,
+    INT2FIX(p->bLength), INT2FIX(p->bDescriptorType), INT2FIX(p->bcdUSB),
+    INT2FIX(p->bDeviceClass), INT2FIX(p->bDeviceSubClass), INT2FIX(p->bDeviceProtocol),
+    INT2FIX(p->bMaxPacketSize0), INT2FIX(p->idVendor), INT2FIX(p->idProduct),
+    INT2FIX(p->bcdDevice), INT2FIX(p->iManufacturer), INT2FIX(p->iProduct),
+    INT2FIX(p->iSerialNumber), INT2FIX(p->bNumConfigurations)));
 }
 
+/* USB::Configuration#descriptor */
 static VALUE
-rusb_dev_handle_new(usb_dev_handle *h)
+rusb_config_descriptor(VALUE v)
 {
-  return Data_Wrap_Struct(rb_cUSB_DevHandle, 0, rusb_devhandle_free, h);
+  struct usb_config_descriptor *p = get_usb_config_descriptor(v);
+  return rb_obj_freeze(rb_struct_new(rb_cUSB_ConfigDescriptor,
+    INT2FIX(p->bLength), INT2FIX(p->bDescriptorType), INT2FIX(p->wTotalLength),
+    INT2FIX(p->bNumInterfaces), INT2FIX(p->bConfigurationValue), INT2FIX(p->iConfiguration),
+    INT2FIX(p->bmAttributes), INT2FIX(p->MaxPower)));
 }
 
-static usb_dev_handle *check_usb_devhandle(VALUE v)
+/* USB::Setting#descriptor */
+static VALUE
+rusb_setting_descriptor(VALUE v)
 {
-  Check_Type(v, T_DATA);
-  if (RDATA(v)->dfree != rusb_devhandle_free) {
-    rb_raise(rb_eTypeError, "wrong argument type %s (expected USB::DevHandle)",
-             rb_class2name(CLASS_OF(v)));
-  }
-  return DATA_PTR(v);
+  struct usb_interface_descriptor *p = get_usb_interface_descriptor(v);
+  return rb_obj_freeze(rb_struct_new(rb_cUSB_SettingDescriptor,
+    INT2FIX(p->bLength), INT2FIX(p->bDescriptorType), INT2FIX(p->bInterfaceNumber),
+    INT2FIX(p->bAlternateSetting), INT2FIX(p->bNumEndpoints), INT2FIX(p->bInterfaceClass),
+    INT2FIX(p->bInterfaceSubClass), INT2FIX(p->bInterfaceProtocol), INT2FIX(p->iInterface)));
 }
 
-static usb_dev_handle *get_usb_devhandle(VALUE v)
+/* USB::Endpoint#descriptor */
+static VALUE
+rusb_endpoint_descriptor(VALUE v)
 {
-  usb_dev_handle *p = check_usb_devhandle(v); \
-  if (!p) {
-    rb_raise(rb_eArgError, "closed USB::DevHandle");
-  }
-  return p;
-} 
+  struct usb_endpoint_descriptor *p = get_usb_endpoint_descriptor(v);
+  return rb_obj_freeze(rb_struct_new(rb_cUSB_EndpointDescriptor,
+    INT2FIX(p->bLength), INT2FIX(p->bDescriptorType), INT2FIX(p->bEndpointAddress),
+    INT2FIX(p->bmAttributes), INT2FIX(p->wMaxPacketSize), INT2FIX(p->bInterval),
+    INT2FIX(p->bRefresh), INT2FIX(p->bSynchAddress)));
+}
 
-static int check_usb_error(char *reason, int ret)
+/* -------- string descriptor cache -------- */
+
+/*
+ * {device identity => {index | langid << 8 => String or nil}}
+ * The identity is made from the bus, filename and device descriptor,
+ * so the strings survive USB.find_busses and USB.rescan.
+ * langid 0 means the first language of the device.
+ */
+static VALUE rusb_string_cache = Qnil;
+
+#define RUSB_STRING_MAX 255
+#define RUSB_STRING_UTF8_MAX (RUSB_STRING_MAX / 2 * 3)
+
+typedef struct {
+  int index;
+  int langid;
+  int ret; /* length of str or -errno */
+  char str[RUSB_STRING_UTF8_MAX + 1];
+} rusb_string_req_t;
+
+typedef struct {
+  int interface;
+  int ret; /* 0 or -errno */
+  char name[256];
+} rusb_driver_req_t;
+
+typedef struct {
+  struct usb_device *device;
+  rusb_string_req_t *reqs;
+  int n;
+  rusb_driver_req_t *drivers;
+  int ndrivers;
+  int timeout;
+  int error; /* the first error other than a stall */
+} rusb_strings_t;
+
+/* converts UTF-16LE to UTF-8 and returns the length. */
+static int
+rusb_utf16le_to_utf8(const unsigned char *src, int len, char *dst)
 {
-  if (ret < 0) {
-    errno = -ret;
-    rb_sys_fail(reason);
+  unsigned char *p = (unsigned char *)dst;
+  int i;
+  for (i = 0; i + 1 < len; i += 2) {
+    unsigned int c = src[i] | (src[i+1] << 8);
+    if (0xd800 <= c && c < 0xdc00 && i + 3 < len) {
+      unsigned int c2 = src[i+2] | (src[i+3] << 8);
+      if (0xdc00 <= c2 && c2 < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+        i += 2;
+      }
+    }
+    if (0xd800 <= c && c < 0xe000)
+      c = 0xfffd;
+    if (c < 0x80) {
+      *p++ = c;
+    }
+    else if (c < 0x800) {
+      *p++ = 0xc0 | (c >> 6);
+      *p++ = 0x80 | (c & 0x3f);
+    }
+    else if (c < 0x10000) {
+      *p++ = 0xe0 | (c >> 12);
+      *p++ = 0x80 | ((c >> 6) & 0x3f);
+      *p++ = 0x80 | (c & 0x3f);
+    }
+    else {
+      *p++ = 0xf0 | (c >> 18);
+      *p++ = 0x80 | ((c >> 12) & 0x3f);
+      *p++ = 0x80 | ((c >> 6) & 0x3f);
+      *p++ = 0x80 | (c & 0x3f);
+    }
   }
-  return ret;
+  return (int)(p - (unsigned char *)dst);
 }
 
-/* USB::DevHandle#usb_close */
-static VALUE
-rusb_close(VALUE v)
+/* reads a string descriptor and returns its length or -errno. */
+static int
+rusb_read_string_descriptor(usb_dev_handle *h, int index, int langid, unsigned char *buf, int timeout)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  check_usb_error("usb_close", usb_close(p));
-  DATA_PTR(v) = NULL;
-  return Qnil;
+  int ret = usb_control_msg(h, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR,
+                            (USB_DT_STRING << 8) | index, langid,
+                            (char *)buf, RUSB_STRING_MAX, timeout);
+  if (ret < 0)
+    return ret;
+  if (ret < 2 || buf[1] != USB_DT_STRING)
+    return -EIO;
+  return buf[0] < ret ? buf[0] : ret;
 }
 
-/* USB::DevHandle#usb_set_configuration(configuration) */
-static VALUE
-rusb_set_configuration(VALUE v, VALUE configuration)
+/*
+ * reads the requested strings and drivers with one open of the device.
+ * It gives up the strings after an error other than a stall,
+ * so that an unresponsive device costs one timeout.
+ */
+static void *
+rusb_strings_read(void *p)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ret = usb_set_configuration(p, NUM2INT(configuration));
-  check_usb_error("usb_set_configuration", ret);
-  return Qnil;
+  rusb_strings_t *s = (rusb_strings_t *)p;
+  unsigned char buf[RUSB_STRING_MAX];
+  int i, ret, first_langid = -1, error = 0;
+  usb_dev_handle *h;
+
+  errno = 0;
+  h = usb_open(s->device);
+  if (!h)
+    error = errno ? -errno : -EIO;
+  for (i = 0; i < s->ndrivers; i++) {
+    rusb_driver_req_t *r = &s->drivers[i];
+#ifdef LIBUSB_HAS_GET_DRIVER_NP
+    r->ret = h ? usb_get_driver_np(h, r->interface, r->name, sizeof(r->name)) : error;
+    r->name[sizeof(r->name) - 1] = '\0';
+#else
+    r->ret = -ENOSYS;
+#endif
+  }
+  for (i = 0; i < s->n; i++) {
+    rusb_string_req_t *r = &s->reqs[i];
+    int langid = r->langid;
+    if (error) {
+      r->ret = error;
+      continue;
+    }
+    if (langid == 0) {
+      if (first_langid < 0) {
+        ret = rusb_read_string_descriptor(h, 0, 0, buf, s->timeout);
+        if (ret < 0 && ret != -EPIPE)
+          error = ret;
+        first_langid = 4 <= ret ? (buf[2] | (buf[3] << 8)) : 0;
+      }
+      if (first_langid == 0) {
+        r->ret = error ? error : -EPIPE;
+        continue;
+      }
+      langid = first_langid;
+    }
+    ret = rusb_read_string_descriptor(h, r->index, langid, buf, s->timeout);
+    if (ret < 0) {
+      r->ret = ret;
+      if (ret != -EPIPE)
+        error = ret;
+      continue;
+    }
+    r->ret = rusb_utf16le_to_utf8(buf + 2, ret - 2, r->str);
+  }
+  if (h)
+    usb_close(h);
+  s->error = error;
+  return NULL;
 }
 
-/* USB::DevHandle#usb_set_altinterface(alternate) */
 static VALUE
-rusb_set_altinterface(VALUE v, VALUE alternate)
+rusb_strings_read_body(VALUE arg)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ret = usb_set_altinterface(p, NUM2INT(alternate));
-  check_usb_error("usb_set_altinterface", ret);
+  rusb_without_gvl(rusb_strings_read, (void *)arg);
   return Qnil;
 }
 
-/* USB::DevHandle#usb_clear_halt(endpoint) */
 static VALUE
-rusb_clear_halt(VALUE v, VALUE ep)
+rusb_strings_read_ensure(VALUE arg)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ret = usb_clear_halt(p, NUM2UINT(ep));
-  check_usb_error("usb_clear_halt", ret);
+  rusb_strings_reading--;
   return Qnil;
 }
 
-/* USB::DevHandle#usb_reset */
-static VALUE
-rusb_reset(VALUE v)
+/* runs rusb_strings_read without the GVL, counted by rusb_strings_reading. */
+static void
+rusb_strings_read_nogvl(rusb_strings_t *s)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ret = usb_reset(p);
-  check_usb_error("usb_reset", ret);
-  /* xxx: call usb_close? */
-  return Qnil;
+  rusb_strings_reading++;
+  rb_ensure(rusb_strings_read_body, (VALUE)s, rusb_strings_read_ensure, Qnil);
 }
 
-/* USB::DevHandle#usb_claim_interface(interface) */
 static VALUE
-rusb_claim_interface(VALUE v, VALUE interface)
+rusb_device_identity(struct usb_device *d)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ret = usb_claim_interface(p, NUM2INT(interface));
-  check_usb_error("usb_claim_interface", ret);
-  return Qnil;
+  return rb_sprintf("%s/%s %04x:%04x %04x", d->bus->dirname, d->filename,
+                    d->descriptor.idVendor, d->descriptor.idProduct,
+                    d->descriptor.bcdDevice);
 }
 
-/* USB::DevHandle#usb_release_interface(interface) */
-static VALUE
+static int
+rusb_string_req_add(rusb_string_req_t *reqs, int n, VALUE entry, int index, int langid)
+{
+  int i;
+  if (index == 0 || rb_hash_lookup2(entry, INT2FIX(index | (langid << 8)), Qundef) != Qundef)
+    return n;
+  for (i = 0; i < n; i++)
+    if (reqs[i].index == index && reqs[i].langid == langid)
+      return n;
+  reqs[n].index = index;
+  reqs[n].langid = langid;
+  return n + 1;
+}
+
+/* counts the string indexes in the descriptors of d. */
+static int
+rusb_device_string_count(struct usb_device *d)
+{
+  int n = 3, c, i;
+  if (!d->config)
+    return n;
+  for (c = 0; c < d->descriptor.bNumConfigurations; c++) {
+    n++;
+    for (i = 0; i < d->config[c].bNumInterfaces; i++)
+      n += d->config[c].interface[i].num_altsetting;
+  }
+  return n;
+}
+
+/*
+ * adds the strings of d not cached yet, in the first language,
+ * to reqs and returns the number of requests.
+ */
+static int
+rusb_device_string_reqs(struct usb_device *d, VALUE entry, rusb_string_req_t *reqs, int n)
+{
+  int c, i, j;
+  n = rusb_string_req_add(reqs, n, entry, d->descriptor.iManufacturer, 0);
+  n = rusb_string_req_add(reqs, n, entry, d->descriptor.iProduct, 0);
+  n = rusb_string_req_add(reqs, n, entry, d->descriptor.iSerialNumber, 0);
+  if (!d->config)
+    return n;
+  for (c = 0; c < d->descriptor.bNumConfigurations; c++) {
+    struct usb_config_descriptor *config = &d->config[c];
+    n = rusb_string_req_add(reqs, n, entry, config->iConfiguration, 0);
+    for (i = 0; i < config->bNumInterfaces; i++)
+      for (j = 0; j < config->interface[i].num_altsetting; j++)
+        n = rusb_string_req_add(reqs, n, entry, config->interface[i].altsetting[j].iInterface, 0);
+  }
+  return n;
+}
+
+/*
+ * stores the strings read to entry.
+ * A stall or EFBIG is cached as nil, as get_string_simple returns nil
+ * for them.  Other errors are not cached: EPERM and EACCES depend on the
+ * permissions of the process, which a udev rule may change.
+ */
+static void
+rusb_strings_store(VALUE entry, rusb_string_req_t *reqs, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    rusb_string_req_t *r = &reqs[i];
+    VALUE key = INT2FIX(r->index | (r->langid << 8));
+    if (0 <= r->ret)
+      rb_hash_aset(entry, key, rb_obj_freeze(rb_utf8_str_new(r->str, r->ret)));
+    else if (r->ret == -EPIPE || r->ret == -EFBIG)
+      rb_hash_aset(entry, key, Qnil);
+  }
+}
+
+/* reads the strings of reqs and stores them to entry. */
+static void
+rusb_strings_fetch(struct usb_device *d, VALUE entry, rusb_string_req_t *reqs, int n, int timeout)
+{
+  rusb_strings_t s;
+  if (n == 0)
+    return;
+  s.device = d;
+  s.reqs = reqs;
+  s.n = n;
+  s.drivers = NULL;
+  s.ndrivers = 0;
+  s.timeout = timeout;
+  rusb_strings_read_nogvl(&s);
+  rusb_strings_store(entry, reqs, n);
+}
+
+static VALUE
+rusb_string_cache_entry(struct usb_device *d)
+{
+  VALUE id = rusb_device_identity(d);
+  VALUE entry = rb_hash_lookup(rusb_string_cache, id);
+  if (NIL_P(entry)) {
+    entry = rb_hash_new();
+    rb_hash_aset(rusb_string_cache, rb_obj_freeze(id), entry);
+  }
+  return entry;
+}
+
+/*
+ * USB::Device#usb_string(index, langid, timeout)
+ *
+ * returns the string descriptor _index_ in _langid_ as an UTF-8 String,
+ * or nil if the device has no such string.
+ * langid 0 means the first language of the device.
+ * The strings are cached by device identity.
+ * nil is also returned, but not cached, if the process may not read it.
+ * At the first miss of a device in the first language, all strings
+ * referred by its descriptors are read with one open of the device,
+ * each request within timeout milliseconds.
+ */
+static VALUE
+rusb_device_usb_string(VALUE v, VALUE vindex, VALUE vlangid, VALUE vtimeout)
+{
+  struct usb_device *d = get_usb_device(v);
+  int index = NUM2INT(vindex), langid = NUM2INT(vlangid), timeout = NUM2INT(vtimeout);
+  VALUE key = INT2FIX(index | (langid << 8)), entry, str, tmp;
+  rusb_string_req_t *reqs;
+  int n;
+
+  if (index <= 0 || 0xff < index || langid < 0 || 0xffff < langid)
+    return Qnil;
+  entry = rusb_string_cache_entry(d);
+  str = rb_hash_lookup2(entry, key, Qundef);
+  if (str != Qundef)
+    return str;
+
+  reqs = ALLOCV_N(rusb_string_req_t, tmp, rusb_device_string_count(d) + 1);
+  n = rusb_string_req_add(reqs, 0, entry, index, langid);
+  if (langid == 0)
+    n = rusb_device_string_reqs(d, entry, reqs, n);
+  rusb_strings_fetch(d, entry, reqs, n, timeout);
+  n = reqs[0].ret;
+  ALLOCV_END(tmp);
+
+  str = rb_hash_lookup2(entry, key, Qundef);
+  if (str != Qundef)
+    return str;
+  if (n == -EPERM || n == -EACCES)
+    return Qnil;
+  errno = -n;
+  rb_sys_fail("usb_string");
+  return Qnil;
+}
+
+/*
+ * USB::Device#usb_probe(timeout)
+ *
+ * reads the strings of the device not cached yet into the string cache
+ * and the drivers bound to its interfaces, with one open of the device
+ * and the GVL released, so that devices are probed in parallel threads.
+ * It returns [strings, drivers, errno]:
+ * strings is {index => String or nil} of the strings in the first
+ * language cached, drivers is {interface number => driver name or nil}
+ * and errno is the first error other than a stall, or nil.
+ * The drivers need libusb usb_get_driver_np.
+ */
+static VALUE
+rusb_device_usb_probe(VALUE v, VALUE vtimeout)
+{
+  struct usb_device *d = get_usb_device(v);
+  int timeout = NUM2INT(vtimeout);
+  VALUE entry = rusb_string_cache_entry(d), strings = rb_hash_new(), drivers = rb_hash_new();
+  VALUE tmp, tmp2;
+  rusb_string_req_t *reqs, *all;
+  rusb_driver_req_t *drvs;
+  rusb_strings_t s;
+  int n, nall, ndrivers = 0, count = rusb_device_string_count(d), c, i;
+  struct usb_config_descriptor *config = NULL;
+
+  /* d is not used without the GVL. */
+  reqs = ALLOCV_N(rusb_string_req_t, tmp, count * 2);
+  all = reqs + count;
+  n = rusb_device_string_reqs(d, entry, reqs, 0);
+  nall = rusb_device_string_reqs(d, rb_hash_new(), all, 0);
+  /* the interfaces of the first configuration, as the kernel binds. */
+  if (d->config && 0 < d->descriptor.bNumConfigurations)
+    config = &d->config[0];
+  drvs = ALLOCV_N(rusb_driver_req_t, tmp2, config ? config->bNumInterfaces : 0);
+  for (c = 0; config && c < config->bNumInterfaces; c++) {
+    if (config->interface[c].num_altsetting == 0)
+      continue;
+    drvs[ndrivers++].interface = config->interface[c].altsetting[0].bInterfaceNumber;
+  }
+
+  s.device = d;
+  s.reqs = reqs;
+  s.n = n;
+  s.drivers = drvs;
+  s.ndrivers = ndrivers;
+  s.timeout = timeout;
+  rusb_strings_read_nogvl(&s);
+  rusb_strings_store(entry, reqs, n);
+  for (i = 0; i < ndrivers; i++)
+    rb_hash_aset(drivers, INT2FIX(drvs[i].interface),
+                 drvs[i].ret < 0 ? Qnil : rb_str_new2(drvs[i].name));
+  /* all strings of the device, cached before or now. */
+  for (i = 0; i < nall; i++) {
+    VALUE key = INT2FIX(all[i].index);
+    VALUE str = rb_hash_lookup2(entry, key, Qundef);
+    if (str != Qundef)
+      rb_hash_aset(strings, key, str);
+  }
+  ALLOCV_END(tmp2);
+  ALLOCV_END(tmp);
+  return rb_ary_new3(3, strings, drivers, s.error ? INT2FIX(-s.error) : Qnil);
+}
+
+/* USB.clear_string_cache */
+static VALUE
+rusb_clear_string_cache(VALUE cUSB)
+{
+  rb_hash_clear(rusb_string_cache);
+  return Qnil;
+}
+
+/* -------- transfer statistics -------- */
+
+#define RUSB_STATS_BUCKETS 32
+#define RUSB_STATS_ERRNOS 8
+#define RUSB_STATS_ENDPOINTS 32
+#define RUSB_STATS_NOT_RUN UINT64_MAX
+
+/*
+ * Counters of the transfers of an endpoint, a DevHandle or the process.
+ * hist[0] counts the transfers which took less than a microsecond and
+ * hist[i] those which took 2**(i-1) to 2**i microseconds;
+ * the last bucket also counts the longer ones.
+ * The errors are counted by errno in a few slots, then in other_errnos.
+ */
+typedef struct {
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t timeouts;
+  uint64_t errors;
+  uint64_t latency_sum; /* microseconds */
+  uint64_t latency_max;
+  uint64_t hist[RUSB_STATS_BUCKETS];
+  struct { int err; uint64_t count; } errnos[RUSB_STATS_ERRNOS];
+  uint64_t other_errnos;
+} rusb_stats_t;
+
+static int rusb_stats_enabled = 0;
+static rusb_stats_t rusb_stats_all;
+
+static uint64_t
+rusb_clock_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+rusb_stats_add_errno(rusb_stats_t *s, int err, uint64_t count)
+{
+  int i;
+  for (i = 0; i < RUSB_STATS_ERRNOS; i++) {
+    if (s->errnos[i].err == err || s->errnos[i].err == 0) {
+      s->errnos[i].err = err;
+      s->errnos[i].count += count;
+      return;
+    }
+  }
+  s->other_errnos += count;
+}
+
+/* counts a transfer which returned ret, bytes or -errno, in usec microseconds. */
+static void
+rusb_stats_add(rusb_stats_t *s, int ret, uint64_t usec)
+{
+  int b = 0;
+  s->transfers++;
+  if (0 <= ret) {
+    s->bytes += ret;
+  }
+  else {
+    s->errors++;
+    if (ret == -ETIMEDOUT)
+      s->timeouts++;
+    rusb_stats_add_errno(s, -ret, 1);
+  }
+  s->latency_sum += usec;
+  if (s->latency_max < usec)
+    s->latency_max = usec;
+  while (b < RUSB_STATS_BUCKETS - 1 && (usec >> b))
+    b++;
+  s->hist[b]++;
+}
+
+static void
+rusb_stats_merge(rusb_stats_t *dst, const rusb_stats_t *src)
+{
+  int i;
+  dst->transfers += src->transfers;
+  dst->bytes += src->bytes;
+  dst->timeouts += src->timeouts;
+  dst->errors += src->errors;
+  dst->latency_sum += src->latency_sum;
+  if (dst->latency_max < src->latency_max)
+    dst->latency_max = src->latency_max;
+  for (i = 0; i < RUSB_STATS_BUCKETS; i++)
+    dst->hist[i] += src->hist[i];
+  for (i = 0; i < RUSB_STATS_ERRNOS && src->errnos[i].err; i++)
+    rusb_stats_add_errno(dst, src->errnos[i].err, src->errnos[i].count);
+  dst->other_errnos += src->other_errnos;
+}
+
+#define RUSB_STATS_SET(h, name, val) rb_hash_aset((h), ID2SYM(rb_intern(name)), ULL2NUM(val))
+
+static VALUE
+rusb_stats_hash(const rusb_stats_t *s)
+{
+  VALUE h = rb_hash_new();
+  VALUE hist = rb_ary_new2(RUSB_STATS_BUCKETS);
+  VALUE errnos = rb_hash_new();
+  int i;
+  RUSB_STATS_SET(h, "transfers", s->transfers);
+  RUSB_STATS_SET(h, "bytes", s->bytes);
+  RUSB_STATS_SET(h, "timeouts", s->timeouts);
+  RUSB_STATS_SET(h, "errors", s->errors);
+  RUSB_STATS_SET(h, "latency_sum", s->latency_sum);
+  RUSB_STATS_SET(h, "latency_max", s->latency_max);
+  for (i = 0; i < RUSB_STATS_BUCKETS; i++)
+    rb_ary_push(hist, ULL2NUM(s->hist[i]));
+  rb_hash_aset(h, ID2SYM(rb_intern("histogram")), hist);
+  for (i = 0; i < RUSB_STATS_ERRNOS && s->errnos[i].err; i++)
+    rb_hash_aset(errnos, INT2FIX(s->errnos[i].err), ULL2NUM(s->errnos[i].count));
+  if (s->other_errnos)
+    RUSB_STATS_SET(errnos, "other", s->other_errnos);
+  rb_hash_aset(h, ID2SYM(rb_intern("errnos")), errnos);
+  return h;
+}
+
+/* USB.stats_enabled? */
+static VALUE
+rusb_stats_enabled_p(VALUE cUSB)
+{
+  return rusb_stats_enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * USB.stats_enabled = enabled
+ *
+ * starts or stops counting the synchronous, batched and asynchronous
+ * transfers in USB.stats and USB::DevHandle#stats.
+ * It is off by default so that a transfer doesn't read the clock.
+ * The counters are Hashes of :transfers, :bytes, :timeouts, :errors,
+ * :errnos ({errno => count}), :latency_sum and :latency_max in
+ * microseconds and :histogram, whose i-th element counts the transfers
+ * which took 2**(i-1) to 2**i microseconds.
+ */
+static VALUE
+rusb_set_stats_enabled(VALUE cUSB, VALUE enabled)
+{
+  rusb_stats_enabled = RTEST(enabled);
+  return enabled;
+}
+
+/* USB.stats: the counters of all handles, copied at once. */
+static VALUE
+rusb_stats(VALUE cUSB)
+{
+  rusb_stats_t s = rusb_stats_all;
+  return rusb_stats_hash(&s);
+}
+
+/* USB.reset_stats */
+static VALUE
+rusb_reset_stats(VALUE cUSB)
+{
+  MEMZERO(&rusb_stats_all, rusb_stats_t, 1);
+  return Qnil;
+}
+
+/* -------- transfer tracing -------- */
+
+#define RUSB_TRACE_SNAPLEN_MAX 65535
+
+/* what a transfer is timed for */
+#define RUSB_TIMED_STATS 1
+#define RUSB_TIMED_TRACE 2
+
+/*
+ * A transfer traced.  ep is the endpoint address; a control transfer
+ * has endpoint 0 with the direction of its setup packet.
+ * The first bytes of the data written or read follow in the data of
+ * the ring.
+ */
+typedef struct {
+  uint64_t start; /* rusb_clock_us when the transfer started */
+  uint64_t usec;
+  int ret; /* bytes transferred or -errno */
+  int length; /* bytes requested */
+  unsigned char type; /* USB_ENDPOINT_TYPE_* */
+  unsigned char ep;
+  unsigned char setup[8]; /* control only */
+  unsigned int captured;
+} rusb_trace_rec_t;
+
+/*
+ * The trace of a DevHandle: a ring of capacity records, the oldest
+ * overwritten first.  The records are written where the transfers are
+ * counted for the statistics, with the GVL, so the ring takes no lock
+ * and a transfer pays a pointer test when the tracing is off.
+ */
+typedef struct {
+  int enabled;
+  unsigned long capacity;
+  unsigned long snaplen;
+  uint64_t head; /* records written */
+  int64_t realtime_offset; /* CLOCK_REALTIME - CLOCK_MONOTONIC in microseconds */
+  rusb_trace_rec_t *recs;
+  unsigned char *data; /* snaplen bytes by record */
+} rusb_trace_t;
+
+static void
+rusb_trace_free(rusb_trace_t *t)
+{
+  if (!t)
+    return;
+  xfree(t->recs);
+  xfree(t->data);
+  xfree(t);
+}
+
+static size_t
+rusb_trace_memsize(const rusb_trace_t *t)
+{
+  if (!t)
+    return 0;
+  return sizeof(*t) + t->capacity * (sizeof(rusb_trace_rec_t) + t->snaplen);
+}
+
+/*
+ * records a transfer.  data has the datalen bytes written, or read if
+ * the transfer succeeded; the first snaplen of them are kept.
+ */
+static void
+rusb_trace_add(rusb_trace_t *t, int type, int ep, const unsigned char *setup, int length, int ret,
+               uint64_t start, uint64_t usec, const void *data, long datalen)
+{
+  unsigned long i = (unsigned long)(t->head++ % t->capacity);
+  rusb_trace_rec_t *r = &t->recs[i];
+  r->start = start;
+  r->usec = usec;
+  r->ret = ret;
+  r->length = length;
+  r->type = (unsigned char)type;
+  r->ep = (unsigned char)ep;
+  if (setup)
+    memcpy(r->setup, setup, sizeof(r->setup));
+  else
+    memset(r->setup, 0, sizeof(r->setup));
+  if (!data || datalen < 0)
+    datalen = 0;
+  r->captured = (unsigned int)((unsigned long)datalen < t->snaplen ? (unsigned long)datalen : t->snaplen);
+  memcpy(t->data + i * t->snaplen, data, r->captured);
+}
+
+static void
+rusb_setup_packet(unsigned char *setup, int requesttype, int request, int value, int index, int length)
+{
+  setup[0] = (unsigned char)requesttype;
+  setup[1] = (unsigned char)request;
+  setup[2] = (unsigned char)value;
+  setup[3] = (unsigned char)(value >> 8);
+  setup[4] = (unsigned char)index;
+  setup[5] = (unsigned char)(index >> 8);
+  setup[6] = (unsigned char)length;
+  setup[7] = (unsigned char)(length >> 8);
+}
+
+/* -------- USB::DevHandle -------- */
+
+static VALUE rb_cUSB_DevHandle;
+
+typedef struct {
+  usb_dev_handle *ptr;
+  int inflight; /* number of transfers running without the GVL */
+  rusb_stats_t **stats; /* by endpoint, allocated by the first transfer counted */
+  rusb_trace_t *trace; /* NULL until DevHandle#usb_trace_start */
+  int busnum, devnum; /* of the device opened, for the trace */
+} rusb_devhandle_t;
+
+static void
+rusb_devhandle_free_stats(rusb_devhandle_t *h)
+{
+  int i;
+  if (!h->stats)
+    return;
+  for (i = 0; i < RUSB_STATS_ENDPOINTS; i++)
+    if (h->stats[i])
+      xfree(h->stats[i]);
+  xfree(h->stats);
+  h->stats = NULL;
+}
+
+static void rusb_devhandle_free(void *_h)
+{
+  rusb_devhandle_t *h = (rusb_devhandle_t *)_h;
+  if (h) {
+    if (h->ptr) usb_close(h->ptr);
+    rusb_devhandle_free_stats(h);
+    rusb_trace_free(h->trace);
+    xfree(h);
+  }
+}
+
+static size_t rusb_devhandle_memsize(const void *p)
+{
+  const rusb_devhandle_t *h = (const rusb_devhandle_t *)p;
+  size_t size = sizeof(rusb_devhandle_t);
+  int i;
+  if (h->stats) {
+    size += RUSB_STATS_ENDPOINTS * sizeof(rusb_stats_t *);
+    for (i = 0; i < RUSB_STATS_ENDPOINTS; i++)
+      if (h->stats[i])
+        size += sizeof(rusb_stats_t);
+  }
+  return size + rusb_trace_memsize(h->trace);
+}
+
+static const rb_data_type_t rusb_devhandle_type = {
+  "USB::DevHandle",
+  { 0, rusb_devhandle_free, rusb_devhandle_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rusb_dev_handle_new(usb_dev_handle *h, struct usb_device *device)
+{
+  rusb_devhandle_t *d = (rusb_devhandle_t *)xmalloc(sizeof(*d));
+  d->ptr = h;
+  d->inflight = 0;
+  d->stats = NULL;
+  d->trace = NULL;
+  d->busnum = atoi(device->bus->dirname);
+  d->devnum = device->devnum;
+  return TypedData_Wrap_Struct(rb_cUSB_DevHandle, &rusb_devhandle_type, d);
+}
+
+static rusb_devhandle_t *check_usb_devhandle(VALUE v)
+{
+  return (rusb_devhandle_t *)rb_check_typeddata(v, &rusb_devhandle_type);
+}
+
+static rusb_devhandle_t *get_rusb_devhandle(VALUE v)
+{
+  rusb_devhandle_t *d = check_usb_devhandle(v);
+  if (!d->ptr) {
+    rb_raise(rb_eArgError, "closed USB::DevHandle");
+  }
+  return d;
+}
+
+static usb_dev_handle *get_usb_devhandle(VALUE v)
+{
+  return get_rusb_devhandle(v)->ptr;
+}
+
+static int check_usb_error(const char *reason, int ret)
+{
+  if (ret < 0) {
+    errno = -ret;
+    rb_sys_fail(reason);
+  }
+  return ret;
+}
+
+/*
+ * counts a transfer on endpoint ep of h, 0 for the control endpoint.
+ * It is called with the GVL, which serializes the counters.
+ */
+static void
+rusb_stats_count(rusb_devhandle_t *h, int ep, int ret, uint64_t usec)
+{
+  int i = (ep & USB_ENDPOINT_ADDRESS_MASK) | ((ep & USB_ENDPOINT_DIR_MASK) ? 16 : 0);
+  if (!h->stats)
+    h->stats = ZALLOC_N(rusb_stats_t *, RUSB_STATS_ENDPOINTS);
+  if (!h->stats[i])
+    h->stats[i] = ZALLOC(rusb_stats_t);
+  rusb_stats_add(h->stats[i], ret, usec);
+  rusb_stats_add(&rusb_stats_all, ret, usec);
+}
+
+/*
+ * USB::DevHandle#stats
+ *
+ * returns the counters of the handle and, in :endpoints, of each endpoint.
+ */
+static VALUE
+rusb_devhandle_stats(VALUE v)
+{
+  rusb_devhandle_t *h = check_usb_devhandle(v);
+  rusb_stats_t total;
+  VALUE eps = rb_hash_new(), result;
+  int i;
+  MEMZERO(&total, rusb_stats_t, 1);
+  if (h->stats) {
+    for (i = 0; i < RUSB_STATS_ENDPOINTS; i++) {
+      if (!h->stats[i])
+        continue;
+      rusb_stats_merge(&total, h->stats[i]);
+      rb_hash_aset(eps, INT2FIX((i & USB_ENDPOINT_ADDRESS_MASK) | (i & 16 ? USB_ENDPOINT_IN : 0)),
+                   rusb_stats_hash(h->stats[i]));
+    }
+  }
+  result = rusb_stats_hash(&total);
+  rb_hash_aset(result, ID2SYM(rb_intern("endpoints")), eps);
+  return result;
+}
+
+/* USB::DevHandle#reset_stats */
+static VALUE
+rusb_devhandle_reset_stats(VALUE v)
+{
+  rusb_devhandle_free_stats(check_usb_devhandle(v));
+  return Qnil;
+}
+
+/* returns what a transfer on h is timed for, RUSB_TIMED_* */
+static int
+rusb_timed(rusb_devhandle_t *h)
+{
+  return (rusb_stats_enabled ? RUSB_TIMED_STATS : 0) |
+         (h->trace && h->trace->enabled ? RUSB_TIMED_TRACE : 0);
+}
+
+/*
+ * USB::DevHandle#usb_trace_start(capacity, snaplen)
+ *
+ * starts tracing the transfers in a new ring of capacity records,
+ * each with the first snaplen bytes of the data.
+ */
+static VALUE
+rusb_devhandle_trace_start(VALUE v, VALUE vcapacity, VALUE vsnaplen)
+{
+  rusb_devhandle_t *h = check_usb_devhandle(v);
+  long capacity = NUM2LONG(vcapacity);
+  long snaplen = NUM2LONG(vsnaplen);
+  rusb_trace_t *t;
+  struct timespec rt;
+  if (capacity <= 0)
+    rb_raise(rb_eArgError, "capacity must be positive");
+  if (snaplen < 0 || RUSB_TRACE_SNAPLEN_MAX < snaplen)
+    rb_raise(rb_eArgError, "snaplen out of range: %ld", snaplen);
+  t = ZALLOC(rusb_trace_t);
+  t->capacity = capacity;
+  t->snaplen = snaplen;
+  t->recs = ALLOC_N(rusb_trace_rec_t, capacity);
+  t->data = snaplen ? ALLOC_N(unsigned char, capacity * snaplen) : NULL;
+  clock_gettime(CLOCK_REALTIME, &rt);
+  t->realtime_offset = (int64_t)rt.tv_sec * 1000000 + rt.tv_nsec / 1000 - (int64_t)rusb_clock_us();
+  t->enabled = 1;
+  rusb_trace_free(h->trace);
+  h->trace = t;
+  return Qnil;
+}
+
+/*
+ * USB::DevHandle#usb_trace_stop
+ *
+ * stops tracing.  The records are kept until the next usb_trace_start.
+ */
+static VALUE
+rusb_devhandle_trace_stop(VALUE v)
+{
+  rusb_devhandle_t *h = check_usb_devhandle(v);
+  if (h->trace)
+    h->trace->enabled = 0;
+  return Qnil;
+}
+
+/* USB::DevHandle#tracing? */
+static VALUE
+rusb_devhandle_tracing_p(VALUE v)
+{
+  rusb_devhandle_t *h = check_usb_devhandle(v);
+  return h->trace && h->trace->enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * USB::DevHandle#usb_trace_records
+ *
+ * returns [busnum, devnum, snaplen, records] where records are the
+ * records in the ring, oldest first:
+ * [sequence, time in microseconds since the epoch, duration in microseconds,
+ *  type, endpoint, length requested, bytes transferred or -errno,
+ *  setup packet or nil, data captured].
+ * The records before the sequence of the first one are overwritten.
+ */
+static VALUE
+rusb_devhandle_trace_records(VALUE v)
+{
+  rusb_devhandle_t *h = check_usb_devhandle(v);
+  rusb_trace_t *t = h->trace;
+  VALUE records = rb_ary_new();
+  uint64_t seq;
+  if (t) {
+    seq = t->head < t->capacity ? 0 : t->head - t->capacity;
+    for (; seq < t->head; seq++) {
+      unsigned long i = (unsigned long)(seq % t->capacity);
+      rusb_trace_rec_t *r = &t->recs[i];
+      VALUE rec = rb_ary_new2(9);
+      rb_ary_push(rec, ULL2NUM(seq));
+      rb_ary_push(rec, LL2NUM((int64_t)r->start + t->realtime_offset));
+      rb_ary_push(rec, ULL2NUM(r->usec));
+      rb_ary_push(rec, INT2FIX(r->type));
+      rb_ary_push(rec, INT2FIX(r->ep));
+      rb_ary_push(rec, INT2NUM(r->length));
+      rb_ary_push(rec, INT2NUM(r->ret));
+      rb_ary_push(rec, r->type == USB_ENDPOINT_TYPE_CONTROL ?
+                       rb_str_new((const char *)r->setup, sizeof(r->setup)) : Qnil);
+      rb_ary_push(rec, rb_str_new((const char *)t->data + i * t->snaplen, r->captured));
+      rb_ary_push(records, rec);
+    }
+  }
+  return rb_ary_new3(4, INT2FIX(h->busnum), INT2FIX(h->devnum),
+                     t ? ULONG2NUM(t->snaplen) : INT2FIX(0), records);
+}
+
+/* -------- transfers without the GVL -------- */
+
+#define RUSB_UNLOCKED 0
+#define RUSB_LOCKED_STRING 1
+#define RUSB_LOCKED_IO_BUFFER 2
+
+struct rusb_xfer {
+  rusb_devhandle_t *h;
+  int type; /* USB_ENDPOINT_TYPE_CONTROL, _BULK or _INTERRUPT */
+  int in;
+  int requesttype, request, value, index; /* control only */
+  int ep;
+  VALUE str;
+  int locked; /* RUSB_LOCKED_* */
+  char *bytes;
+  int size;
+  int timeout;
+  int ret;
+  int timed; /* RUSB_TIMED_* */
+  uint64_t start;
+  uint64_t usec; /* RUSB_STATS_NOT_RUN until the transfer runs */
+};
+
+static void *
+rusb_xfer_nogvl(void *arg)
+{
+  struct rusb_xfer *x = (struct rusb_xfer *)arg;
+  usb_dev_handle *p = x->h->ptr;
+  if (x->timed)
+    x->start = rusb_clock_us();
+  switch (x->type) {
+    case USB_ENDPOINT_TYPE_CONTROL:
+      x->ret = usb_control_msg(p, x->requesttype, x->request, x->value, x->index,
+                               x->bytes, x->size, x->timeout);
+      break;
+    case USB_ENDPOINT_TYPE_BULK:
+      if (x->in)
+        x->ret = usb_bulk_read(p, x->ep, x->bytes, x->size, x->timeout);
+      else
+        x->ret = usb_bulk_write(p, x->ep, x->bytes, x->size, x->timeout);
+      break;
+    case USB_ENDPOINT_TYPE_INTERRUPT:
+      if (x->in)
+        x->ret = usb_interrupt_read(p, x->ep, x->bytes, x->size, x->timeout);
+      else
+        x->ret = usb_interrupt_write(p, x->ep, x->bytes, x->size, x->timeout);
+      break;
+  }
+  if (x->timed)
+    x->usec = rusb_clock_us() - x->start;
+  return NULL;
+}
+
+static void
+rusb_xfer_count(struct rusb_xfer *x)
+{
+  rusb_trace_t *t = x->h->trace;
+  unsigned char setup[8];
+  if (!x->timed || x->usec == RUSB_STATS_NOT_RUN)
+    return;
+  if (x->timed & RUSB_TIMED_STATS)
+    rusb_stats_count(x->h, x->type == USB_ENDPOINT_TYPE_CONTROL ? 0 : x->ep, x->ret, x->usec);
+  if ((x->timed & RUSB_TIMED_TRACE) && t && t->enabled) {
+    if (x->type == USB_ENDPOINT_TYPE_CONTROL) {
+      rusb_setup_packet(setup, x->requesttype, x->request, x->value, x->index, x->size);
+      rusb_trace_add(t, x->type, x->requesttype & USB_ENDPOINT_DIR_MASK, setup, x->size, x->ret,
+                     x->start, x->usec, x->bytes, x->in ? x->ret : x->size);
+    }
+    else {
+      rusb_trace_add(t, x->type, x->ep, NULL, x->size, x->ret,
+                     x->start, x->usec, x->bytes, x->in ? x->ret : x->size);
+    }
+  }
+}
+
+static VALUE
+rusb_xfer_body(VALUE arg)
+{
+  rusb_without_gvl(rusb_xfer_nogvl, (void *)arg);
+  return Qnil;
+}
+
+static VALUE
+rusb_xfer_ensure(VALUE arg)
+{
+  struct rusb_xfer *x = (struct rusb_xfer *)arg;
+  x->h->inflight--;
+  rusb_xfer_count(x);
+  if (x->locked == RUSB_LOCKED_STRING)
+    rb_str_unlocktmp(x->str);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  else if (x->locked == RUSB_LOCKED_IO_BUFFER)
+    rb_io_buffer_unlock(x->str);
+#endif
+  return Qnil;
+}
+
+static int
+rusb_xfer_call(struct rusb_xfer *x)
+{
+  x->ret = -EINTR;
+  x->timed = rusb_timed(x->h);
+  x->usec = RUSB_STATS_NOT_RUN;
+  x->h->inflight++;
+  rb_ensure(rusb_xfer_body, (VALUE)x, rusb_xfer_ensure, (VALUE)x);
+  return x->ret;
+}
+
+/*
+ * Runs a transfer on vbytes.
+ * A buffer read into is locked against modification by other threads
+ * while the GVL is released.  A buffer written from is replaced by a
+ * frozen (shared, not copied) string for the same reason.
+ */
+static int
+rusb_xfer_run(struct rusb_xfer *x, VALUE vbytes)
+{
+  StringValue(vbytes);
+  if (x->in) {
+    rb_str_modify(vbytes);
+  }
+  else {
+    vbytes = rb_str_new_frozen(vbytes);
+  }
+  x->str = vbytes;
+  x->bytes = RSTRING_PTR(vbytes);
+  x->size = RSTRING_LEN(vbytes);
+  x->locked = RUSB_UNLOCKED;
+  if (x->in) {
+    rb_str_locktmp(vbytes);
+    x->locked = RUSB_LOCKED_STRING;
+  }
+  rusb_xfer_call(x);
+  RB_GC_GUARD(vbytes);
+  return x->ret;
+}
+
+static long
+rusb_check_range(long offset, VALUE vlength, long size)
+{
+  long length;
+  if (offset < 0 || size < offset)
+    rb_raise(rb_eArgError, "offset out of buffer");
+  length = NIL_P(vlength) ? size - offset : NUM2LONG(vlength);
+  if (length < 0)
+    rb_raise(rb_eArgError, "negative length");
+  if (INT_MAX < length)
+    length = INT_MAX;
+  return length;
+}
+
+/*
+ * Runs an IN transfer of at most vlength bytes into vbuf at voffset,
+ * without allocating.
+ * vbuf is a String or an IO::Buffer.
+ * A String is expanded to its capacity as needed
+ * and its length is set to offset + the number of bytes read.
+ * An IO::Buffer is not resized.
+ */
+static int
+rusb_xfer_into(struct rusb_xfer *x, VALUE vbuf, VALUE voffset, VALUE vlength)
+{
+  long offset = NIL_P(voffset) ? 0 : NUM2LONG(voffset);
+  long len, length;
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  if (rb_obj_is_kind_of(vbuf, rb_cIOBuffer)) {
+    void *base;
+    size_t size;
+    rb_io_buffer_get_bytes_for_writing(vbuf, &base, &size);
+    length = rusb_check_range(offset, vlength, (long)size);
+    if ((long)size - offset < length)
+      rb_raise(rb_eArgError, "length out of buffer");
+    rb_io_buffer_lock(vbuf);
+    x->str = vbuf;
+    x->locked = RUSB_LOCKED_IO_BUFFER;
+    x->bytes = (char *)base + offset;
+    x->size = length;
+    return rusb_xfer_call(x);
+  }
+#endif
+  StringValue(vbuf);
+  len = RSTRING_LEN(vbuf);
+  if (offset < 0 || len < offset)
+    rb_raise(rb_eArgError, "offset out of buffer");
+  length = rusb_check_range(offset, vlength, (long)rb_str_capacity(vbuf));
+  rb_str_modify_expand(vbuf, len < offset + length ? offset + length - len : 0);
+  rb_str_locktmp(vbuf);
+  x->str = vbuf;
+  x->locked = RUSB_LOCKED_STRING;
+  x->bytes = RSTRING_PTR(vbuf) + offset;
+  x->size = length;
+  if (0 <= rusb_xfer_call(x))
+    rb_str_set_len(vbuf, offset + x->ret);
+  RB_GC_GUARD(vbuf);
+  return x->ret;
+}
+
+/*
+ * USB.usb_buffer_room(buffer, offset, length)
+ *
+ * returns the bytes bulk_read_into reads at most into _buffer_ at _offset_:
+ * _length_, or the rest of an IO::Buffer or of the capacity of a String.
+ */
+static VALUE
+rusb_buffer_room(VALUE cUSB, VALUE vbuf, VALUE voffset, VALUE vlength)
+{
+  long offset = NIL_P(voffset) ? 0 : NUM2LONG(voffset);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  if (rb_obj_is_kind_of(vbuf, rb_cIOBuffer)) {
+    const void *base;
+    size_t size;
+    rb_io_buffer_get_bytes_for_reading(vbuf, &base, &size);
+    return LONG2NUM(rusb_check_range(offset, vlength, (long)size));
+  }
+#endif
+  StringValue(vbuf);
+  if (offset < 0 || RSTRING_LEN(vbuf) < offset)
+    rb_raise(rb_eArgError, "offset out of buffer");
+  return LONG2NUM(rusb_check_range(offset, vlength, (long)rb_str_capacity(vbuf)));
+}
+
+static VALUE
+rusb_xfer_data(VALUE v, int type, int in, const char *reason, VALUE vep, VALUE vbytes, VALUE vtimeout)
+{
+  struct rusb_xfer x;
+  x.h = get_rusb_devhandle(v);
+  x.type = type;
+  x.in = in;
+  x.ep = NUM2INT(vep);
+  x.timeout = NUM2INT(vtimeout);
+  check_usb_error(reason, rusb_xfer_run(&x, vbytes));
+  return INT2NUM(x.ret);
+}
+
+static VALUE
+rusb_xfer_data_into(int argc, VALUE *argv, VALUE v, int type, const char *reason)
+{
+  struct rusb_xfer x;
+  VALUE vep, vbuf, vtimeout, voffset, vlength;
+  rb_scan_args(argc, argv, "32", &vep, &vbuf, &vtimeout, &voffset, &vlength);
+  x.h = get_rusb_devhandle(v);
+  x.type = type;
+  x.in = 1;
+  x.ep = NUM2INT(vep);
+  x.timeout = NUM2INT(vtimeout);
+  check_usb_error(reason, rusb_xfer_into(&x, vbuf, voffset, vlength));
+  return INT2NUM(x.ret);
+}
+
+/* -------- batched transfers -------- */
+
+/* the ret of a transfer of a batch which didn't run. */
+#define RUSB_XFER_NOT_RUN INT_MIN
+
+struct rusb_xfer_batch {
+  struct rusb_xfer *xs;
+  long n;
+  long done; /* transfers started */
+  volatile int interrupted;
+  int running;
+  const char *reason;
+  void (*prepare)(struct rusb_xfer_batch *);
+  VALUE items;
+  VALUE bufs;
+  VALUE result;
+};
+
+#ifndef HAVE_LIBUSB_1_0
+static void *
+rusb_xfer_batch_nogvl(void *arg)
+{
+  struct rusb_xfer_batch *b = (struct rusb_xfer_batch *)arg;
+  while (b->done < b->n && !b->interrupted) {
+    struct rusb_xfer *x = &b->xs[b->done++];
+    rusb_xfer_nogvl(x);
+    if (x->ret < 0)
+      break;
+  }
+  return NULL;
+}
+
+/* stops the batch after the transfer in progress. */
+static void
+rusb_xfer_batch_ubf(void *arg)
+{
+  ((struct rusb_xfer_batch *)arg)->interrupted = 1;
+}
+#endif
+
+#ifdef HAVE_LIBUSB_1_0
+/*
+ * libusb-1.0 pipelines a batch: up to RUSB_XFER_BATCH_WINDOW transfers
+ * are submitted at a time and completed in order, so that the device
+ * doesn't wait for the host between the transfers.
+ */
+#define RUSB_XFER_BATCH_WINDOW 8
+/* consecutive failures to handle the events before giving up the transfers in flight */
+#define RUSB_XFER_EVENT_FAILURES 3
+
+struct rusb_xfer_slot {
+  struct libusb_transfer *t;
+  struct rusb_xfer *x;
+  unsigned char *ctrl; /* setup packet followed by the data of a control transfer */
+  int completed;
+};
+
+/* 0 or the errno of the status of a transfer done. */
+static int
+rusb_transfer_errno(enum libusb_transfer_status status)
+{
+  switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED: return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT: return ETIMEDOUT;
+    case LIBUSB_TRANSFER_CANCELLED: return ECANCELED;
+    case LIBUSB_TRANSFER_STALL: return EPIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return ENODEV;
+    case LIBUSB_TRANSFER_OVERFLOW: return EOVERFLOW;
+    default: return EIO;
+  }
+}
+
+static void LIBUSB_CALL
+rusb_xfer_slot_callback(struct libusb_transfer *t)
+{
+  struct rusb_xfer_slot *slot = (struct rusb_xfer_slot *)t->user_data;
+  if (slot->x->timed)
+    slot->x->usec = rusb_clock_us() - slot->x->start;
+  slot->completed = 1;
+}
+
+/* frees a transfer abandoned by its batch when libusb completes it. */
+static void LIBUSB_CALL
+rusb_xfer_slot_abandoned(struct libusb_transfer *t)
+{
+  if (t->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+    free(t->buffer);
+  libusb_free_transfer(t);
+}
+
+static int
+rusb_xfer_slot_submit(struct rusb_xfer_slot *slot, struct rusb_xfer *x)
+{
+  libusb_device_handle *dev = x->h->ptr->handle;
+  slot->x = x;
+  slot->completed = 0;
+  switch (x->type) {
+    case USB_ENDPOINT_TYPE_CONTROL:
+      slot->ctrl = malloc(LIBUSB_CONTROL_SETUP_SIZE + x->size);
+      if (!slot->ctrl)
+        return -ENOMEM;
+      libusb_fill_control_setup(slot->ctrl, x->requesttype, x->request, x->value, x->index, x->size);
+      if (!x->in)
+        memcpy(slot->ctrl + LIBUSB_CONTROL_SETUP_SIZE, x->bytes, x->size);
+      libusb_fill_control_transfer(slot->t, dev, slot->ctrl, rusb_xfer_slot_callback, slot, x->timeout);
+      break;
+    case USB_ENDPOINT_TYPE_BULK:
+      libusb_fill_bulk_transfer(slot->t, dev, x->in ? x->ep | LIBUSB_ENDPOINT_IN : x->ep & ~LIBUSB_ENDPOINT_IN,
+                                (unsigned char *)x->bytes, x->size, rusb_xfer_slot_callback, slot, x->timeout);
+      break;
+    case USB_ENDPOINT_TYPE_INTERRUPT:
+      libusb_fill_interrupt_transfer(slot->t, dev, x->in ? x->ep | LIBUSB_ENDPOINT_IN : x->ep & ~LIBUSB_ENDPOINT_IN,
+                                     (unsigned char *)x->bytes, x->size, rusb_xfer_slot_callback, slot, x->timeout);
+      break;
+  }
+  if (x->timed)
+    x->start = rusb_clock_us();
+  return rusb1_error(libusb_submit_transfer(slot->t));
+}
+
+/*
+ * sets the ret of the transfer of a completed slot:
+ * the bytes transferred, as a timeout after some bytes is by usb_bulk_write,
+ * -errno, or RUSB_XFER_NOT_RUN for a transfer cancelled before any byte.
+ */
+static void
+rusb_xfer_slot_finish(struct rusb_xfer_slot *slot)
+{
+  struct rusb_xfer *x = slot->x;
+  struct libusb_transfer *t = slot->t;
+  int e = rusb_transfer_errno(t->status);
+  if (e == 0 || (e == ETIMEDOUT && 0 < t->actual_length))
+    x->ret = t->actual_length;
+  else if (e == ECANCELED && t->actual_length == 0)
+    x->ret = RUSB_XFER_NOT_RUN;
+  else
+    x->ret = -e;
+  if (x->ret == RUSB_XFER_NOT_RUN)
+    x->usec = RUSB_STATS_NOT_RUN;
+  if (slot->ctrl) {
+    if (x->in && 0 < x->ret)
+      memcpy(x->bytes, slot->ctrl + LIBUSB_CONTROL_SETUP_SIZE, x->ret);
+    free(slot->ctrl);
+    slot->ctrl = NULL;
+  }
+}
+
+/*
+ * Runs the transfers in a window of submitted ones.
+ * After a failure or an interrupt, no transfer is submitted
+ * and the ones in the window are cancelled.
+ */
+static void *
+rusb_xfer_batch_pipeline_nogvl(void *arg)
+{
+  struct rusb_xfer_batch *b = (struct rusb_xfer_batch *)arg;
+  struct rusb_xfer_slot slots[RUSB_XFER_BATCH_WINDOW];
+  long finished = 0, i;
+  int stop = 0, r;
+  memset(slots, 0, sizeof(slots));
+  for (i = 0; i < RUSB_XFER_BATCH_WINDOW; i++) {
+    slots[i].t = libusb_alloc_transfer(0);
+    if (!slots[i].t) {
+      b->xs[0].ret = -ENOMEM;
+      b->done = 1;
+      goto out;
+    }
+  }
+  while (1) {
+    while (!stop && !b->interrupted && b->done < b->n &&
+           b->done - finished < RUSB_XFER_BATCH_WINDOW) {
+      struct rusb_xfer_slot *slot = &slots[b->done % RUSB_XFER_BATCH_WINDOW];
+      r = rusb_xfer_slot_submit(slot, &b->xs[b->done]);
+      b->done++;
+      if (r < 0) {
+        b->xs[b->done - 1].ret = r;
+        free(slot->ctrl);
+        slot->ctrl = NULL;
+        stop = 1;
+      }
+    }
+    if (b->interrupted && !stop) {
+      stop = 1;
+      for (i = finished; i < b->done; i++)
+        libusb_cancel_transfer(slots[i % RUSB_XFER_BATCH_WINDOW].t);
+    }
+    if (finished == b->done)
+      break;
+    if (b->xs[finished].ret != RUSB_XFER_NOT_RUN) { /* failed to submit */
+      finished++;
+      continue;
+    }
+    {
+      struct rusb_xfer_slot *slot = &slots[finished % RUSB_XFER_BATCH_WINDOW];
+      int failures = 0;
+      while (!slot->completed) {
+        r = libusb_handle_events_completed(rusb1_context, &slot->completed);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+          if (RUSB_XFER_EVENT_FAILURES <= ++failures)
+            break;
+          if (!stop) {
+            stop = 1;
+            for (i = finished; i < b->done; i++)
+              libusb_cancel_transfer(slots[i % RUSB_XFER_BATCH_WINDOW].t);
+          }
+          continue;
+        }
+        if (b->interrupted && !stop)
+          break;
+      }
+      if (!slot->completed && failures < RUSB_XFER_EVENT_FAILURES)
+        continue;
+      if (!slot->completed) {
+        /* the events can't be handled: the transfers in flight are left to libusb. */
+        for (i = finished; i < b->done; i++) {
+          struct rusb_xfer_slot *s = &slots[i % RUSB_XFER_BATCH_WINDOW];
+          if (b->xs[i].ret != RUSB_XFER_NOT_RUN)
+            continue;
+          b->xs[i].ret = rusb1_error(r);
+          s->t->callback = rusb_xfer_slot_abandoned;
+          s->t = NULL;
+          s->ctrl = NULL;
+        }
+        break;
+      }
+      rusb_xfer_slot_finish(slot);
+      finished++;
+      if (slot->x->ret < 0 && !stop) {
+        stop = 1;
+        for (i = finished; i < b->done; i++)
+          libusb_cancel_transfer(slots[i % RUSB_XFER_BATCH_WINDOW].t);
+      }
+    }
+  }
+out:
+  for (i = 0; i < RUSB_XFER_BATCH_WINDOW; i++)
+    libusb_free_transfer(slots[i].t);
+  return NULL;
+}
+
+/* cancels the transfers of the batch, waking up the wait for events. */
+static void
+rusb_xfer_batch_pipeline_ubf(void *arg)
+{
+  ((struct rusb_xfer_batch *)arg)->interrupted = 1;
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+  libusb_interrupt_event_handler(rusb1_context);
+#endif
+}
+#endif
+
+static VALUE
+rusb_xfer_batch_body(VALUE arg)
+{
+  struct rusb_xfer_batch *b = (struct rusb_xfer_batch *)arg;
+  b->prepare(b);
+  if (b->n) {
+    b->xs[0].h->inflight++;
+    b->running = 1;
+#ifdef HAVE_LIBUSB_1_0
+    rusb_without_gvl2(rusb_xfer_batch_pipeline_nogvl, b, rusb_xfer_batch_pipeline_ubf, b);
+#else
+    rusb_without_gvl2(rusb_xfer_batch_nogvl, b, rusb_xfer_batch_ubf, b);
+#endif
+  }
+  return Qnil;
+}
+
+/*
+ * Collects the results and releases the buffers of a batch.
+ * The result has, for each transfer, the number of bytes transferred,
+ * a SystemCallError for the failed transfer or nil for a transfer not run.
+ * A pipelined transfer submitted before the failure of an earlier one
+ * has its own result, unless it is cancelled before transferring.
+ */
+static VALUE
+rusb_xfer_batch_ensure(VALUE arg)
+{
+  struct rusb_xfer_batch *b = (struct rusb_xfer_batch *)arg;
+  long i;
+  if (b->running)
+    b->xs[0].h->inflight--;
+  for (i = 0; i < b->done; i++)
+    rusb_xfer_count(&b->xs[i]);
+  for (i = 0; i < b->n; i++)
+    if (b->xs[i].locked == RUSB_LOCKED_STRING)
+      rb_str_unlocktmp(b->xs[i].str);
+  b->result = rb_ary_new2(b->n);
+  for (i = 0; i < b->n; i++) {
+    int ret = b->xs[i].ret;
+    if (ret == RUSB_XFER_NOT_RUN)
+      rb_ary_push(b->result, Qnil);
+    else if (ret < 0)
+      rb_ary_push(b->result, rb_funcall(rb_eSystemCallError, rb_intern("new"), 2,
+                                        rb_str_new2(b->reason), INT2NUM(-ret)));
+    else
+      rb_ary_push(b->result, INT2NUM(ret));
+  }
+  xfree(b->xs);
+  b->xs = NULL;
+  return Qnil;
+}
+
+/*
+ * Sets the buffer of the i-th transfer of a batch.
+ * A buffer read into is locked until the batch finishes.
+ */
+static void
+rusb_xfer_batch_buffer(struct rusb_xfer_batch *b, long i, VALUE vbytes)
+{
+  struct rusb_xfer *x = &b->xs[i];
+  StringValue(vbytes);
+  if (x->in) {
+    rb_str_modify(vbytes);
+    rb_str_locktmp(vbytes);
+    x->locked = RUSB_LOCKED_STRING;
+  }
+  else {
+    vbytes = rb_str_new_frozen(vbytes);
+  }
+  rb_ary_push(b->bufs, vbytes);
+  x->str = vbytes;
+  x->bytes = RSTRING_PTR(vbytes);
+  x->size = RSTRING_LEN(vbytes);
+}
+
+/*
+ * Runs the transfers of items, set up by prepare, in one blocking region.
+ * It stops at the first failure.
+ * libusb-0.1 runs them one after another; libusb-1.0 pipelines them,
+ * see rusb_xfer_batch_pipeline_nogvl.
+ */
+static VALUE
+rusb_xfer_batch_run(VALUE v, VALUE items, void (*prepare)(struct rusb_xfer_batch *),
+                    struct rusb_xfer *tmpl, const char *reason)
+{
+  struct rusb_xfer_batch b;
+  long i;
+  Check_Type(items, T_ARRAY);
+  b.n = RARRAY_LEN(items);
+  b.xs = ALLOC_N(struct rusb_xfer, b.n);
+  for (i = 0; i < b.n; i++) {
+    b.xs[i] = *tmpl;
+    b.xs[i].locked = RUSB_UNLOCKED;
+    b.xs[i].ret = RUSB_XFER_NOT_RUN;
+    b.xs[i].timed = rusb_timed(tmpl->h);
+    b.xs[i].usec = RUSB_STATS_NOT_RUN;
+  }
+  b.done = 0;
+  b.interrupted = 0;
+  b.running = 0;
+  b.reason = reason;
+  b.prepare = prepare;
+  b.items = items;
+  b.bufs = rb_ary_new2(b.n);
+  b.result = Qnil;
+  rb_ensure(rusb_xfer_batch_body, (VALUE)&b, rusb_xfer_batch_ensure, (VALUE)&b);
+  RB_GC_GUARD(b.items);
+  RB_GC_GUARD(b.bufs);
+  return b.result;
+}
+
+static void
+rusb_bulk_write_batch_prepare(struct rusb_xfer_batch *b)
+{
+  long i;
+  for (i = 0; i < b->n; i++)
+    rusb_xfer_batch_buffer(b, i, rb_ary_entry(b->items, i));
+}
+
+static void
+rusb_control_batch_prepare(struct rusb_xfer_batch *b)
+{
+  long i;
+  for (i = 0; i < b->n; i++) {
+    struct rusb_xfer *x = &b->xs[i];
+    VALUE item = rb_ary_entry(b->items, i);
+    Check_Type(item, T_ARRAY);
+    if (RARRAY_LEN(item) != 5)
+      rb_raise(rb_eArgError, "control request should be [requesttype, request, value, index, bytes]");
+    x->requesttype = NUM2INT(rb_ary_entry(item, 0));
+    x->request = NUM2INT(rb_ary_entry(item, 1));
+    x->value = NUM2INT(rb_ary_entry(item, 2));
+    x->index = NUM2INT(rb_ary_entry(item, 3));
+    x->in = (x->requesttype & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
+    rusb_xfer_batch_buffer(b, i, rb_ary_entry(item, 4));
+  }
+}
+
+/*
+ * USB::DevHandle#bulk_write_batch(endpoint, [bytes, ...], timeout)
+ *
+ * writes each bytes in order and returns their results.
+ * With libusb-1.0, up to 8 writes are in flight at a time.
+ */
+static VALUE
+rusb_bulk_write_batch(VALUE v, VALUE vep, VALUE vitems, VALUE vtimeout)
+{
+  struct rusb_xfer x;
+  x.h = get_rusb_devhandle(v);
+  x.type = USB_ENDPOINT_TYPE_BULK;
+  x.in = 0;
+  x.ep = NUM2INT(vep);
+  x.timeout = NUM2INT(vtimeout);
+  return rusb_xfer_batch_run(v, vitems, rusb_bulk_write_batch_prepare, &x, "usb_bulk_write");
+}
+
+/*
+ * USB::DevHandle#control_batch([[requesttype, request, value, index, bytes], ...], timeout)
+ *
+ * runs each control request in order and returns their results.
+ * With libusb-1.0, up to 8 requests are in flight at a time.
+ */
+static VALUE
+rusb_control_batch(VALUE v, VALUE vitems, VALUE vtimeout)
+{
+  struct rusb_xfer x;
+  x.h = get_rusb_devhandle(v);
+  x.type = USB_ENDPOINT_TYPE_CONTROL;
+  x.timeout = NUM2INT(vtimeout);
+  return rusb_xfer_batch_run(v, vitems, rusb_control_batch_prepare, &x, "usb_control_msg");
+}
+
+#ifdef HAVE_LIBUSB_1_0
+/* -------- asynchronous transfers (libusb-1.0) -------- */
+
+/*
+ * A transfer submitted by USB::DevHandle#usb_submit.
+ * It is linked in rusb_async_pending until USB.usb_handle_events finds
+ * it done.  The completion callback runs without the GVL in the thread
+ * handling events, so it only sets done.
+ */
+typedef struct rusb_async {
+  struct rusb_async *next, *prev;
+  struct libusb_transfer *t;
+  rusb_devhandle_t *h;
+  VALUE devhandle;
+  VALUE transfer; /* USB::Transfer */
+  VALUE str; /* the buffer or a frozen copy of the bytes written */
+  int locked; /* RUSB_LOCKED_* */
+  int type;
+  int in;
+  long offset;
+  long length; /* -1 until rusb_async_prepare if not given */
+  unsigned char *bytes;
+  unsigned char *ctrl; /* setup packet followed by the data of a control transfer */
+  int done;
+  int timed; /* RUSB_TIMED_* */
+  uint64_t start, usec;
+} rusb_async_t;
+
+static rusb_async_t rusb_async_pending = { &rusb_async_pending, &rusb_async_pending };
+static rb_nativethread_lock_t rusb_async_lock;
+static VALUE rusb_async_root;
+
+/*
+ * str is pinned: libusb holds a pointer to its bytes,
+ * which move with an embedded String.
+ */
+static void rusb_async_mark(void *p)
+{
+  rusb_async_t *a;
+  for (a = rusb_async_pending.next; a != &rusb_async_pending; a = a->next) {
+    rb_gc_mark_movable(a->devhandle);
+    rb_gc_mark_movable(a->transfer);
+    rb_gc_mark(a->str);
+  }
+}
+
+static void rusb_async_compact(void *p)
+{
+  rusb_async_t *a;
+  for (a = rusb_async_pending.next; a != &rusb_async_pending; a = a->next) {
+    a->devhandle = rb_gc_location(a->devhandle);
+    a->transfer = rb_gc_location(a->transfer);
+  }
+}
+
+/* the memory of the pending transfers. */
+static size_t rusb_async_memsize(const void *p)
+{
+  rusb_async_t *a;
+  size_t size = 0;
+  for (a = rusb_async_pending.next; a != &rusb_async_pending; a = a->next) {
+    size += sizeof(*a);
+    if (a->t)
+      size += sizeof(struct libusb_transfer) +
+              a->t->num_iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+    if (a->ctrl)
+      size += LIBUSB_CONTROL_SETUP_SIZE + a->length;
+  }
+  return size;
+}
+
+static const rb_data_type_t rusb_async_type = {
+  "USB::async",
+  { rusb_async_mark, 0, rusb_async_memsize, RUSB_DCOMPACT(rusb_async_compact) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void LIBUSB_CALL
+rusb_async_callback(struct libusb_transfer *t)
+{
+  rusb_async_t *a = (rusb_async_t *)t->user_data;
+  if (a->timed)
+    a->usec = rusb_clock_us() - a->start;
+  rb_nativethread_lock_lock(&rusb_async_lock);
+  a->done = 1;
+  rb_nativethread_lock_unlock(&rusb_async_lock);
+}
+
+static void
+rusb_async_unlock(rusb_async_t *a)
+{
+  if (a->locked == RUSB_LOCKED_STRING)
+    rb_str_unlocktmp(a->str);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  else if (a->locked == RUSB_LOCKED_IO_BUFFER)
+    rb_io_buffer_unlock(a->str);
+#endif
+  a->locked = RUSB_UNLOCKED;
+}
+
+static void
+rusb_async_free(rusb_async_t *a)
+{
+  if (a->t)
+    libusb_free_transfer(a->t);
+  if (a->ctrl)
+    xfree(a->ctrl);
+  xfree(a);
+}
+
+/*
+ * Sets up the buffer of a transfer of a->length bytes at a->offset.
+ * The length defaults to the rest of the buffer,
+ * up to the capacity of a String read into.
+ * The data of a control transfer is copied after the setup packet.
+ * A buffer read into is locked until the completion.
+ * A bulk or interrupt IN String is expanded here
+ * and resized to offset + the number of bytes received by the completion.
+ */
+static VALUE
+rusb_async_prepare(VALUE arg)
+{
+  rusb_async_t *a = (rusb_async_t *)arg;
+  VALUE vbuf = a->str;
+  VALUE vlength = a->length < 0 ? Qnil : LONG2NUM(a->length);
+  long len, end;
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  if (a->type != USB_ENDPOINT_TYPE_CONTROL && rb_obj_is_kind_of(vbuf, rb_cIOBuffer)) {
+    void *base;
+    size_t size;
+    if (a->in)
+      rb_io_buffer_get_bytes_for_writing(vbuf, &base, &size);
+    else
+      rb_io_buffer_get_bytes_for_reading(vbuf, (const void **)&base, &size);
+    a->length = rusb_check_range(a->offset, vlength, (long)size);
+    if ((long)size - a->offset < a->length)
+      rb_raise(rb_eArgError, "length out of buffer");
+    rb_io_buffer_lock(vbuf);
+    a->locked = RUSB_LOCKED_IO_BUFFER;
+    a->bytes = (unsigned char *)base + a->offset;
+    return Qnil;
+  }
+#endif
+  StringValue(vbuf);
+  a->str = vbuf;
+  len = RSTRING_LEN(vbuf);
+  if (!a->in || a->type == USB_ENDPOINT_TYPE_CONTROL) {
+    a->length = rusb_check_range(a->offset, vlength, len);
+    if (len - a->offset < a->length)
+      rb_raise(rb_eArgError, "length out of buffer");
+    if (a->type == USB_ENDPOINT_TYPE_CONTROL) {
+      if (a->in)
+        rb_str_modify(vbuf);
+      else
+        memcpy(a->ctrl + LIBUSB_CONTROL_SETUP_SIZE, RSTRING_PTR(vbuf) + a->offset, a->length);
+      a->bytes = a->ctrl;
+    }
+    else {
+      a->str = rb_str_new_frozen(vbuf);
+      a->bytes = (unsigned char *)RSTRING_PTR(a->str) + a->offset;
+    }
+    return Qnil;
+  }
+  if (a->offset < 0 || len < a->offset)
+    rb_raise(rb_eArgError, "offset out of buffer");
+  a->length = rusb_check_range(a->offset, vlength, (long)rb_str_capacity(vbuf));
+  end = a->offset + a->length;
+  rb_str_modify_expand(vbuf, len < end ? end - len : 0);
+  if (a->type == USB_ENDPOINT_TYPE_ISOCHRONOUS && len < end)
+    rb_str_set_len(vbuf, end);
+  rb_str_locktmp(vbuf);
+  a->locked = RUSB_LOCKED_STRING;
+  a->bytes = (unsigned char *)RSTRING_PTR(vbuf) + a->offset;
+  return Qnil;
+}
+
+/*
+ * USB::DevHandle#usb_submit(transfer, type, endpoint, buffer, offset, length, timeout, setup, iso_lengths, stream_id)
+ *
+ * submits an asynchronous transfer of _type_ (USB_ENDPOINT_TYPE_*)
+ * on _length_ bytes of _buffer_ at _offset_.
+ * A nil _length_ is the rest of the buffer (bulk and interrupt only).
+ * _setup_ is [requesttype, request, value, index] of a control transfer.
+ * _iso_lengths_ is the array of packet lengths of an isochronous transfer.
+ * _stream_id_ is the bulk stream or nil.
+ * The completion is reported by USB.usb_handle_events.
+ */
+static VALUE
+rusb_submit(VALUE v, VALUE vtransfer, VALUE vtype, VALUE vep, VALUE vbuf, VALUE voffset,
+            VALUE vlength, VALUE vtimeout, VALUE vsetup, VALUE viso, VALUE vstream)
+{
+  rusb_devhandle_t *h = get_rusb_devhandle(v);
+  int type = NUM2INT(vtype);
+  int ep = NUM2INT(vep);
+  long offset = NUM2LONG(voffset);
+  long length = NIL_P(vlength) ? -1 : NUM2LONG(vlength);
+  unsigned int timeout = NUM2UINT(vtimeout);
+  int requesttype = 0, request = 0, value = 0, index = 0;
+  int niso = 0, i, r, state;
+  int *iso_lengths = NULL;
+  VALUE iso_tmp = 0;
+  rusb_async_t *a;
+
+  if (offset < 0)
+    rb_raise(rb_eArgError, "offset out of buffer");
+  if (!NIL_P(vlength) && length < 0)
+    rb_raise(rb_eArgError, "negative length");
+  if (INT_MAX - LIBUSB_CONTROL_SETUP_SIZE < length)
+    length = INT_MAX - LIBUSB_CONTROL_SETUP_SIZE;
+  if (length < 0 && (type == USB_ENDPOINT_TYPE_CONTROL || type == USB_ENDPOINT_TYPE_ISOCHRONOUS))
+    rb_raise(rb_eArgError, "length required");
+  switch (type) {
+    case USB_ENDPOINT_TYPE_CONTROL:
+      Check_Type(vsetup, T_ARRAY);
+      if (RARRAY_LEN(vsetup) != 4)
+        rb_raise(rb_eArgError, "setup should be [requesttype, request, value, index]");
+      requesttype = NUM2INT(rb_ary_entry(vsetup, 0));
+      request = NUM2INT(rb_ary_entry(vsetup, 1));
+      value = NUM2INT(rb_ary_entry(vsetup, 2));
+      index = NUM2INT(rb_ary_entry(vsetup, 3));
+      if (0xffff < length)
+        rb_raise(rb_eArgError, "control transfer too long");
+      break;
+    case USB_ENDPOINT_TYPE_ISOCHRONOUS: {
+      long sum = 0;
+      Check_Type(viso, T_ARRAY);
+      if (INT_MAX < RARRAY_LEN(viso))
+        rb_raise(rb_eArgError, "too many packets");
+      niso = (int)RARRAY_LEN(viso);
+      iso_lengths = ALLOCV_N(int, iso_tmp, niso);
+      for (i = 0; i < niso; i++) {
+        iso_lengths[i] = NUM2INT(rb_ary_entry(viso, i));
+        if (iso_lengths[i] < 0)
+          rb_raise(rb_eArgError, "negative packet length");
+        sum += iso_lengths[i];
+      }
+      if (length < sum)
+        rb_raise(rb_eArgError, "packets exceed the length");
+      break;
+    }
+    case USB_ENDPOINT_TYPE_BULK:
+    case USB_ENDPOINT_TYPE_INTERRUPT:
+      break;
+    default:
+      rb_raise(rb_eArgError, "unexpected transfer type: %d", type);
+  }
+#ifndef HAVE_LIBUSB_ALLOC_STREAMS
+  if (!NIL_P(vstream))
+    rb_raise(rb_eNotImpError, "bulk streams are not supported by this libusb");
+#endif
+
+  a = ZALLOC(rusb_async_t);
+  a->h = h;
+  a->devhandle = v;
+  a->transfer = vtransfer;
+  a->str = vbuf;
+  a->type = type;
+  a->in = ((type == USB_ENDPOINT_TYPE_CONTROL ? requesttype : ep) & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
+  a->offset = offset;
+  a->length = length;
+  if (type == USB_ENDPOINT_TYPE_CONTROL) {
+    a->ctrl = ALLOC_N(unsigned char, LIBUSB_CONTROL_SETUP_SIZE + length);
+    libusb_fill_control_setup(a->ctrl, requesttype, request, value, index, length);
+  }
+  rb_protect(rusb_async_prepare, (VALUE)a, &state);
+  if (state) {
+    rusb_async_free(a);
+    rb_jump_tag(state);
+  }
+  a->t = libusb_alloc_transfer(niso);
+  if (!a->t) {
+    rusb_async_unlock(a);
+    rusb_async_free(a);
+    rb_memerror();
+  }
+  switch (type) {
+    case USB_ENDPOINT_TYPE_CONTROL:
+      libusb_fill_control_transfer(a->t, h->ptr->handle, a->ctrl,
+                                   rusb_async_callback, a, timeout);
+      break;
+    case USB_ENDPOINT_TYPE_BULK:
+#ifdef HAVE_LIBUSB_ALLOC_STREAMS
+      if (!NIL_P(vstream)) {
+        libusb_fill_bulk_stream_transfer(a->t, h->ptr->handle, ep, NUM2UINT(vstream),
+                                         a->bytes, (int)a->length, rusb_async_callback, a, timeout);
+        break;
+      }
+#endif
+      libusb_fill_bulk_transfer(a->t, h->ptr->handle, ep, a->bytes, (int)a->length,
+                                rusb_async_callback, a, timeout);
+      break;
+    case USB_ENDPOINT_TYPE_INTERRUPT:
+      libusb_fill_interrupt_transfer(a->t, h->ptr->handle, ep, a->bytes, (int)a->length,
+                                     rusb_async_callback, a, timeout);
+      break;
+    case USB_ENDPOINT_TYPE_ISOCHRONOUS:
+      libusb_fill_iso_transfer(a->t, h->ptr->handle, ep, a->bytes, (int)a->length, niso,
+                               rusb_async_callback, a, timeout);
+      for (i = 0; i < niso; i++)
+        a->t->iso_packet_desc[i].length = iso_lengths[i];
+      break;
+  }
+  ALLOCV_END(iso_tmp);
+  a->timed = rusb_timed(h);
+  if (a->timed)
+    a->start = rusb_clock_us();
+  r = libusb_submit_transfer(a->t);
+  if (r < 0) {
+    rusb_async_unlock(a);
+    rusb_async_free(a);
+    check_usb_error("usb_submit", rusb1_error(r));
+  }
+  h->inflight++;
+  a->prev = rusb_async_pending.prev;
+  a->next = &rusb_async_pending;
+  a->prev->next = a;
+  rusb_async_pending.prev = a;
+  return vtransfer;
+}
+
+/*
+ * USB::DevHandle#usb_cancel(transfer)
+ *
+ * asks libusb to cancel _transfer_ submitted by usb_submit on this handle.
+ * It returns true if the transfer was pending,
+ * false if it is done or unknown.
+ * The cancelled transfer is reported by USB.usb_handle_events with ECANCELED,
+ * or with its own completion if it completed meanwhile.
+ */
+static VALUE
+rusb_cancel(VALUE v, VALUE vtransfer)
+{
+  rusb_devhandle_t *h = get_rusb_devhandle(v);
+  rusb_async_t *a;
+  int done, r;
+  for (a = rusb_async_pending.next; a != &rusb_async_pending; a = a->next) {
+    if (a->h != h || a->transfer != vtransfer)
+      continue;
+    rb_nativethread_lock_lock(&rusb_async_lock);
+    done = a->done;
+    rb_nativethread_lock_unlock(&rusb_async_lock);
+    if (done)
+      return Qfalse;
+    r = libusb_cancel_transfer(a->t);
+    if (r == LIBUSB_ERROR_NOT_FOUND)
+      return Qfalse;
+    if (r < 0)
+      check_usb_error("usb_cancel", rusb1_error(r));
+    return Qtrue;
+  }
+  return Qfalse;
+}
+
+static VALUE
+rusb_async_status(enum libusb_transfer_status status)
+{
+  int e = rusb_transfer_errno(status);
+  return e ? INT2FIX(e) : Qnil;
+}
+
+/*
+ * traces a done transfer, before its buffer is unlocked.
+ * An isochronous transfer is captured as its whole buffer.
+ */
+static void
+rusb_async_trace(rusb_async_t *a)
+{
+  struct libusb_transfer *t = a->t;
+  rusb_trace_t *tr = a->h->trace;
+  int i, ret = t->actual_length;
+  const unsigned char *data = a->bytes;
+  if (!(a->timed & RUSB_TIMED_TRACE) || !tr || !tr->enabled)
+    return;
+  if (a->type == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+    for (ret = 0, i = 0; i < t->num_iso_packets; i++)
+      ret += t->iso_packet_desc[i].actual_length;
+  }
+  if (t->status != LIBUSB_TRANSFER_COMPLETED)
+    ret = -FIX2INT(rusb_async_status(t->status));
+  if (a->type == USB_ENDPOINT_TYPE_CONTROL) {
+    data = a->ctrl + LIBUSB_CONTROL_SETUP_SIZE;
+    rusb_trace_add(tr, a->type, a->ctrl[0] & USB_ENDPOINT_DIR_MASK, a->ctrl, (int)a->length, ret,
+                   a->start, a->usec, data, a->in ? t->actual_length : a->length);
+  }
+  else {
+    rusb_trace_add(tr, a->type, t->endpoint, NULL, (int)a->length, ret,
+                   a->start, a->usec, data,
+                   a->in && a->type != USB_ENDPOINT_TYPE_ISOCHRONOUS ? t->actual_length : a->length);
+  }
+}
+
+/*
+ * Finishes a done transfer and returns
+ * [transfer, actual_length, errno or nil, [[actual_length, errno or nil], ...] or nil].
+ */
+static VALUE
+rusb_async_finish(rusb_async_t *a)
+{
+  struct libusb_transfer *t = a->t;
+  VALUE iso = Qnil, status;
+  int i, bytes = a->type == USB_ENDPOINT_TYPE_ISOCHRONOUS ? 0 : t->actual_length;
+  rusb_async_trace(a);
+  rusb_async_unlock(a);
+  if (a->in && RB_TYPE_P(a->str, T_STRING)) {
+    if (a->type == USB_ENDPOINT_TYPE_CONTROL) {
+      long n = t->actual_length;
+      if (RSTRING_LEN(a->str) - a->offset < n)
+        n = RSTRING_LEN(a->str) - a->offset;
+      if (0 < n && !OBJ_FROZEN(a->str)) {
+        rb_str_modify(a->str);
+        memcpy(RSTRING_PTR(a->str) + a->offset, a->ctrl + LIBUSB_CONTROL_SETUP_SIZE, n);
+      }
+    }
+    else if (a->type != USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+      rb_str_set_len(a->str, a->offset + t->actual_length);
+    }
+  }
+  if (a->type == USB_ENDPOINT_TYPE_ISOCHRONOUS) {
+    iso = rb_ary_new2(t->num_iso_packets);
+    for (i = 0; i < t->num_iso_packets; i++) {
+      struct libusb_iso_packet_descriptor *d = &t->iso_packet_desc[i];
+      rb_ary_push(iso, rb_assoc_new(UINT2NUM(d->actual_length), rusb_async_status(d->status)));
+      bytes += d->actual_length;
+    }
+  }
+  status = rusb_async_status(t->status);
+  if (a->timed & RUSB_TIMED_STATS)
+    rusb_stats_count(a->h, a->type == USB_ENDPOINT_TYPE_CONTROL ? 0 : t->endpoint,
+                     NIL_P(status) ? bytes : -FIX2INT(status), a->usec);
+  return rb_ary_new3(4, a->transfer, INT2NUM(t->actual_length), status, iso);
+}
+
+struct rusb_events {
+  struct timeval tv;
+  int ret;
+};
+
+static void *
+rusb_handle_events_nogvl(void *arg)
+{
+  struct rusb_events *e = (struct rusb_events *)arg;
+  e->ret = libusb_handle_events_timeout_completed(rusb1_context, &e->tv, NULL);
+  return NULL;
+}
+
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+static void
+rusb_handle_events_ubf(void *arg)
+{
+  libusb_interrupt_event_handler(rusb1_context);
+}
+# define RUSB_EVENTS_UBF rusb_handle_events_ubf
+#else
+# define RUSB_EVENTS_UBF RUBY_UBF_IO
+#endif
+
+/*
+ * USB.usb_handle_events(timeout)
+ *
+ * handles libusb events at most _timeout_ seconds without the GVL
+ * and returns the transfers done, as
+ * [[transfer, actual_length, errno or nil, iso_packets or nil], ...].
+ * A zero _timeout_ polls without releasing the GVL.
+ */
+static VALUE
+rusb_handle_events(VALUE cUSB, VALUE vtimeout)
+{
+  struct rusb_events e;
+  rusb_async_t *a, *next, done;
+  VALUE result;
+  double timeout = NUM2DBL(vtimeout);
+  if (timeout < 0)
+    timeout = 0;
+  e.tv.tv_sec = (time_t)timeout;
+  e.tv.tv_usec = (long)((timeout - (double)e.tv.tv_sec) * 1e6);
+  e.ret = LIBUSB_ERROR_INTERRUPTED;
+  if (timeout == 0)
+    rusb_handle_events_nogvl(&e);
+  else
+    rusb_without_gvl2(rusb_handle_events_nogvl, &e, RUSB_EVENTS_UBF, NULL);
+  if (e.ret < 0 && e.ret != LIBUSB_ERROR_INTERRUPTED && e.ret != LIBUSB_ERROR_TIMEOUT)
+    check_usb_error("usb_handle_events", rusb1_error(e.ret));
+
+  /* unlink the done transfers first so that no Ruby code runs in between. */
+  done.next = done.prev = &done;
+  rb_nativethread_lock_lock(&rusb_async_lock);
+  for (a = rusb_async_pending.next; a != &rusb_async_pending; a = next) {
+    next = a->next;
+    if (!a->done)
+      continue;
+    a->prev->next = a->next;
+    a->next->prev = a->prev;
+    a->prev = done.prev;
+    a->next = &done;
+    done.prev->next = a;
+    done.prev = a;
+  }
+  rb_nativethread_lock_unlock(&rusb_async_lock);
+
+  result = rb_ary_new();
+  for (a = done.next; a != &done; a = next) {
+    next = a->next;
+    a->h->inflight--;
+    rb_ary_push(result, rusb_async_finish(a));
+    rusb_async_free(a);
+  }
+  return result;
+}
+
+/*
+ * USB.usb_pollfds
+ *
+ * returns the file descriptors libusb polls, as [[fd, :r, :w or :rw], ...].
+ * It is empty on a platform without pollable file descriptors.
+ */
+static VALUE
+rusb_pollfds(VALUE cUSB)
+{
+  const struct libusb_pollfd **fds = libusb_get_pollfds(rusb1_context);
+  VALUE result = rb_ary_new();
+  int i;
+  if (!fds)
+    return result;
+  for (i = 0; fds[i]; i++) {
+    short events = fds[i]->events;
+    const char *interest = (events & POLLOUT) ? ((events & POLLIN) ? "rw" : "w") : "r";
+    rb_ary_push(result, rb_assoc_new(INT2NUM(fds[i]->fd), ID2SYM(rb_intern(interest))));
+  }
+#ifdef HAVE_LIBUSB_FREE_POLLFDS
+  libusb_free_pollfds(fds);
+#else
+  free((void *)fds);
+#endif
+  return result;
+}
+
+/*
+ * USB.usb_next_timeout
+ *
+ * returns the seconds until libusb needs USB.usb_handle_events
+ * for a timeout, or nil if no timeout is pending.
+ */
+static VALUE
+rusb_next_timeout(VALUE cUSB)
+{
+  struct timeval tv;
+  int r = libusb_get_next_timeout(rusb1_context, &tv);
+  check_usb_error("usb_next_timeout", rusb1_error(r));
+  if (r == 0)
+    return Qnil;
+  return rb_float_new((double)tv.tv_sec + (double)tv.tv_usec / 1e6);
+}
+
+#ifdef HAVE_LIBUSB_HOTPLUG_REGISTER_CALLBACK
+/*
+ * Hotplug events queued by the libusb callback, which runs without the
+ * GVL, until USB.usb_hotplug_events takes them.
+ */
+typedef struct rusb_hotplug_event {
+  struct rusb_hotplug_event *next;
+  libusb_device *dev;
+  libusb_hotplug_event event;
+  long id;
+} rusb_hotplug_event_t;
+
+static rusb_hotplug_event_t *rusb_hotplug_head;
+static rusb_hotplug_event_t **rusb_hotplug_tail = &rusb_hotplug_head;
+
+static int LIBUSB_CALL
+rusb_hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+  rusb_hotplug_event_t *e = malloc(sizeof(*e));
+  if (!e)
+    return 0;
+  e->next = NULL;
+  e->dev = libusb_ref_device(dev);
+  e->event = event;
+  e->id = (long)(intptr_t)user_data;
+  rb_nativethread_lock_lock(&rusb_async_lock);
+  *rusb_hotplug_tail = e;
+  rusb_hotplug_tail = &e->next;
+  rb_nativethread_lock_unlock(&rusb_async_lock);
+  return 0;
+}
+
+/*
+ * USB.usb_hotplug_register(id, vendor, product, devclass, enumerate)
+ *
+ * registers a hotplug callback reporting events with _id_.
+ * -1 matches any _vendor_, _product_ or _devclass_.
+ * If _enumerate_ is true, the devices present are reported as arrived.
+ * It returns the libusb callback handle.
+ */
+static VALUE
+rusb_hotplug_register(VALUE cUSB, VALUE vid, VALUE vvendor, VALUE vproduct, VALUE vclass, VALUE venumerate)
+{
+  libusb_hotplug_callback_handle handle;
+  int r;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    rb_raise(rb_eNotImpError, "hotplug is not supported on this platform");
+  r = libusb_hotplug_register_callback(rusb1_context,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        RTEST(venumerate) ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS,
+        NUM2INT(vvendor), NUM2INT(vproduct), NUM2INT(vclass),
+        rusb_hotplug_callback, (void *)(intptr_t)NUM2LONG(vid), &handle);
+  check_usb_error("usb_hotplug_register", rusb1_error(r));
+  return INT2NUM(handle);
+}
+
+/* USB.usb_hotplug_deregister(handle) */
+static VALUE
+rusb_hotplug_deregister(VALUE cUSB, VALUE vhandle)
+{
+  libusb_hotplug_deregister_callback(rusb1_context, NUM2INT(vhandle));
+  return Qnil;
+}
+
+/*
+ * USB.usb_hotplug_events
+ *
+ * returns the hotplug events since the last call,
+ * as [[id, :arrived or :left, device], ...].
+ * The device list is updated without revoking any object,
+ * so a device left is still usable as a USB::Device
+ * until the next USB.find_busses or USB.rescan.
+ */
+static VALUE
+rusb_hotplug_events(VALUE cUSB)
+{
+  rusb_hotplug_event_t *e, *next;
+  VALUE result = rb_ary_new();
+  rb_nativethread_lock_lock(&rusb_async_lock);
+  e = rusb_hotplug_head;
+  rusb_hotplug_head = NULL;
+  rusb_hotplug_tail = &rusb_hotplug_head;
+  rb_nativethread_lock_unlock(&rusb_async_lock);
+  if (e) {
+    rusb1_update();
+    rusb_index = Qnil;
+  }
+  for (; e; e = next) {
+    struct usb_device *d = rusb1_find_device(e->dev);
+    next = e->next;
+    if (d) {
+      VALUE vdev = rusb_device_make(d, rusb_bus_make(d->bus, Qnil));
+      VALUE event = ID2SYM(rb_intern(e->event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT ? "left" : "arrived"));
+      rb_ary_push(result, rb_ary_new3(3, LONG2NUM(e->id), event, vdev));
+    }
+    libusb_unref_device(e->dev);
+    free(e);
+  }
+  return result;
+}
+#endif
+
+#ifdef HAVE_LIBUSB_ALLOC_STREAMS
+static int
+rusb_stream_endpoints_count(VALUE veps)
+{
+  Check_Type(veps, T_ARRAY);
+  if (INT_MAX < RARRAY_LEN(veps))
+    rb_raise(rb_eArgError, "too many endpoints");
+  return (int)RARRAY_LEN(veps);
+}
+
+static void
+rusb_stream_endpoints(VALUE veps, unsigned char *eps, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    eps[i] = (unsigned char)NUM2INT(rb_ary_entry(veps, i));
+}
+
+/* USB::DevHandle#usb_alloc_streams(num_streams, endpoints) */
+static VALUE
+rusb_alloc_streams(VALUE v, VALUE vnum, VALUE veps)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  unsigned int num = NUM2UINT(vnum);
+  int n = rusb_stream_endpoints_count(veps);
+  VALUE tmp = 0;
+  unsigned char *eps = ALLOCV_N(unsigned char, tmp, n);
+  int ret;
+  rusb_stream_endpoints(veps, eps, n);
+  ret = libusb_alloc_streams(p->handle, num, eps, n);
+  ALLOCV_END(tmp);
+  check_usb_error("usb_alloc_streams", rusb1_error(ret));
+  return INT2NUM(ret);
+}
+
+/* USB::DevHandle#usb_free_streams(endpoints) */
+static VALUE
+rusb_free_streams(VALUE v, VALUE veps)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  int n = rusb_stream_endpoints_count(veps);
+  VALUE tmp = 0;
+  unsigned char *eps = ALLOCV_N(unsigned char, tmp, n);
+  int ret;
+  rusb_stream_endpoints(veps, eps, n);
+  ret = libusb_free_streams(p->handle, eps, n);
+  ALLOCV_END(tmp);
+  check_usb_error("usb_free_streams", rusb1_error(ret));
+  return Qnil;
+}
+#endif
+#endif
+
+/* USB::DevHandle#usb_close */
+static VALUE
+rusb_close(VALUE v)
+{
+  rusb_devhandle_t *d = get_rusb_devhandle(v);
+  if (d->inflight)
+    rb_raise(rb_eRuntimeError, "USB::DevHandle in use by another thread");
+  check_usb_error("usb_close", usb_close(d->ptr));
+  d->ptr = NULL;
+  return Qnil;
+}
+
+/* USB::DevHandle#usb_set_configuration(configuration) */
+static VALUE
+rusb_set_configuration(VALUE v, VALUE configuration)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  int ret = usb_set_configuration(p, NUM2INT(configuration));
+  check_usb_error("usb_set_configuration", ret);
+  return Qnil;
+}
+
+/* USB::DevHandle#usb_set_altinterface(alternate) */
+static VALUE
+rusb_set_altinterface(VALUE v, VALUE alternate)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  int ret = usb_set_altinterface(p, NUM2INT(alternate));
+  check_usb_error("usb_set_altinterface", ret);
+  return Qnil;
+}
+
+/* USB::DevHandle#usb_clear_halt(endpoint) */
+static VALUE
+rusb_clear_halt(VALUE v, VALUE ep)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  int ret = usb_clear_halt(p, NUM2UINT(ep));
+  check_usb_error("usb_clear_halt", ret);
+  return Qnil;
+}
+
+/* USB::DevHandle#usb_reset */
+static VALUE
+rusb_reset(VALUE v)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  int ret = usb_reset(p);
+  check_usb_error("usb_reset", ret);
+  /* xxx: call usb_close? */
+  return Qnil;
+}
+
+/* USB::DevHandle#usb_claim_interface(interface) */
+static VALUE
+rusb_claim_interface(VALUE v, VALUE interface)
+{
+  usb_dev_handle *p = get_usb_devhandle(v);
+  int ret = usb_claim_interface(p, NUM2INT(interface));
+  check_usb_error("usb_claim_interface", ret);
+  return Qnil;
+}
+
+/* USB::DevHandle#usb_release_interface(interface) */
+static VALUE
 rusb_release_interface(VALUE v, VALUE interface)
 {
   usb_dev_handle *p = get_usb_devhandle(v);
@@ -555,22 +3611,17 @@ rusb_control_msg(
   VALUE vbytes,
   VALUE vtimeout)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int requesttype = NUM2INT(vrequesttype);
-  int request = NUM2INT(vrequest);
-  int value = NUM2INT(vvalue);
-  int index = NUM2INT(vindex);
-  int timeout = NUM2INT(vtimeout);
-  char *bytes;
-  int size;
-  int ret;
-  StringValue(vbytes);
-  rb_str_modify(vbytes);
-  bytes = RSTRING_PTR(vbytes);
-  size = RSTRING_LEN(vbytes);
-  ret = usb_control_msg(p, requesttype, request, value, index, bytes, size, timeout);
-  check_usb_error("usb_control_msg", ret);
-  return INT2NUM(ret);
+  struct rusb_xfer x;
+  x.h = get_rusb_devhandle(v);
+  x.type = USB_ENDPOINT_TYPE_CONTROL;
+  x.in = (NUM2INT(vrequesttype) & USB_ENDPOINT_DIR_MASK) == USB_ENDPOINT_IN;
+  x.requesttype = NUM2INT(vrequesttype);
+  x.request = NUM2INT(vrequest);
+  x.value = NUM2INT(vvalue);
+  x.index = NUM2INT(vindex);
+  x.timeout = NUM2INT(vtimeout);
+  check_usb_error("usb_control_msg", rusb_xfer_run(&x, vbytes));
+  return INT2NUM(x.ret);
 }
 
 /* USB::DevHandle#usb_get_string(index, langid, buf) */
@@ -673,18 +3724,7 @@ rusb_bulk_write(
   VALUE vbytes,
   VALUE vtimeout)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ep = NUM2INT(vep);
-  int timeout = NUM2INT(vtimeout);
-  char *bytes;
-  int size;
-  int ret;
-  StringValue(vbytes);
-  bytes = RSTRING_PTR(vbytes);
-  size = RSTRING_LEN(vbytes);
-  ret = usb_bulk_write(p, ep, bytes, size, timeout);
-  check_usb_error("usb_bulk_write", ret);
-  return INT2NUM(ret);
+  return rusb_xfer_data(v, USB_ENDPOINT_TYPE_BULK, 0, "usb_bulk_write", vep, vbytes, vtimeout);
 }
 
 /* USB::DevHandle#usb_bulk_read(endpoint, bytes, timeout) */
@@ -695,19 +3735,7 @@ rusb_bulk_read(
   VALUE vbytes,
   VALUE vtimeout)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ep = NUM2INT(vep);
-  int timeout = NUM2INT(vtimeout);
-  char *bytes;
-  int size;
-  int ret;
-  StringValue(vbytes);
-  rb_str_modify(vbytes);
-  bytes = RSTRING_PTR(vbytes);
-  size = RSTRING_LEN(vbytes);
-  ret = usb_bulk_read(p, ep, bytes, size, timeout);
-  check_usb_error("usb_bulk_read", ret);
-  return INT2NUM(ret);
+  return rusb_xfer_data(v, USB_ENDPOINT_TYPE_BULK, 1, "usb_bulk_read", vep, vbytes, vtimeout);
 }
 
 /* USB::DevHandle#usb_interrupt_write(endpoint, bytes, timeout) */
@@ -718,18 +3746,7 @@ rusb_interrupt_write(
   VALUE vbytes,
   VALUE vtimeout)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ep = NUM2INT(vep);
-  int timeout = NUM2INT(vtimeout);
-  char *bytes;
-  int size;
-  int ret;
-  StringValue(vbytes);
-  bytes = RSTRING_PTR(vbytes);
-  size = RSTRING_LEN(vbytes);
-  ret = usb_interrupt_write(p, ep, bytes, size, timeout);
-  check_usb_error("usb_interrupt_write", ret);
-  return INT2NUM(ret);
+  return rusb_xfer_data(v, USB_ENDPOINT_TYPE_INTERRUPT, 0, "usb_interrupt_write", vep, vbytes, vtimeout);
 }
 
 /* USB::DevHandle#usb_interrupt_read(endpoint, bytes, timeout) */
@@ -740,19 +3757,21 @@ rusb_interrupt_read(
   VALUE vbytes,
   VALUE vtimeout)
 {
-  usb_dev_handle *p = get_usb_devhandle(v);
-  int ep = NUM2INT(vep);
-  int timeout = NUM2INT(vtimeout);
-  char *bytes;
-  int size;
-  int ret;
-  StringValue(vbytes);
-  rb_str_modify(vbytes);
-  bytes = RSTRING_PTR(vbytes);
-  size = RSTRING_LEN(vbytes);
-  ret = usb_interrupt_read(p, ep, bytes, size, timeout);
-  check_usb_error("usb_interrupt_read", ret);
-  return INT2NUM(ret);
+  return rusb_xfer_data(v, USB_ENDPOINT_TYPE_INTERRUPT, 1, "usb_interrupt_read", vep, vbytes, vtimeout);
+}
+
+/* USB::DevHandle#bulk_read_into(endpoint, buffer, timeout[, offset[, length]]) */
+static VALUE
+rusb_bulk_read_into(int argc, VALUE *argv, VALUE v)
+{
+  return rusb_xfer_data_into(argc, argv, v, USB_ENDPOINT_TYPE_BULK, "usb_bulk_read");
+}
+
+/* USB::DevHandle#interrupt_read_into(endpoint, buffer, timeout[, offset[, length]]) */
+static VALUE
+rusb_interrupt_read_into(int argc, VALUE *argv, VALUE v)
+{
+  return rusb_xfer_data_into(argc, argv, v, USB_ENDPOINT_TYPE_INTERRUPT, "usb_interrupt_read");
 }
 
 #ifdef LIBUSB_HAS_GET_DRIVER_NP
@@ -794,39 +3813,160 @@ rusb_detach_kernel_driver_np(
 }
 #endif
 
-/* -------- libusb binding initialization -------- */
+#ifdef RUSB_EMULATOR
+/* -------- emulated devices -------- */
 
-void
-Init_usb()
+/*
+ * USB.usb_emulator_plug(bus, devnum, parent, port, descriptors, strings, endpoints)
+ *
+ * plugs an emulated device with _descriptors_, the device descriptor
+ * followed by the configuration descriptors, and _strings_, the string
+ * descriptors by index or nil.
+ * _parent_ is the device number of the hub on the same bus, or nil.
+ * _endpoints_ is [[address, latency_us, bytes_per_sec, error_every, errno, loopback], ...].
+ * The device is seen by the next USB.find_devices or USB.rescan.
+ */
+static VALUE
+rusb_emulator_plug(VALUE cUSB, VALUE vbus, VALUE vdevnum, VALUE vparent, VALUE vport,
+                   VALUE vdescriptors, VALUE vstrings, VALUE vendpoints)
 {
-  rb_cUSB = rb_define_module("USB");
+  const unsigned char **strings;
+  int *lengths;
+  rusbemu_endpoint_t *eps;
+  VALUE strings_tmp = 0, lengths_tmp = 0, eps_tmp = 0;
+  long nstrings, neps, i;
+  int ret;
 
-#define f(name) rb_define_const(rb_cUSB, #name, INT2NUM(name));
-#include "constants.h"
-#undef f
+  StringValue(vdescriptors);
+  Check_Type(vstrings, T_ARRAY);
+  Check_Type(vendpoints, T_ARRAY);
+  nstrings = RARRAY_LEN(vstrings);
+  neps = RARRAY_LEN(vendpoints);
+  if (INT_MAX < RSTRING_LEN(vdescriptors) || 256 < nstrings || 32 < neps)
+    rb_raise(rb_eArgError, "too large device");
+  strings = ALLOCV_N(const unsigned char *, strings_tmp, nstrings);
+  lengths = ALLOCV_N(int, lengths_tmp, nstrings);
+  eps = ALLOCV_N(rusbemu_endpoint_t, eps_tmp, neps);
+  for (i = 0; i < nstrings; i++) {
+    VALUE str = rb_ary_entry(vstrings, i);
+    strings[i] = NULL;
+    lengths[i] = 0;
+    if (NIL_P(str))
+      continue;
+    Check_Type(str, T_STRING);
+    if (255 < RSTRING_LEN(str))
+      rb_raise(rb_eArgError, "too long string descriptor");
+    strings[i] = (const unsigned char *)RSTRING_PTR(str);
+    lengths[i] = (int)RSTRING_LEN(str);
+  }
+  for (i = 0; i < neps; i++) {
+    VALUE ep = rb_ary_entry(vendpoints, i);
+    Check_Type(ep, T_ARRAY);
+    if (RARRAY_LEN(ep) != 6)
+      rb_raise(rb_eArgError, "endpoint should be [address, latency_us, bytes_per_sec, error_every, errno, loopback]");
+    eps[i].address = NUM2INT(rb_ary_entry(ep, 0));
+    eps[i].latency_us = NUM2ULONG(rb_ary_entry(ep, 1));
+    eps[i].bytes_per_sec = NUM2ULONG(rb_ary_entry(ep, 2));
+    eps[i].error_every = NUM2ULONG(rb_ary_entry(ep, 3));
+    eps[i].error = NUM2INT(rb_ary_entry(ep, 4));
+    eps[i].loopback = RTEST(rb_ary_entry(ep, 5));
+  }
+  ret = rusbemu_plug(NUM2INT(vbus), NUM2INT(vdevnum), NIL_P(vparent) ? 0 : NUM2INT(vparent),
+                     NUM2INT(vport),
+                     (const unsigned char *)RSTRING_PTR(vdescriptors), (int)RSTRING_LEN(vdescriptors),
+                     strings, lengths, (int)nstrings, eps, (int)neps);
+  ALLOCV_END(strings_tmp);
+  ALLOCV_END(lengths_tmp);
+  ALLOCV_END(eps_tmp);
+  RB_GC_GUARD(vstrings);
+  check_usb_error("usb_emulator_plug", ret);
+  return Qnil;
+}
 
-  bus_objects = st_init_numtable();
-  rb_cUSB_Bus = rb_define_class_under(rb_cUSB, "Bus", rb_cData);
+/*
+ * USB.usb_emulator_unplug(bus, devnum)
+ *
+ * unplugs an emulated device.
+ * The device is removed by the next USB.find_devices or USB.rescan.
+ */
+static VALUE
+rusb_emulator_unplug(VALUE cUSB, VALUE vbus, VALUE vdevnum)
+{
+  check_usb_error("usb_emulator_unplug", rusbemu_unplug(NUM2INT(vbus), NUM2INT(vdevnum)));
+  return Qnil;
+}
 
-  device_objects = st_init_numtable();
-  rb_cUSB_Device = rb_define_class_under(rb_cUSB, "Device", rb_cData);
+/* USB.usb_emulator_unplug_all */
+static VALUE
+rusb_emulator_unplug_all(VALUE cUSB)
+{
+  rusbemu_unplug_all();
+  return Qnil;
+}
+#endif
 
-  config_descriptor_objects = st_init_numtable();
-  rb_cUSB_Configuration = rb_define_class_under(rb_cUSB, "Configuration", rb_cData);
+/* -------- libusb binding initialization -------- */
 
-  interface_objects = st_init_numtable();
-  rb_cUSB_Interface = rb_define_class_under(rb_cUSB, "Interface", rb_cData);
+void
+Init_usb()
+{
+  VALUE rb_cWeakMap;
 
-  interface_descriptor_objects = st_init_numtable();
-  rb_cUSB_Setting = rb_define_class_under(rb_cUSB, "Setting", rb_cData);
+  rb_cUSB = rb_define_module("USB");
 
-  endpoint_descriptor_objects = st_init_numtable();
-  rb_cUSB_Endpoint = rb_define_class_under(rb_cUSB, "Endpoint", rb_cData);
+  id_aref = rb_intern("[]");
+  id_aset = rb_intern("[]=");
+  id_values = rb_intern("values");
+  rb_cWeakMap = rb_path2class("ObjectSpace::WeakMap");
 
-  rb_cUSB_DevHandle = rb_define_class_under(rb_cUSB, "DevHandle", rb_cData);
+#define f(name) rb_define_const(rb_cUSB, #name, INT2NUM(name));
+#include "constants.h"
+#undef f
 
-  rusb_gc_root = Data_Wrap_Struct(0, rusb_gc_mark, 0, 0); \
-  rb_global_variable(&rusb_gc_root);
+  bus_objects = rb_class_new_instance(0, NULL, rb_cWeakMap);
+  rb_global_variable(&bus_objects);
+  rb_cUSB_Bus = rb_define_class_under(rb_cUSB, "Bus", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_Bus);
+
+  device_objects = rb_class_new_instance(0, NULL, rb_cWeakMap);
+  rb_global_variable(&device_objects);
+  rb_cUSB_Device = rb_define_class_under(rb_cUSB, "Device", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_Device);
+
+  config_descriptor_objects = rb_class_new_instance(0, NULL, rb_cWeakMap);
+  rb_global_variable(&config_descriptor_objects);
+  rb_cUSB_Configuration = rb_define_class_under(rb_cUSB, "Configuration", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_Configuration);
+
+  interface_objects = rb_class_new_instance(0, NULL, rb_cWeakMap);
+  rb_global_variable(&interface_objects);
+  rb_cUSB_Interface = rb_define_class_under(rb_cUSB, "Interface", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_Interface);
+
+  interface_descriptor_objects = rb_class_new_instance(0, NULL, rb_cWeakMap);
+  rb_global_variable(&interface_descriptor_objects);
+  rb_cUSB_Setting = rb_define_class_under(rb_cUSB, "Setting", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_Setting);
+
+  endpoint_descriptor_objects = rb_class_new_instance(0, NULL, rb_cWeakMap);
+  rb_global_variable(&endpoint_descriptor_objects);
+  rb_cUSB_Endpoint = rb_define_class_under(rb_cUSB, "Endpoint", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_Endpoint);
+
+  rb_cUSB_DevHandle = rb_define_class_under(rb_cUSB, "DevHandle", rb_cObject);
+  rb_undef_alloc_func(rb_cUSB_DevHandle);
+
+#ifdef HAVE_LIBUSB_1_0
+  rb_define_const(rb_cUSB, "BACKEND", rb_str_new2("libusb-1.0"));
+  rb_nativethread_lock_initialize(&rusb_async_lock);
+  /* the mark function is not called for a NULL data pointer. */
+  rusb_async_root = TypedData_Wrap_Struct(0, &rusb_async_type, &rusb_async_pending);
+  rb_global_variable(&rusb_async_root);
+#elif defined(RUSB_EMULATOR)
+  rb_define_const(rb_cUSB, "BACKEND", rb_str_new2("emulator"));
+#else
+  rb_define_const(rb_cUSB, "BACKEND", rb_str_new2("libusb-0.1"));
+#endif
 
   usb_init();
   usb_find_busses(); /* xxx: return value */
@@ -834,7 +3974,22 @@ Init_usb()
 
   rb_define_module_function(rb_cUSB, "find_busses", rusb_find_busses, 0);
   rb_define_module_function(rb_cUSB, "find_devices", rusb_find_devices, 0);
+  rb_define_module_function(rb_cUSB, "rescan", rusb_rescan, 0);
   rb_define_module_function(rb_cUSB, "first_bus", rusb_first_bus, 0);
+  rb_define_module_function(rb_cUSB, "usb_lookup", rusb_usb_lookup, 2);
+  rb_define_module_function(rb_cUSB, "usb_enumerate", rusb_enumerate, 2);
+  rb_define_module_function(rb_cUSB, "usb_buffer_room", rusb_buffer_room, 3);
+  rb_global_variable(&rusb_index);
+#ifdef HAVE_LIBUSB_1_0
+  rb_define_module_function(rb_cUSB, "usb_handle_events", rusb_handle_events, 1);
+  rb_define_module_function(rb_cUSB, "usb_pollfds", rusb_pollfds, 0);
+  rb_define_module_function(rb_cUSB, "usb_next_timeout", rusb_next_timeout, 0);
+#endif
+#ifdef HAVE_LIBUSB_HOTPLUG_REGISTER_CALLBACK
+  rb_define_module_function(rb_cUSB, "usb_hotplug_register", rusb_hotplug_register, 5);
+  rb_define_module_function(rb_cUSB, "usb_hotplug_deregister", rusb_hotplug_deregister, 1);
+  rb_define_module_function(rb_cUSB, "usb_hotplug_events", rusb_hotplug_events, 0);
+#endif
 
   rb_define_method(rb_cUSB_Bus, "revoked?", rusb_bus_revoked_p, 0);
   rb_define_method(rb_cUSB_Bus, "prev", rusb_bus_prev, 0);
@@ -851,6 +4006,9 @@ Init_usb()
   rb_define_method(rb_cUSB_Device, "devnum", rusb_device_devnum, 0);
   rb_define_method(rb_cUSB_Device, "num_children", rusb_device_num_children, 0);
   rb_define_method(rb_cUSB_Device, "children", rusb_device_children, 0);
+#ifdef HAVE_LIBUSB_GET_PORT_NUMBERS
+  rb_define_method(rb_cUSB_Device, "port_path", rusb_device_port_path, 0);
+#endif
   rb_define_method(rb_cUSB_Device, "bLength", rusb_devdesc_bLength, 0);
   rb_define_method(rb_cUSB_Device, "bDescriptorType", rusb_devdesc_bDescriptorType, 0);
   rb_define_method(rb_cUSB_Device, "bcdUSB", rusb_devdesc_bcdUSB, 0);
@@ -909,6 +4067,41 @@ Init_usb()
   rb_define_method(rb_cUSB_Endpoint, "bRefresh", rusb_endpoint_bRefresh, 0);
   rb_define_method(rb_cUSB_Endpoint, "bSynchAddress", rusb_endpoint_bSynchAddress, 0);
 
+  /* frozen snapshots of all fields of a descriptor, as Struct. */
+  rb_cUSB_DeviceDescriptor = rb_struct_define_under(rb_cUSB_Device, "Descriptor",
+    "bLength", "bDescriptorType", "bcdUSB", "bDeviceClass", "bDeviceSubClass",
+    "bDeviceProtocol", "bMaxPacketSize0", "idVendor", "idProduct", "bcdDevice",
+    "iManufacturer", "iProduct", "iSerialNumber", "bNumConfigurations", NULL);
+  rb_cUSB_ConfigDescriptor = rb_struct_define_under(rb_cUSB_Configuration, "Descriptor",
+    "bLength", "bDescriptorType", "wTotalLength", "bNumInterfaces",
+    "bConfigurationValue", "iConfiguration", "bmAttributes", "bMaxPower", NULL);
+  rb_cUSB_SettingDescriptor = rb_struct_define_under(rb_cUSB_Setting, "Descriptor",
+    "bLength", "bDescriptorType", "bInterfaceNumber", "bAlternateSetting",
+    "bNumEndpoints", "bInterfaceClass", "bInterfaceSubClass", "bInterfaceProtocol",
+    "iInterface", NULL);
+  rb_cUSB_EndpointDescriptor = rb_struct_define_under(rb_cUSB_Endpoint, "Descriptor",
+    "bLength", "bDescriptorType", "bEndpointAddress", "bmAttributes",
+    "wMaxPacketSize", "bInterval", "bRefresh", "bSynchAddress", NULL);
+  rb_define_method(rb_cUSB_Device, "descriptor", rusb_device_descriptor, 0);
+  rb_define_method(rb_cUSB_Configuration, "descriptor", rusb_config_descriptor, 0);
+  rb_define_method(rb_cUSB_Setting, "descriptor", rusb_setting_descriptor, 0);
+  rb_define_method(rb_cUSB_Endpoint, "descriptor", rusb_endpoint_descriptor, 0);
+
+  rusb_string_cache = rb_hash_new();
+  rb_global_variable(&rusb_string_cache);
+  rb_define_method(rb_cUSB_Device, "usb_string", rusb_device_usb_string, 3);
+  rb_define_method(rb_cUSB_Device, "usb_probe", rusb_device_usb_probe, 1);
+  rb_define_module_function(rb_cUSB, "clear_string_cache", rusb_clear_string_cache, 0);
+#ifdef RUSB_EMULATOR
+  rb_define_module_function(rb_cUSB, "usb_emulator_plug", rusb_emulator_plug, 7);
+  rb_define_module_function(rb_cUSB, "usb_emulator_unplug", rusb_emulator_unplug, 2);
+  rb_define_module_function(rb_cUSB, "usb_emulator_unplug_all", rusb_emulator_unplug_all, 0);
+#endif
+  rb_define_module_function(rb_cUSB, "stats_enabled?", rusb_stats_enabled_p, 0);
+  rb_define_module_function(rb_cUSB, "stats_enabled=", rusb_set_stats_enabled, 1);
+  rb_define_module_function(rb_cUSB, "stats", rusb_stats, 0);
+  rb_define_module_function(rb_cUSB, "reset_stats", rusb_reset_stats, 0);
+
   rb_define_method(rb_cUSB_DevHandle, "usb_close", rusb_close, 0);
   rb_define_method(rb_cUSB_DevHandle, "usb_set_configuration", rusb_set_configuration, 1);
   rb_define_method(rb_cUSB_DevHandle, "usb_set_altinterface", rusb_set_altinterface, 1);
@@ -925,6 +4118,24 @@ Init_usb()
   rb_define_method(rb_cUSB_DevHandle, "usb_bulk_read", rusb_bulk_read, 3);
   rb_define_method(rb_cUSB_DevHandle, "usb_interrupt_write", rusb_interrupt_write, 3);
   rb_define_method(rb_cUSB_DevHandle, "usb_interrupt_read", rusb_interrupt_read, 3);
+  rb_define_method(rb_cUSB_DevHandle, "bulk_read_into", rusb_bulk_read_into, -1);
+  rb_define_method(rb_cUSB_DevHandle, "interrupt_read_into", rusb_interrupt_read_into, -1);
+  rb_define_method(rb_cUSB_DevHandle, "bulk_write_batch", rusb_bulk_write_batch, 3);
+  rb_define_method(rb_cUSB_DevHandle, "control_batch", rusb_control_batch, 2);
+  rb_define_method(rb_cUSB_DevHandle, "stats", rusb_devhandle_stats, 0);
+  rb_define_method(rb_cUSB_DevHandle, "reset_stats", rusb_devhandle_reset_stats, 0);
+  rb_define_method(rb_cUSB_DevHandle, "usb_trace_start", rusb_devhandle_trace_start, 2);
+  rb_define_method(rb_cUSB_DevHandle, "usb_trace_stop", rusb_devhandle_trace_stop, 0);
+  rb_define_method(rb_cUSB_DevHandle, "tracing?", rusb_devhandle_tracing_p, 0);
+  rb_define_method(rb_cUSB_DevHandle, "usb_trace_records", rusb_devhandle_trace_records, 0);
+#ifdef HAVE_LIBUSB_1_0
+  rb_define_method(rb_cUSB_DevHandle, "usb_submit", rusb_submit, 10);
+  rb_define_method(rb_cUSB_DevHandle, "usb_cancel", rusb_cancel, 1);
+#endif
+#ifdef HAVE_LIBUSB_ALLOC_STREAMS
+  rb_define_method(rb_cUSB_DevHandle, "usb_alloc_streams", rusb_alloc_streams, 2);
+  rb_define_method(rb_cUSB_DevHandle, "usb_free_streams", rusb_free_streams, 1);
+#endif
 
 #ifdef LIBUSB_HAS_GET_DRIVER_NP
   rb_define_method(rb_cUSB_DevHandle, "usb_get_driver_np", rusb_get_driver_np, 2);
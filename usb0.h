@@ -0,0 +1,189 @@
+/*
+   usb0.h - libusb-0.1 structures and constants
+
+   Copyright (C) 2007 Tanaka Akira
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * The structures and constants of the libusb-0.1 API, for the backends
+ * which provide the API without libusb-0.1: usb1.h and usbemu.h.
+ * usb_dev_handle is defined by each backend.
+ */
+
+#ifndef RUSB_USB0_H
+#define RUSB_USB0_H
+
+#include <limits.h>
+
+#define USB_CLASS_PER_INTERFACE         0
+#define USB_CLASS_AUDIO                 1
+#define USB_CLASS_COMM                  2
+#define USB_CLASS_HID                   3
+#define USB_CLASS_PRINTER               7
+#define USB_CLASS_PTP                   6
+#define USB_CLASS_MASS_STORAGE          8
+#define USB_CLASS_HUB                   9
+#define USB_CLASS_DATA                  10
+#define USB_CLASS_VENDOR_SPEC           0xff
+
+#define USB_DT_DEVICE                   0x01
+#define USB_DT_CONFIG                   0x02
+#define USB_DT_STRING                   0x03
+#define USB_DT_INTERFACE                0x04
+#define USB_DT_ENDPOINT                 0x05
+#define USB_DT_HID                      0x21
+#define USB_DT_REPORT                   0x22
+#define USB_DT_PHYSICAL                 0x23
+#define USB_DT_HUB                      0x29
+
+#define USB_DT_DEVICE_SIZE              18
+#define USB_DT_CONFIG_SIZE              9
+#define USB_DT_INTERFACE_SIZE           9
+#define USB_DT_ENDPOINT_SIZE            7
+#define USB_DT_ENDPOINT_AUDIO_SIZE      9
+#define USB_DT_HUB_NONVAR_SIZE          7
+
+#define USB_MAXENDPOINTS                32
+#define USB_ENDPOINT_ADDRESS_MASK       0x0f
+#define USB_ENDPOINT_DIR_MASK           0x80
+#define USB_ENDPOINT_TYPE_MASK          0x03
+#define USB_ENDPOINT_TYPE_CONTROL       0
+#define USB_ENDPOINT_TYPE_ISOCHRONOUS   1
+#define USB_ENDPOINT_TYPE_BULK          2
+#define USB_ENDPOINT_TYPE_INTERRUPT     3
+#define USB_MAXINTERFACES               32
+#define USB_MAXALTSETTING               128
+#define USB_MAXCONFIG                   8
+
+#define USB_REQ_GET_STATUS              0x00
+#define USB_REQ_CLEAR_FEATURE           0x01
+#define USB_REQ_SET_FEATURE             0x03
+#define USB_REQ_SET_ADDRESS             0x05
+#define USB_REQ_GET_DESCRIPTOR          0x06
+#define USB_REQ_SET_DESCRIPTOR          0x07
+#define USB_REQ_GET_CONFIGURATION       0x08
+#define USB_REQ_SET_CONFIGURATION       0x09
+#define USB_REQ_GET_INTERFACE           0x0A
+#define USB_REQ_SET_INTERFACE           0x0B
+#define USB_REQ_SYNCH_FRAME             0x0C
+
+#define USB_TYPE_STANDARD               (0x00 << 5)
+#define USB_TYPE_CLASS                  (0x01 << 5)
+#define USB_TYPE_VENDOR                 (0x02 << 5)
+#define USB_TYPE_RESERVED               (0x03 << 5)
+
+#define USB_RECIP_DEVICE                0x00
+#define USB_RECIP_INTERFACE             0x01
+#define USB_RECIP_ENDPOINT              0x02
+#define USB_RECIP_OTHER                 0x03
+
+#define USB_ENDPOINT_IN                 0x80
+#define USB_ENDPOINT_OUT                0x00
+
+#define USB_ERROR_BEGIN                 500000
+
+#define LIBUSB_PATH_MAX (PATH_MAX + 1)
+
+struct usb_endpoint_descriptor {
+  unsigned char  bLength;
+  unsigned char  bDescriptorType;
+  unsigned char  bEndpointAddress;
+  unsigned char  bmAttributes;
+  unsigned short wMaxPacketSize;
+  unsigned char  bInterval;
+  unsigned char  bRefresh;
+  unsigned char  bSynchAddress;
+  unsigned char *extra;
+  int extralen;
+};
+
+struct usb_interface_descriptor {
+  unsigned char  bLength;
+  unsigned char  bDescriptorType;
+  unsigned char  bInterfaceNumber;
+  unsigned char  bAlternateSetting;
+  unsigned char  bNumEndpoints;
+  unsigned char  bInterfaceClass;
+  unsigned char  bInterfaceSubClass;
+  unsigned char  bInterfaceProtocol;
+  unsigned char  iInterface;
+  struct usb_endpoint_descriptor *endpoint;
+  unsigned char *extra;
+  int extralen;
+};
+
+struct usb_interface {
+  struct usb_interface_descriptor *altsetting;
+  int num_altsetting;
+};
+
+struct usb_config_descriptor {
+  unsigned char  bLength;
+  unsigned char  bDescriptorType;
+  unsigned short wTotalLength;
+  unsigned char  bNumInterfaces;
+  unsigned char  bConfigurationValue;
+  unsigned char  iConfiguration;
+  unsigned char  bmAttributes;
+  unsigned char  MaxPower;
+  struct usb_interface *interface;
+  unsigned char *extra;
+  int extralen;
+};
+
+struct usb_device_descriptor {
+  unsigned char  bLength;
+  unsigned char  bDescriptorType;
+  unsigned short bcdUSB;
+  unsigned char  bDeviceClass;
+  unsigned char  bDeviceSubClass;
+  unsigned char  bDeviceProtocol;
+  unsigned char  bMaxPacketSize0;
+  unsigned short idVendor;
+  unsigned short idProduct;
+  unsigned short bcdDevice;
+  unsigned char  iManufacturer;
+  unsigned char  iProduct;
+  unsigned char  iSerialNumber;
+  unsigned char  bNumConfigurations;
+};
+
+struct usb_bus;
+
+struct usb_device {
+  struct usb_device *next, *prev;
+  char filename[LIBUSB_PATH_MAX];
+  struct usb_bus *bus;
+  struct usb_device_descriptor descriptor;
+  struct usb_config_descriptor *config;
+  void *dev; /* the device of the backend */
+  unsigned char devnum;
+  unsigned char num_children;
+  struct usb_device **children;
+};
+
+struct usb_bus {
+  struct usb_bus *next, *prev;
+  char dirname[LIBUSB_PATH_MAX];
+  struct usb_device *devices;
+  unsigned int location;
+  struct usb_device *root_dev;
+};
+
+typedef struct usb_dev_handle usb_dev_handle;
+
+#endif
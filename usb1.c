@@ -0,0 +1,635 @@
+/*
+   usb1.c - libusb-0.1 API on top of libusb-1.0
+
+   Copyright (C) 2007 Tanaka Akira
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifdef HAVE_LIBUSB_1_0
+
+#include "usb1.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+libusb_context *rusb1_context;
+
+static struct usb_bus *rusb1_busses;
+
+/*
+ * Devices removed by rusb1_find_devices.
+ * They may still be referenced by Ruby objects until the next
+ * rusb1_find_busses, which revokes all of them.
+ */
+static struct usb_device *rusb1_removed_devices;
+
+/* converts a libusb-1.0 error to -errno as libusb-0.1 returns. */
+int
+rusb1_error(int r)
+{
+  switch (r) {
+    case LIBUSB_SUCCESS: return 0;
+    case LIBUSB_ERROR_IO: return -EIO;
+    case LIBUSB_ERROR_INVALID_PARAM: return -EINVAL;
+    case LIBUSB_ERROR_ACCESS: return -EACCES;
+    case LIBUSB_ERROR_NO_DEVICE: return -ENODEV;
+    case LIBUSB_ERROR_NOT_FOUND: return -ENOENT;
+    case LIBUSB_ERROR_BUSY: return -EBUSY;
+    case LIBUSB_ERROR_TIMEOUT: return -ETIMEDOUT;
+    case LIBUSB_ERROR_OVERFLOW: return -EOVERFLOW;
+    case LIBUSB_ERROR_PIPE: return -EPIPE;
+    case LIBUSB_ERROR_INTERRUPTED: return -EINTR;
+    case LIBUSB_ERROR_NO_MEM: return -ENOMEM;
+    case LIBUSB_ERROR_NOT_SUPPORTED: return -ENOSYS;
+    default: return r < 0 ? -EIO : r;
+  }
+}
+
+/* -------- descriptor tree -------- */
+
+static unsigned char *
+rusb1_copy_extra(const unsigned char *extra, int len)
+{
+  unsigned char *p;
+  if (len <= 0)
+    return NULL;
+  p = malloc(len);
+  if (p)
+    memcpy(p, extra, len);
+  return p;
+}
+
+static void
+rusb1_copy_config(struct usb_config_descriptor *dst, const struct libusb_config_descriptor *src)
+{
+  int i, j, k;
+  dst->bLength = src->bLength;
+  dst->bDescriptorType = src->bDescriptorType;
+  dst->wTotalLength = src->wTotalLength;
+  dst->bNumInterfaces = src->bNumInterfaces;
+  dst->bConfigurationValue = src->bConfigurationValue;
+  dst->iConfiguration = src->iConfiguration;
+  dst->bmAttributes = src->bmAttributes;
+  dst->MaxPower = src->MaxPower;
+  dst->extra = rusb1_copy_extra(src->extra, src->extra_length);
+  dst->extralen = dst->extra ? src->extra_length : 0;
+  dst->interface = calloc(src->bNumInterfaces, sizeof(struct usb_interface));
+  if (!dst->interface) {
+    dst->bNumInterfaces = 0;
+    return;
+  }
+  for (i = 0; i < src->bNumInterfaces; i++) {
+    const struct libusb_interface *si = &src->interface[i];
+    struct usb_interface *di = &dst->interface[i];
+    di->altsetting = calloc(si->num_altsetting, sizeof(struct usb_interface_descriptor));
+    if (!di->altsetting)
+      continue;
+    di->num_altsetting = si->num_altsetting;
+    for (j = 0; j < si->num_altsetting; j++) {
+      const struct libusb_interface_descriptor *sa = &si->altsetting[j];
+      struct usb_interface_descriptor *da = &di->altsetting[j];
+      da->bLength = sa->bLength;
+      da->bDescriptorType = sa->bDescriptorType;
+      da->bInterfaceNumber = sa->bInterfaceNumber;
+      da->bAlternateSetting = sa->bAlternateSetting;
+      da->bInterfaceClass = sa->bInterfaceClass;
+      da->bInterfaceSubClass = sa->bInterfaceSubClass;
+      da->bInterfaceProtocol = sa->bInterfaceProtocol;
+      da->iInterface = sa->iInterface;
+      da->extra = rusb1_copy_extra(sa->extra, sa->extra_length);
+      da->extralen = da->extra ? sa->extra_length : 0;
+      da->endpoint = calloc(sa->bNumEndpoints, sizeof(struct usb_endpoint_descriptor));
+      if (!da->endpoint)
+        continue;
+      da->bNumEndpoints = sa->bNumEndpoints;
+      for (k = 0; k < sa->bNumEndpoints; k++) {
+        const struct libusb_endpoint_descriptor *se = &sa->endpoint[k];
+        struct usb_endpoint_descriptor *de = &da->endpoint[k];
+        de->bLength = se->bLength;
+        de->bDescriptorType = se->bDescriptorType;
+        de->bEndpointAddress = se->bEndpointAddress;
+        de->bmAttributes = se->bmAttributes;
+        de->wMaxPacketSize = se->wMaxPacketSize;
+        de->bInterval = se->bInterval;
+        de->bRefresh = se->bRefresh;
+        de->bSynchAddress = se->bSynchAddress;
+        de->extra = rusb1_copy_extra(se->extra, se->extra_length);
+        de->extralen = de->extra ? se->extra_length : 0;
+      }
+    }
+  }
+}
+
+static void
+rusb1_free_config(struct usb_config_descriptor *config)
+{
+  int i, j, k;
+  if (!config->interface)
+    return;
+  for (i = 0; i < config->bNumInterfaces; i++) {
+    struct usb_interface *intf = &config->interface[i];
+    for (j = 0; j < intf->num_altsetting; j++) {
+      struct usb_interface_descriptor *alt = &intf->altsetting[j];
+      for (k = 0; k < alt->bNumEndpoints; k++)
+        free(alt->endpoint[k].extra);
+      free(alt->endpoint);
+      free(alt->extra);
+    }
+    free(intf->altsetting);
+  }
+  free(config->interface);
+  free(config->extra);
+}
+
+static struct usb_device *
+rusb1_device_new(struct usb_bus *bus, libusb_device *dev)
+{
+  struct usb_device *d;
+  struct libusb_device_descriptor desc;
+  int i;
+  if (libusb_get_device_descriptor(dev, &desc) < 0)
+    return NULL;
+  d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+  d->bus = bus;
+  d->dev = libusb_ref_device(dev);
+  d->devnum = libusb_get_device_address(dev);
+  snprintf(d->filename, sizeof(d->filename), "%03d", d->devnum);
+  d->descriptor.bLength = desc.bLength;
+  d->descriptor.bDescriptorType = desc.bDescriptorType;
+  d->descriptor.bcdUSB = desc.bcdUSB;
+  d->descriptor.bDeviceClass = desc.bDeviceClass;
+  d->descriptor.bDeviceSubClass = desc.bDeviceSubClass;
+  d->descriptor.bDeviceProtocol = desc.bDeviceProtocol;
+  d->descriptor.bMaxPacketSize0 = desc.bMaxPacketSize0;
+  d->descriptor.idVendor = desc.idVendor;
+  d->descriptor.idProduct = desc.idProduct;
+  d->descriptor.bcdDevice = desc.bcdDevice;
+  d->descriptor.iManufacturer = desc.iManufacturer;
+  d->descriptor.iProduct = desc.iProduct;
+  d->descriptor.iSerialNumber = desc.iSerialNumber;
+  d->config = calloc(desc.bNumConfigurations, sizeof(struct usb_config_descriptor));
+  if (d->config) {
+    d->descriptor.bNumConfigurations = desc.bNumConfigurations;
+    for (i = 0; i < desc.bNumConfigurations; i++) {
+      struct libusb_config_descriptor *config;
+      if (libusb_get_config_descriptor(dev, i, &config) < 0)
+        continue;
+      rusb1_copy_config(&d->config[i], config);
+      libusb_free_config_descriptor(config);
+    }
+  }
+  return d;
+}
+
+static void
+rusb1_device_free(struct usb_device *d)
+{
+  int i;
+  if (d->config) {
+    for (i = 0; i < d->descriptor.bNumConfigurations; i++)
+      rusb1_free_config(&d->config[i]);
+    free(d->config);
+  }
+  free(d->children);
+  libusb_unref_device(d->dev);
+  free(d);
+}
+
+static void
+rusb1_free_devices(struct usb_device *d)
+{
+  while (d) {
+    struct usb_device *next = d->next;
+    rusb1_device_free(d);
+    d = next;
+  }
+}
+
+static struct usb_device *
+rusb1_find_device_in_busses(libusb_device *dev)
+{
+  struct usb_bus *bus;
+  struct usb_device *d;
+  for (bus = rusb1_busses; bus; bus = bus->next)
+    for (d = bus->devices; d; d = d->next)
+      if (d->dev == dev)
+        return d;
+  return NULL;
+}
+
+/* returns the usb_device of dev, including a device removed already. */
+struct usb_device *
+rusb1_find_device(libusb_device *dev)
+{
+  struct usb_device *d = rusb1_find_device_in_busses(dev);
+  if (d)
+    return d;
+  for (d = rusb1_removed_devices; d; d = d->next)
+    if (d->dev == dev)
+      return d;
+  return NULL;
+}
+
+/* sets children and root_dev from the parents known by libusb-1.0. */
+static void
+rusb1_link_children(void)
+{
+#ifdef HAVE_LIBUSB_GET_PARENT
+  struct usb_bus *bus;
+  struct usb_device *d, *parent;
+  for (bus = rusb1_busses; bus; bus = bus->next) {
+    bus->root_dev = NULL;
+    for (d = bus->devices; d; d = d->next) {
+      free(d->children);
+      d->children = NULL;
+      d->num_children = 0;
+    }
+  }
+  for (bus = rusb1_busses; bus; bus = bus->next) {
+    for (d = bus->devices; d; d = d->next) {
+      libusb_device *p = libusb_get_parent(d->dev);
+      parent = p ? rusb1_find_device_in_busses(p) : NULL;
+      if (!parent) {
+        if (!bus->root_dev)
+          bus->root_dev = d;
+        continue;
+      }
+      if (parent->num_children == UCHAR_MAX)
+        continue;
+      parent->children = realloc(parent->children,
+                                 (parent->num_children + 1) * sizeof(struct usb_device *));
+      if (parent->children)
+        parent->children[parent->num_children++] = d;
+      else
+        parent->num_children = 0;
+    }
+  }
+#endif
+}
+
+void
+rusb1_init(void)
+{
+  if (!rusb1_context)
+    libusb_init(&rusb1_context);
+}
+
+struct usb_bus *
+rusb1_get_busses(void)
+{
+  return rusb1_busses;
+}
+
+/*
+ * Updates the bus list.
+ * Busses still present are kept with their devices.
+ * Busses vanished and devices removed before are freed only if remove is
+ * true.  It returns the number of busses added or removed.
+ */
+static int
+rusb1_scan_busses(int remove)
+{
+  libusb_device **list;
+  ssize_t n, i;
+  unsigned char present[256];
+  struct usb_bus *bus, *next, *prev = NULL, **tail;
+  int changes = 0;
+
+  n = libusb_get_device_list(rusb1_context, &list);
+  if (n < 0)
+    return rusb1_error((int)n);
+  memset(present, 0, sizeof(present));
+  for (i = 0; i < n; i++)
+    present[libusb_get_bus_number(list[i])] = 1;
+  libusb_free_device_list(list, 1);
+
+  if (remove)
+    rusb1_free_removed();
+
+  tail = &rusb1_busses;
+  for (bus = rusb1_busses; bus; bus = next) {
+    next = bus->next;
+    if (present[bus->location] || !remove) {
+      present[bus->location] = 0;
+      bus->prev = prev;
+      *tail = bus;
+      tail = &bus->next;
+      prev = bus;
+    }
+    else {
+      rusb1_free_devices(bus->devices);
+      free(bus);
+      changes++;
+    }
+  }
+  *tail = NULL;
+
+  for (i = 1; i < 256; i++) {
+    if (!present[i])
+      continue;
+    bus = calloc(1, sizeof(*bus));
+    if (!bus)
+      break;
+    bus->location = (unsigned int)i;
+    snprintf(bus->dirname, sizeof(bus->dirname), "%03d", (int)i);
+    bus->prev = prev;
+    *tail = bus;
+    tail = &bus->next;
+    prev = bus;
+    changes++;
+  }
+  rusb1_link_children();
+  return changes;
+}
+
+int
+rusb1_find_busses(void)
+{
+  return rusb1_scan_busses(1);
+}
+
+/*
+ * Adds the busses and devices appeared and unlinks the devices removed.
+ * Nothing is freed, so the Ruby objects of the removed devices are still
+ * valid until the next rusb1_find_busses.
+ */
+int
+rusb1_update(void)
+{
+  int r = rusb1_scan_busses(0);
+  if (r < 0)
+    return r;
+  return rusb1_find_devices();
+}
+
+/* returns the devices unlinked by rusb1_update and not freed yet. */
+struct usb_device *
+rusb1_get_removed(void)
+{
+  return rusb1_removed_devices;
+}
+
+/* frees the devices unlinked by rusb1_update. */
+void
+rusb1_free_removed(void)
+{
+  rusb1_free_devices(rusb1_removed_devices);
+  rusb1_removed_devices = NULL;
+}
+
+/*
+ * Updates the device list of each bus.
+ * Devices still present keep their usb_device structure.
+ * It returns the number of devices added or removed.
+ */
+int
+rusb1_find_devices(void)
+{
+  libusb_device **list;
+  ssize_t n, i;
+  struct usb_bus *bus;
+  int changes = 0;
+
+  n = libusb_get_device_list(rusb1_context, &list);
+  if (n < 0)
+    return rusb1_error((int)n);
+  for (bus = rusb1_busses; bus; bus = bus->next) {
+    struct usb_device *old = bus->devices, *d, *next, *prev = NULL, **tail = &bus->devices;
+    bus->devices = NULL;
+    for (i = 0; i < n; i++) {
+      struct usb_device **pp;
+      if (libusb_get_bus_number(list[i]) != bus->location)
+        continue;
+      for (pp = &old; *pp; pp = &(*pp)->next)
+        if ((*pp)->dev == list[i])
+          break;
+      if (*pp) {
+        d = *pp;
+        *pp = d->next;
+      }
+      else {
+        d = rusb1_device_new(bus, list[i]);
+        if (!d)
+          continue;
+        changes++;
+      }
+      d->prev = prev;
+      d->next = NULL;
+      *tail = d;
+      tail = &d->next;
+      prev = d;
+    }
+    for (d = old; d; d = next) {
+      next = d->next;
+      d->prev = NULL;
+      d->next = rusb1_removed_devices;
+      rusb1_removed_devices = d;
+      changes++;
+    }
+  }
+  libusb_free_device_list(list, 1);
+  rusb1_link_children();
+  return changes;
+}
+
+/* -------- device handle -------- */
+
+usb_dev_handle *
+rusb1_open(struct usb_device *dev)
+{
+  usb_dev_handle *h;
+  int r;
+  h = malloc(sizeof(*h));
+  if (!h) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  r = libusb_open((libusb_device *)dev->dev, &h->handle);
+  if (r < 0) {
+    free(h);
+    errno = -rusb1_error(r);
+    return NULL;
+  }
+  h->device = dev;
+  h->last_claimed_interface = -1;
+  return h;
+}
+
+int
+rusb1_close(usb_dev_handle *dev)
+{
+  libusb_close(dev->handle);
+  free(dev);
+  return 0;
+}
+
+int
+rusb1_get_string(usb_dev_handle *dev, int index, int langid, char *buf, size_t buflen)
+{
+  int r = libusb_get_string_descriptor(dev->handle, index, langid,
+                                       (unsigned char *)buf, (int)buflen);
+  return rusb1_error(r);
+}
+
+int
+rusb1_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen)
+{
+  int r = libusb_get_string_descriptor_ascii(dev->handle, index,
+                                             (unsigned char *)buf, (int)buflen);
+  return rusb1_error(r);
+}
+
+int
+rusb1_get_descriptor_by_endpoint(usb_dev_handle *dev, int ep, unsigned char type, unsigned char index, void *buf, int size)
+{
+  int r = libusb_control_transfer(dev->handle, ep | LIBUSB_ENDPOINT_IN,
+                                  LIBUSB_REQUEST_GET_DESCRIPTOR, (type << 8) + index, 0,
+                                  buf, size, 1000);
+  return rusb1_error(r);
+}
+
+int
+rusb1_get_descriptor(usb_dev_handle *dev, unsigned char type, unsigned char index, void *buf, int size)
+{
+  int r = libusb_get_descriptor(dev->handle, type, index, buf, size);
+  return rusb1_error(r);
+}
+
+/* A timed out transfer returns the partial length as libusb-0.1 does. */
+static int
+rusb1_transferred(int r, int actual)
+{
+  if (r == 0 || (r == LIBUSB_ERROR_TIMEOUT && 0 < actual))
+    return actual;
+  return rusb1_error(r);
+}
+
+int
+rusb1_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  int actual = 0;
+  int r = libusb_bulk_transfer(dev->handle, ep & ~LIBUSB_ENDPOINT_IN,
+                               (unsigned char *)bytes, size, &actual, timeout);
+  return rusb1_transferred(r, actual);
+}
+
+int
+rusb1_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  int actual = 0;
+  int r = libusb_bulk_transfer(dev->handle, ep | LIBUSB_ENDPOINT_IN,
+                               (unsigned char *)bytes, size, &actual, timeout);
+  return rusb1_transferred(r, actual);
+}
+
+int
+rusb1_interrupt_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  int actual = 0;
+  int r = libusb_interrupt_transfer(dev->handle, ep & ~LIBUSB_ENDPOINT_IN,
+                                    (unsigned char *)bytes, size, &actual, timeout);
+  return rusb1_transferred(r, actual);
+}
+
+int
+rusb1_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  int actual = 0;
+  int r = libusb_interrupt_transfer(dev->handle, ep | LIBUSB_ENDPOINT_IN,
+                                    (unsigned char *)bytes, size, &actual, timeout);
+  return rusb1_transferred(r, actual);
+}
+
+int
+rusb1_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout)
+{
+  int r = libusb_control_transfer(dev->handle, requesttype, request, value, index,
+                                  (unsigned char *)bytes, size, timeout);
+  return rusb1_error(r);
+}
+
+int
+rusb1_set_configuration(usb_dev_handle *dev, int configuration)
+{
+  return rusb1_error(libusb_set_configuration(dev->handle, configuration));
+}
+
+int
+rusb1_claim_interface(usb_dev_handle *dev, int interface)
+{
+  int r = libusb_claim_interface(dev->handle, interface);
+  if (r == 0)
+    dev->last_claimed_interface = interface;
+  return rusb1_error(r);
+}
+
+int
+rusb1_release_interface(usb_dev_handle *dev, int interface)
+{
+  int r = libusb_release_interface(dev->handle, interface);
+  if (r == 0 && dev->last_claimed_interface == interface)
+    dev->last_claimed_interface = -1;
+  return rusb1_error(r);
+}
+
+/* libusb-0.1 sets the alternate setting of the last claimed interface. */
+int
+rusb1_set_altinterface(usb_dev_handle *dev, int alternate)
+{
+  if (dev->last_claimed_interface < 0)
+    return -EINVAL;
+  return rusb1_error(libusb_set_interface_alt_setting(dev->handle,
+                                                      dev->last_claimed_interface, alternate));
+}
+
+int
+rusb1_clear_halt(usb_dev_handle *dev, unsigned int ep)
+{
+  return rusb1_error(libusb_clear_halt(dev->handle, ep));
+}
+
+int
+rusb1_reset(usb_dev_handle *dev)
+{
+  return rusb1_error(libusb_reset_device(dev->handle));
+}
+
+/*
+ * libusb-1.0 tells whether a kernel driver is bound but not its name.
+ * "dummy" is returned as the name, as libusb-compat-0.1 does.
+ */
+int
+rusb1_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned int namelen)
+{
+  int r = libusb_kernel_driver_active(dev->handle, interface);
+  if (r < 0)
+    return rusb1_error(r);
+  if (r == 0)
+    return -ENODATA;
+  snprintf(name, namelen, "dummy");
+  return 0;
+}
+
+int
+rusb1_detach_kernel_driver_np(usb_dev_handle *dev, int interface)
+{
+  return rusb1_error(libusb_detach_kernel_driver(dev->handle, interface));
+}
+
+#endif
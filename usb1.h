@@ -0,0 +1,102 @@
+/*
+   usb1.h - libusb-0.1 API on top of libusb-1.0
+
+   Copyright (C) 2007 Tanaka Akira
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * usb.c is written for the libusb-0.1 API: a tree of usb_bus, usb_device
+ * and descriptor structures, and synchronous functions returning
+ * -errno on failure.
+ * This header provides the same functions, with the structures of usb0.h,
+ * implemented by usb1.c with libusb-1.0.
+ * The functions are prefixed by rusb1_ so that they don't conflict with
+ * a real libusb-0.1 loaded in the same process.
+ */
+
+#ifndef RUSB_USB1_H
+#define RUSB_USB1_H
+
+#include <libusb.h>
+#include "usb0.h"
+
+#define LIBUSB_HAS_GET_DRIVER_NP 1
+#define LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP 1
+
+struct usb_dev_handle {
+  libusb_device_handle *handle;
+  struct usb_device *device;
+  int last_claimed_interface;
+};
+
+extern libusb_context *rusb1_context;
+
+int rusb1_error(int r);
+
+void rusb1_init(void);
+int rusb1_find_busses(void);
+int rusb1_find_devices(void);
+struct usb_bus *rusb1_get_busses(void);
+int rusb1_update(void);
+struct usb_device *rusb1_get_removed(void);
+void rusb1_free_removed(void);
+struct usb_device *rusb1_find_device(libusb_device *dev);
+usb_dev_handle *rusb1_open(struct usb_device *dev);
+int rusb1_close(usb_dev_handle *dev);
+int rusb1_get_string(usb_dev_handle *dev, int index, int langid, char *buf, size_t buflen);
+int rusb1_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen);
+int rusb1_get_descriptor_by_endpoint(usb_dev_handle *dev, int ep, unsigned char type, unsigned char index, void *buf, int size);
+int rusb1_get_descriptor(usb_dev_handle *dev, unsigned char type, unsigned char index, void *buf, int size);
+int rusb1_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusb1_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusb1_interrupt_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusb1_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusb1_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout);
+int rusb1_set_configuration(usb_dev_handle *dev, int configuration);
+int rusb1_claim_interface(usb_dev_handle *dev, int interface);
+int rusb1_release_interface(usb_dev_handle *dev, int interface);
+int rusb1_set_altinterface(usb_dev_handle *dev, int alternate);
+int rusb1_clear_halt(usb_dev_handle *dev, unsigned int ep);
+int rusb1_reset(usb_dev_handle *dev);
+int rusb1_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned int namelen);
+int rusb1_detach_kernel_driver_np(usb_dev_handle *dev, int interface);
+
+#define usb_init rusb1_init
+#define usb_find_busses rusb1_find_busses
+#define usb_find_devices rusb1_find_devices
+#define usb_get_busses rusb1_get_busses
+#define usb_open rusb1_open
+#define usb_close rusb1_close
+#define usb_get_string rusb1_get_string
+#define usb_get_string_simple rusb1_get_string_simple
+#define usb_get_descriptor_by_endpoint rusb1_get_descriptor_by_endpoint
+#define usb_get_descriptor rusb1_get_descriptor
+#define usb_bulk_write rusb1_bulk_write
+#define usb_bulk_read rusb1_bulk_read
+#define usb_interrupt_write rusb1_interrupt_write
+#define usb_interrupt_read rusb1_interrupt_read
+#define usb_control_msg rusb1_control_msg
+#define usb_set_configuration rusb1_set_configuration
+#define usb_claim_interface rusb1_claim_interface
+#define usb_release_interface rusb1_release_interface
+#define usb_set_altinterface rusb1_set_altinterface
+#define usb_clear_halt rusb1_clear_halt
+#define usb_reset rusb1_reset
+#define usb_get_driver_np rusb1_get_driver_np
+#define usb_detach_kernel_driver_np rusb1_detach_kernel_driver_np
+
+#endif
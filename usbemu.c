@@ -0,0 +1,1087 @@
+/*
+   usbemu.c - libusb-0.1 API on emulated devices
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifdef RUSB_EMULATOR
+
+#include "ruby.h"
+#include "ruby/thread_native.h"
+#include "usbemu.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define RUSBEMU_ENDPOINTS 32
+#define RUSBEMU_CTRL_MAX 4096
+#define RUSBEMU_FIFO_MAX (1 << 20)
+#define RUSBEMU_POLL_US 1000 /* step of a transfer waiting for a loopback FIFO */
+#define RUSBEMU_EP_INDEX(ep) (((ep) & USB_ENDPOINT_ADDRESS_MASK) | (((ep) & USB_ENDPOINT_DIR_MASK) ? 16 : 0))
+
+typedef struct {
+  rusbemu_endpoint_t conf;
+  int present;
+  unsigned long count;   /* transfers, for error_every */
+  unsigned char pattern; /* the next byte of an IN endpoint */
+  unsigned char *fifo;   /* the bytes written for loopback */
+  size_t fifo_len;
+} rusbemu_ep_t;
+
+/*
+ * An emulated device.  dev is the usb_device in the bus list.
+ * The device is referenced by its list, pending, linked or removed,
+ * and by its handles, and freed by the last of them.
+ */
+typedef struct rusbemu_device {
+  struct usb_device dev;
+  struct rusbemu_device *next_pending, *next_removed;
+  struct rusbemu_device *parent_dev; /* set by rusbemu_find_devices */
+  int busnum, parent, port;
+  int plugged; /* cleared by rusbemu_unplug */
+  int refs;
+  unsigned char *raw; /* the device descriptor followed by the configurations */
+  int rawlen;
+  unsigned char **strings;
+  int *string_lengths;
+  int nstrings;
+  rusbemu_ep_t eps[RUSBEMU_ENDPOINTS];
+  int configuration;
+  unsigned int claimed;
+  unsigned char ctrl[RUSBEMU_CTRL_MAX];
+  int ctrl_len;
+} rusbemu_device_t;
+
+struct usb_dev_handle {
+  rusbemu_device_t *device;
+  unsigned int claimed;
+  int last_claimed_interface;
+};
+
+/*
+ * The lists are changed with the GVL, but the transfers, open and close
+ * run without it, so the device states are guarded by rusbemu_lock.
+ */
+static rb_nativethread_lock_t rusbemu_lock;
+static int rusbemu_initialized;
+/* 0, 1, ... 255 twice, copied from any offset of the IN pattern */
+static unsigned char rusbemu_pattern[512];
+static struct usb_bus *rusbemu_busses;
+static rusbemu_device_t *rusbemu_pending;
+static rusbemu_device_t *rusbemu_removed;
+
+/* -------- descriptors -------- */
+
+static int
+rusbemu_append_extra(unsigned char **extra, int *extralen, const unsigned char *p, int len)
+{
+  unsigned char *e = realloc(*extra, *extralen + len);
+  if (!e)
+    return -ENOMEM;
+  memcpy(e + *extralen, p, len);
+  *extra = e;
+  *extralen += len;
+  return 0;
+}
+
+static void
+rusbemu_free_config(struct usb_config_descriptor *config)
+{
+  int i, j, k;
+  if (config->interface) {
+    for (i = 0; i < config->bNumInterfaces; i++) {
+      struct usb_interface *intf = &config->interface[i];
+      for (j = 0; j < intf->num_altsetting; j++) {
+        struct usb_interface_descriptor *alt = &intf->altsetting[j];
+        for (k = 0; k < alt->bNumEndpoints; k++)
+          free(alt->endpoint[k].extra);
+        free(alt->endpoint);
+        free(alt->extra);
+      }
+      free(intf->altsetting);
+    }
+  }
+  free(config->interface);
+  free(config->extra);
+}
+
+/*
+ * parses a configuration descriptor with its interfaces and endpoints.
+ * The other descriptors are kept in extra of the descriptor before.
+ */
+static int
+rusbemu_parse_config(struct usb_config_descriptor *c, const unsigned char *p, int len)
+{
+  struct usb_interface_descriptor *alt = NULL;
+  struct usb_endpoint_descriptor *ep = NULL;
+  int nused = 0, declared = 0, pos, i, r;
+
+  if (len < USB_DT_CONFIG_SIZE || p[1] != USB_DT_CONFIG)
+    return -EINVAL;
+  c->bLength = p[0];
+  c->bDescriptorType = p[1];
+  c->wTotalLength = p[2] | (p[3] << 8);
+  c->bNumInterfaces = p[4];
+  c->bConfigurationValue = p[5];
+  c->iConfiguration = p[6];
+  c->bmAttributes = p[7];
+  c->MaxPower = p[8];
+  if (c->wTotalLength < p[0] || len < c->wTotalLength)
+    return -EINVAL;
+  c->interface = calloc(c->bNumInterfaces ? c->bNumInterfaces : 1, sizeof(struct usb_interface));
+  if (!c->interface)
+    return -ENOMEM;
+
+  for (pos = p[0]; pos < c->wTotalLength; pos += p[pos]) {
+    const unsigned char *d = p + pos;
+    if (d[0] < 2 || c->wTotalLength < pos + d[0])
+      return -EINVAL;
+    if (d[1] == USB_DT_INTERFACE && USB_DT_INTERFACE_SIZE <= d[0]) {
+      struct usb_interface *intf = NULL;
+      for (i = 0; i < nused; i++)
+        if (c->interface[i].altsetting[0].bInterfaceNumber == d[2])
+          intf = &c->interface[i];
+      if (!intf) {
+        if (nused == c->bNumInterfaces)
+          return -EINVAL;
+        intf = &c->interface[nused++];
+      }
+      alt = realloc(intf->altsetting, (intf->num_altsetting + 1) * sizeof(*alt));
+      if (!alt)
+        return -ENOMEM;
+      intf->altsetting = alt;
+      alt = &intf->altsetting[intf->num_altsetting++];
+      memset(alt, 0, sizeof(*alt));
+      alt->bLength = d[0];
+      alt->bDescriptorType = d[1];
+      alt->bInterfaceNumber = d[2];
+      alt->bAlternateSetting = d[3];
+      declared = d[4];
+      alt->bInterfaceClass = d[5];
+      alt->bInterfaceSubClass = d[6];
+      alt->bInterfaceProtocol = d[7];
+      alt->iInterface = d[8];
+      alt->endpoint = calloc(declared ? declared : 1, sizeof(struct usb_endpoint_descriptor));
+      if (!alt->endpoint)
+        return -ENOMEM;
+      ep = NULL;
+      continue;
+    }
+    if (d[1] == USB_DT_ENDPOINT && USB_DT_ENDPOINT_SIZE <= d[0] && alt && alt->bNumEndpoints < declared) {
+      ep = &alt->endpoint[alt->bNumEndpoints++];
+      ep->bLength = d[0];
+      ep->bDescriptorType = d[1];
+      ep->bEndpointAddress = d[2];
+      ep->bmAttributes = d[3];
+      ep->wMaxPacketSize = d[4] | (d[5] << 8);
+      ep->bInterval = d[6];
+      if (USB_DT_ENDPOINT_AUDIO_SIZE <= d[0]) {
+        ep->bRefresh = d[7];
+        ep->bSynchAddress = d[8];
+      }
+      continue;
+    }
+    if (ep)
+      r = rusbemu_append_extra(&ep->extra, &ep->extralen, d, d[0]);
+    else if (alt)
+      r = rusbemu_append_extra(&alt->extra, &alt->extralen, d, d[0]);
+    else
+      r = rusbemu_append_extra(&c->extra, &c->extralen, d, d[0]);
+    if (r < 0)
+      return r;
+  }
+  /* the interfaces not described are left out. */
+  c->bNumInterfaces = nused;
+  return 0;
+}
+
+/* returns the configuration descriptor at index, or NULL. */
+static const unsigned char *
+rusbemu_raw_config(rusbemu_device_t *e, int index, int *len)
+{
+  int pos = USB_DT_DEVICE_SIZE, i;
+  for (i = 0; pos + 4 <= e->rawlen; i++) {
+    int total = e->raw[pos + 2] | (e->raw[pos + 3] << 8);
+    if (i == index) {
+      *len = total;
+      return e->raw + pos;
+    }
+    pos += total;
+  }
+  return NULL;
+}
+
+/* -------- devices -------- */
+
+static void
+rusbemu_device_free(rusbemu_device_t *e)
+{
+  int i;
+  if (e->dev.config) {
+    for (i = 0; i < e->dev.descriptor.bNumConfigurations; i++)
+      rusbemu_free_config(&e->dev.config[i]);
+    free(e->dev.config);
+  }
+  free(e->dev.children);
+  for (i = 0; i < e->nstrings; i++)
+    free(e->strings[i]);
+  free(e->strings);
+  free(e->string_lengths);
+  for (i = 0; i < RUSBEMU_ENDPOINTS; i++)
+    free(e->eps[i].fifo);
+  free(e->raw);
+  free(e);
+}
+
+/* drops a reference to e.  Called with rusbemu_lock. */
+static void
+rusbemu_device_unref(rusbemu_device_t *e)
+{
+  if (--e->refs == 0)
+    rusbemu_device_free(e);
+}
+
+static int
+rusbemu_device_init(rusbemu_device_t *e, const unsigned char *p, int len)
+{
+  struct usb_device_descriptor *dd = &e->dev.descriptor;
+  int pos = USB_DT_DEVICE_SIZE, i, j, k, r;
+
+  if (len < USB_DT_DEVICE_SIZE || p[1] != USB_DT_DEVICE)
+    return -EINVAL;
+  e->raw = malloc(len);
+  if (!e->raw)
+    return -ENOMEM;
+  memcpy(e->raw, p, len);
+  e->rawlen = len;
+  dd->bLength = p[0];
+  dd->bDescriptorType = p[1];
+  dd->bcdUSB = p[2] | (p[3] << 8);
+  dd->bDeviceClass = p[4];
+  dd->bDeviceSubClass = p[5];
+  dd->bDeviceProtocol = p[6];
+  dd->bMaxPacketSize0 = p[7];
+  dd->idVendor = p[8] | (p[9] << 8);
+  dd->idProduct = p[10] | (p[11] << 8);
+  dd->bcdDevice = p[12] | (p[13] << 8);
+  dd->iManufacturer = p[14];
+  dd->iProduct = p[15];
+  dd->iSerialNumber = p[16];
+  e->dev.config = calloc(p[17] ? p[17] : 1, sizeof(struct usb_config_descriptor));
+  if (!e->dev.config)
+    return -ENOMEM;
+  for (i = 0; i < p[17]; i++) {
+    struct usb_config_descriptor *c = &e->dev.config[i];
+    dd->bNumConfigurations = i + 1;
+    r = rusbemu_parse_config(c, p + pos, len - pos);
+    if (r < 0)
+      return r;
+    pos += c->wTotalLength;
+  }
+
+  e->eps[0].present = 1;
+  for (i = 0; i < dd->bNumConfigurations; i++)
+    for (j = 0; j < e->dev.config[i].bNumInterfaces; j++) {
+      struct usb_interface *intf = &e->dev.config[i].interface[j];
+      for (k = 0; k < intf->num_altsetting; k++) {
+        int n;
+        for (n = 0; n < intf->altsetting[k].bNumEndpoints; n++)
+          e->eps[RUSBEMU_EP_INDEX(intf->altsetting[k].endpoint[n].bEndpointAddress)].present = 1;
+      }
+    }
+  if (dd->bNumConfigurations)
+    e->configuration = e->dev.config[0].bConfigurationValue;
+  return 0;
+}
+
+static rusbemu_device_t *
+rusbemu_find_linked(int busnum, int devnum)
+{
+  struct usb_bus *bus;
+  struct usb_device *d;
+  for (bus = rusbemu_busses; bus; bus = bus->next) {
+    if ((int)bus->location != busnum)
+      continue;
+    for (d = bus->devices; d; d = d->next)
+      if (d->devnum == devnum)
+        return (rusbemu_device_t *)d;
+  }
+  return NULL;
+}
+
+/*
+ * plugs a device with descriptors, the device descriptor followed by the
+ * configuration descriptors, and strings, the string descriptors by index.
+ * parent is the device number of the hub at port on the same bus, or 0.
+ * The endpoints not in endpoints have no latency, no bandwidth limit and
+ * no error.
+ * It returns 0 or -errno.
+ */
+int
+rusbemu_plug(int busnum, int devnum, int parent, int port,
+             const unsigned char *descriptors, int length,
+             const unsigned char **strings, const int *string_lengths, int nstrings,
+             const rusbemu_endpoint_t *endpoints, int nendpoints)
+{
+  rusbemu_device_t *e, *p;
+  int i, r;
+
+  if (busnum < 1 || 255 < busnum || devnum < 1 || 127 < devnum)
+    return -EINVAL;
+  rusbemu_init();
+  for (p = rusbemu_pending; p; p = p->next_pending)
+    if (p->busnum == busnum && p->dev.devnum == devnum)
+      return -EEXIST;
+  p = rusbemu_find_linked(busnum, devnum);
+  if (p && p->plugged)
+    return -EEXIST;
+
+  e = calloc(1, sizeof(*e));
+  if (!e)
+    return -ENOMEM;
+  e->dev.dev = e;
+  e->dev.devnum = devnum;
+  snprintf(e->dev.filename, sizeof(e->dev.filename), "%03d", devnum);
+  e->busnum = busnum;
+  e->parent = parent;
+  e->port = port;
+  e->plugged = 1;
+  e->refs = 1;
+  r = rusbemu_device_init(e, descriptors, length);
+  if (0 <= r && 0 < nstrings) {
+    e->strings = calloc(nstrings, sizeof(unsigned char *));
+    e->string_lengths = calloc(nstrings, sizeof(int));
+    if (!e->strings || !e->string_lengths)
+      r = -ENOMEM;
+    else
+      e->nstrings = nstrings;
+    for (i = 0; 0 <= r && i < nstrings; i++) {
+      if (!strings[i])
+        continue;
+      e->strings[i] = malloc(string_lengths[i]);
+      if (!e->strings[i]) {
+        r = -ENOMEM;
+        break;
+      }
+      memcpy(e->strings[i], strings[i], string_lengths[i]);
+      e->string_lengths[i] = string_lengths[i];
+    }
+  }
+  if (r < 0) {
+    rusbemu_device_free(e);
+    return r;
+  }
+  for (i = 0; i < nendpoints; i++) {
+    rusbemu_ep_t *ep = &e->eps[RUSBEMU_EP_INDEX(endpoints[i].address)];
+    ep->conf = endpoints[i];
+    ep->present = 1;
+  }
+  e->next_pending = rusbemu_pending;
+  rusbemu_pending = e;
+  return 0;
+}
+
+/*
+ * unplugs a device.  A device not seen by rusbemu_find_devices yet is
+ * freed at once.  The handles of the device fail with -ENODEV.
+ */
+int
+rusbemu_unplug(int busnum, int devnum)
+{
+  rusbemu_device_t **pp, *e;
+  for (pp = &rusbemu_pending; (e = *pp) != NULL; pp = &e->next_pending) {
+    if (e->busnum == busnum && e->dev.devnum == devnum) {
+      *pp = e->next_pending;
+      rb_nativethread_lock_lock(&rusbemu_lock);
+      rusbemu_device_unref(e);
+      rb_nativethread_lock_unlock(&rusbemu_lock);
+      return 0;
+    }
+  }
+  e = rusbemu_find_linked(busnum, devnum);
+  if (!e || !e->plugged)
+    return -ENOENT;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  e->plugged = 0;
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return 0;
+}
+
+void
+rusbemu_unplug_all(void)
+{
+  struct usb_bus *bus;
+  struct usb_device *d;
+  while (rusbemu_pending)
+    rusbemu_unplug(rusbemu_pending->busnum, rusbemu_pending->dev.devnum);
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  for (bus = rusbemu_busses; bus; bus = bus->next)
+    for (d = bus->devices; d; d = d->next)
+      ((rusbemu_device_t *)d)->plugged = 0;
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+}
+
+/* returns the ports from the root hub to dev, as libusb_get_port_numbers. */
+int
+rusbemu_get_port_numbers(void *dev, uint8_t *ports, int len)
+{
+  rusbemu_device_t *e, *up;
+  int n = 0, i;
+  for (e = dev; e->parent_dev; e = e->parent_dev)
+    n++;
+  if (len < n)
+    return -EOVERFLOW;
+  i = n;
+  for (e = dev; (up = e->parent_dev) != NULL; e = up)
+    ports[--i] = e->port;
+  return n;
+}
+
+/* -------- libusb-0.1 API -------- */
+
+void
+rusbemu_init(void)
+{
+  int i;
+  if (!rusbemu_initialized) {
+    rb_nativethread_lock_initialize(&rusbemu_lock);
+    for (i = 0; i < (int)sizeof(rusbemu_pattern); i++)
+      rusbemu_pattern[i] = (unsigned char)i;
+    rusbemu_initialized = 1;
+  }
+}
+
+struct usb_bus *
+rusbemu_get_busses(void)
+{
+  return rusbemu_busses;
+}
+
+static void
+rusbemu_remove(rusbemu_device_t *e)
+{
+  struct usb_bus *bus = e->dev.bus;
+  if (e->dev.prev)
+    e->dev.prev->next = e->dev.next;
+  else
+    bus->devices = e->dev.next;
+  if (e->dev.next)
+    e->dev.next->prev = e->dev.prev;
+  e->dev.next = e->dev.prev = NULL;
+  e->next_removed = rusbemu_removed;
+  rusbemu_removed = e;
+}
+
+static int
+rusbemu_bus_plugged(int busnum)
+{
+  rusbemu_device_t *e;
+  struct usb_bus *bus;
+  struct usb_device *d;
+  for (e = rusbemu_pending; e; e = e->next_pending)
+    if (e->busnum == busnum)
+      return 1;
+  for (bus = rusbemu_busses; bus; bus = bus->next)
+    if ((int)bus->location == busnum)
+      for (d = bus->devices; d; d = d->next)
+        if (((rusbemu_device_t *)d)->plugged)
+          return 1;
+  return 0;
+}
+
+/*
+ * Updates the bus list, sorted by bus number.
+ * The devices removed before are released, as Ruby objects are revoked
+ * by USB.find_busses and USB.rescan before and after this.
+ * A bus without plugged devices is removed with its devices.
+ * It returns the number of busses added or removed.
+ */
+int
+rusbemu_find_busses(void)
+{
+  struct usb_bus *bus, *next, **pp;
+  rusbemu_device_t *e;
+  int changes = 0, busnum;
+
+  rusbemu_init();
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  while ((e = rusbemu_removed) != NULL) {
+    rusbemu_removed = e->next_removed;
+    rusbemu_device_unref(e);
+  }
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+
+  for (pp = &rusbemu_busses; (bus = *pp) != NULL; ) {
+    if (rusbemu_bus_plugged(bus->location)) {
+      pp = &bus->next;
+      continue;
+    }
+    while (bus->devices)
+      rusbemu_remove((rusbemu_device_t *)bus->devices);
+    *pp = next = bus->next;
+    if (next)
+      next->prev = bus->prev;
+    free(bus);
+    changes++;
+  }
+
+  for (e = rusbemu_pending; e; e = e->next_pending) {
+    busnum = e->busnum;
+    for (pp = &rusbemu_busses; (bus = *pp) != NULL && (int)bus->location < busnum; pp = &bus->next)
+      ;
+    if (bus && (int)bus->location == busnum)
+      continue;
+    next = bus;
+    bus = calloc(1, sizeof(*bus));
+    if (!bus)
+      return -ENOMEM;
+    bus->location = busnum;
+    snprintf(bus->dirname, sizeof(bus->dirname), "%03d", busnum);
+    bus->next = next;
+    bus->prev = next ? next->prev : NULL;
+    if (next)
+      next->prev = bus;
+    *pp = bus;
+    changes++;
+  }
+  return changes;
+}
+
+/* sets children, sorted by port, and root_dev from the parents plugged. */
+static void
+rusbemu_link_children(void)
+{
+  struct usb_bus *bus;
+  struct usb_device *d, *c;
+  for (bus = rusbemu_busses; bus; bus = bus->next) {
+    bus->root_dev = NULL;
+    for (d = bus->devices; d; d = d->next) {
+      free(d->children);
+      d->children = NULL;
+      d->num_children = 0;
+      ((rusbemu_device_t *)d)->parent_dev = NULL;
+    }
+    for (d = bus->devices; d; d = d->next) {
+      rusbemu_device_t *e = (rusbemu_device_t *)d, *p = NULL;
+      int n;
+      for (c = bus->devices; c && e->parent; c = c->next)
+        if (c->devnum == e->parent)
+          p = (rusbemu_device_t *)c;
+      if (!p) {
+        if (!bus->root_dev)
+          bus->root_dev = d;
+        continue;
+      }
+      if (p->dev.num_children == UCHAR_MAX)
+        continue;
+      e->parent_dev = p;
+      p->dev.children = realloc(p->dev.children, (p->dev.num_children + 1) * sizeof(struct usb_device *));
+      if (!p->dev.children) {
+        p->dev.num_children = 0;
+        continue;
+      }
+      for (n = p->dev.num_children++; 0 < n && e->port < ((rusbemu_device_t *)p->dev.children[n - 1])->port; n--)
+        p->dev.children[n] = p->dev.children[n - 1];
+      p->dev.children[n] = d;
+    }
+  }
+}
+
+/*
+ * Updates the device lists, sorted by device number:
+ * the devices unplugged are removed and the devices plugged on a bus
+ * found by rusbemu_find_busses are added.
+ * It returns the number of devices added or removed.
+ */
+int
+rusbemu_find_devices(void)
+{
+  struct usb_bus *bus;
+  struct usb_device *d, *next, **pp;
+  rusbemu_device_t *e, **ep;
+  int changes = 0;
+
+  for (bus = rusbemu_busses; bus; bus = bus->next)
+    for (d = bus->devices; d; d = next) {
+      next = d->next;
+      if (!((rusbemu_device_t *)d)->plugged) {
+        rusbemu_remove((rusbemu_device_t *)d);
+        changes++;
+      }
+    }
+
+  for (ep = &rusbemu_pending; (e = *ep) != NULL; ) {
+    for (bus = rusbemu_busses; bus && (int)bus->location != e->busnum; bus = bus->next)
+      ;
+    if (!bus) {
+      ep = &e->next_pending;
+      continue;
+    }
+    *ep = e->next_pending;
+    e->next_pending = NULL;
+    e->dev.bus = bus;
+    for (pp = &bus->devices; *pp && (*pp)->devnum < e->dev.devnum; pp = &(*pp)->next)
+      e->dev.prev = *pp;
+    if (pp == &bus->devices)
+      e->dev.prev = NULL;
+    e->dev.next = *pp;
+    if (*pp)
+      (*pp)->prev = &e->dev;
+    *pp = &e->dev;
+    changes++;
+  }
+  rusbemu_link_children();
+  return changes;
+}
+
+usb_dev_handle *
+rusbemu_open(struct usb_device *dev)
+{
+  rusbemu_device_t *e = (rusbemu_device_t *)dev;
+  usb_dev_handle *h;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  if (!e->plugged) {
+    rb_nativethread_lock_unlock(&rusbemu_lock);
+    errno = ENODEV;
+    return NULL;
+  }
+  h = malloc(sizeof(*h));
+  if (!h) {
+    rb_nativethread_lock_unlock(&rusbemu_lock);
+    errno = ENOMEM;
+    return NULL;
+  }
+  e->refs++;
+  h->device = e;
+  h->claimed = 0;
+  h->last_claimed_interface = -1;
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return h;
+}
+
+int
+rusbemu_close(usb_dev_handle *dev)
+{
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  dev->device->claimed &= ~dev->claimed;
+  rusbemu_device_unref(dev->device);
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  free(dev);
+  return 0;
+}
+
+/* -------- transfers -------- */
+
+/*
+ * sleeps the latency of e plus the time of size bytes at its bandwidth,
+ * or the timeout in milliseconds if shorter.
+ */
+static int
+rusbemu_delay(const rusbemu_endpoint_t *conf, long size, int timeout)
+{
+  double usec = (double)conf->latency_us;
+  struct timespec ts;
+  int ret = 0;
+  if (conf->bytes_per_sec)
+    usec += (double)size * 1e6 / (double)conf->bytes_per_sec;
+  if (0 < timeout && (double)timeout * 1000 < usec) {
+    usec = (double)timeout * 1000;
+    ret = -ETIMEDOUT;
+  }
+  if (usec < 1)
+    return ret;
+  ts.tv_sec = (time_t)(usec / 1e6);
+  ts.tv_nsec = (long)((usec - (double)ts.tv_sec * 1e6) * 1000);
+  if (nanosleep(&ts, NULL) < 0)
+    return -errno;
+  return ret;
+}
+
+/*
+ * starts a transfer on endpoint index i: counts it and sleeps.
+ * It returns 0 or the error injected.
+ */
+static int
+rusbemu_begin(usb_dev_handle *dev, int i, long size, int timeout)
+{
+  rusbemu_device_t *e = dev->device;
+  rusbemu_endpoint_t conf;
+  unsigned long count;
+  int r;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  if (!e->plugged || !e->eps[i].present) {
+    r = e->plugged ? -EINVAL : -ENODEV;
+    rb_nativethread_lock_unlock(&rusbemu_lock);
+    return r;
+  }
+  conf = e->eps[i].conf;
+  count = ++e->eps[i].count;
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  r = rusbemu_delay(&conf, size, timeout);
+  if (r < 0)
+    return r;
+  if (conf.error_every && count % conf.error_every == 0)
+    return conf.error ? -conf.error : -EIO;
+  return 0;
+}
+
+/*
+ * sleeps a step of a transfer waiting for a loopback FIFO,
+ * counting the microseconds waited in *waited.
+ * It returns -ETIMEDOUT after the timeout in milliseconds, never for 0,
+ * and -errno if the sleep is interrupted.
+ * It is called without rusbemu_lock.
+ */
+static int
+rusbemu_poll(long *waited, int timeout)
+{
+  struct timespec ts;
+  if (0 < timeout && (long)timeout * 1000 <= *waited)
+    return -ETIMEDOUT;
+  ts.tv_sec = 0;
+  ts.tv_nsec = RUSBEMU_POLL_US * 1000L;
+  if (nanosleep(&ts, NULL) < 0)
+    return -errno;
+  *waited += RUSBEMU_POLL_US;
+  return 0;
+}
+
+static int
+rusbemu_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  rusbemu_device_t *e = dev->device;
+  int i = RUSBEMU_EP_INDEX(ep | USB_ENDPOINT_IN), n, r;
+  long waited = 0;
+  rusbemu_ep_t *in, *out;
+  r = rusbemu_begin(dev, i, size, timeout);
+  if (r < 0)
+    return r;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  in = &e->eps[i];
+  out = &e->eps[RUSBEMU_EP_INDEX(ep & ~USB_ENDPOINT_IN)];
+  if (in->conf.loopback) {
+    /* waits for the data written to the OUT endpoint. */
+    while (out->fifo_len == 0 && 0 < size && e->plugged) {
+      rb_nativethread_lock_unlock(&rusbemu_lock);
+      r = rusbemu_poll(&waited, timeout);
+      if (r < 0)
+        return r;
+      rb_nativethread_lock_lock(&rusbemu_lock);
+    }
+    n = out->fifo_len < (size_t)size ? (int)out->fifo_len : size;
+    if (!e->plugged) {
+      n = -ENODEV;
+    }
+    else {
+      memcpy(bytes, out->fifo, n);
+      memmove(out->fifo, out->fifo + n, out->fifo_len - n);
+      out->fifo_len -= n;
+    }
+  }
+  else {
+    for (n = 0; n < size; n += r) {
+      r = size - n < 256 ? size - n : 256;
+      memcpy(bytes + n, rusbemu_pattern + in->pattern, r);
+      in->pattern += r;
+    }
+  }
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return n;
+}
+
+static int
+rusbemu_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  rusbemu_device_t *e = dev->device;
+  int i = RUSBEMU_EP_INDEX(ep & ~USB_ENDPOINT_IN), n = size, r;
+  long waited = 0;
+  rusbemu_ep_t *out;
+  r = rusbemu_begin(dev, i, size, timeout);
+  if (r < 0)
+    return r;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  out = &e->eps[i];
+  if (out->conf.loopback || e->eps[RUSBEMU_EP_INDEX(ep | USB_ENDPOINT_IN)].conf.loopback) {
+    size_t room;
+    unsigned char *fifo;
+    /* waits for the IN endpoint to read the FIFO full. */
+    while (out->fifo_len == RUSBEMU_FIFO_MAX && 0 < size && e->plugged) {
+      rb_nativethread_lock_unlock(&rusbemu_lock);
+      r = rusbemu_poll(&waited, timeout);
+      if (r < 0)
+        return r;
+      rb_nativethread_lock_lock(&rusbemu_lock);
+    }
+    room = RUSBEMU_FIFO_MAX - out->fifo_len;
+    if (room < (size_t)n)
+      n = (int)room;
+    fifo = realloc(out->fifo, out->fifo_len + n);
+    if (!e->plugged) {
+      n = -ENODEV;
+    }
+    else if (!fifo && n) {
+      n = -ENOMEM;
+    }
+    else {
+      out->fifo = fifo;
+      memcpy(out->fifo + out->fifo_len, bytes, n);
+      out->fifo_len += n;
+    }
+  }
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return n;
+}
+
+int
+rusbemu_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  return rusbemu_write(dev, ep, bytes, size, timeout);
+}
+
+int
+rusbemu_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  return rusbemu_read(dev, ep, bytes, size, timeout);
+}
+
+int
+rusbemu_interrupt_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  return rusbemu_write(dev, ep, bytes, size, timeout);
+}
+
+int
+rusbemu_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+  return rusbemu_read(dev, ep, bytes, size, timeout);
+}
+
+static int
+rusbemu_copy(char *bytes, int size, const unsigned char *src, int len)
+{
+  if (!src)
+    return -EPIPE;
+  if (size < len)
+    len = size;
+  memcpy(bytes, src, len);
+  return len;
+}
+
+/* answers a standard request.  Called with rusbemu_lock. */
+static int
+rusbemu_standard_request(rusbemu_device_t *e, int requesttype, int request, int value, int index, char *bytes, int size)
+{
+  static const unsigned char zero[2];
+  const unsigned char *p;
+  unsigned char conf;
+  int len = 0, i = value & 0xff;
+  switch (request) {
+    case USB_REQ_GET_DESCRIPTOR:
+      switch (value >> 8) {
+        case USB_DT_DEVICE:
+          return rusbemu_copy(bytes, size, e->raw, USB_DT_DEVICE_SIZE);
+        case USB_DT_CONFIG:
+          p = rusbemu_raw_config(e, i, &len);
+          return rusbemu_copy(bytes, size, p, len);
+        case USB_DT_STRING:
+          if (e->nstrings <= i)
+            return -EPIPE;
+          return rusbemu_copy(bytes, size, e->strings[i], e->string_lengths[i]);
+      }
+      return -EPIPE;
+    case USB_REQ_GET_STATUS:
+      return rusbemu_copy(bytes, size, zero, 2);
+    case USB_REQ_GET_CONFIGURATION:
+      conf = e->configuration;
+      return rusbemu_copy(bytes, size, &conf, 1);
+    case USB_REQ_SET_CONFIGURATION:
+      for (i = 0; i < e->dev.descriptor.bNumConfigurations; i++)
+        if (e->dev.config[i].bConfigurationValue == value)
+          break;
+      if (value && i == e->dev.descriptor.bNumConfigurations)
+        return -EINVAL;
+      e->configuration = value;
+      return 0;
+    case USB_REQ_CLEAR_FEATURE:
+    case USB_REQ_SET_FEATURE:
+    case USB_REQ_SET_INTERFACE:
+      return 0;
+  }
+  return -EPIPE;
+}
+
+int
+rusbemu_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout)
+{
+  rusbemu_device_t *e = dev->device;
+  int r = rusbemu_begin(dev, 0, size, timeout);
+  if (r < 0)
+    return r;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  if ((requesttype & USB_TYPE_RESERVED) == USB_TYPE_STANDARD) {
+    r = rusbemu_standard_request(e, requesttype, request, value, index, bytes, size);
+  }
+  else if (requesttype & USB_ENDPOINT_IN) {
+    r = rusbemu_copy(bytes, size, e->ctrl, e->ctrl_len);
+  }
+  else {
+    e->ctrl_len = size < RUSBEMU_CTRL_MAX ? size : RUSBEMU_CTRL_MAX;
+    memcpy(e->ctrl, bytes, e->ctrl_len);
+    r = size;
+  }
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return r;
+}
+
+int
+rusbemu_get_string(usb_dev_handle *dev, int index, int langid, char *buf, size_t buflen)
+{
+  return rusbemu_control_msg(dev, USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR,
+                             (USB_DT_STRING << 8) + index, langid, buf, (int)buflen, 1000);
+}
+
+/* reads the string in the first language, as ASCII with '?' for the others. */
+int
+rusbemu_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen)
+{
+  char tmp[256];
+  int r, langid, i, n = 0;
+  if (buflen == 0)
+    return -EINVAL;
+  r = rusbemu_get_string(dev, 0, 0, tmp, sizeof(tmp));
+  if (r < 0)
+    return r;
+  if (r < 4)
+    return -EIO;
+  langid = (unsigned char)tmp[2] | ((unsigned char)tmp[3] << 8);
+  r = rusbemu_get_string(dev, index, langid, tmp, sizeof(tmp));
+  if (r < 0)
+    return r;
+  if (tmp[1] != USB_DT_STRING)
+    return -EIO;
+  if ((unsigned char)tmp[0] < r)
+    r = (unsigned char)tmp[0];
+  for (i = 2; i + 1 < r && (size_t)n + 1 < buflen; i += 2)
+    buf[n++] = tmp[i + 1] || (tmp[i] & 0x80) ? '?' : tmp[i];
+  buf[n] = '\0';
+  return n;
+}
+
+int
+rusbemu_get_descriptor_by_endpoint(usb_dev_handle *dev, int ep, unsigned char type, unsigned char index, void *buf, int size)
+{
+  return rusbemu_control_msg(dev, ep | USB_ENDPOINT_IN, USB_REQ_GET_DESCRIPTOR,
+                             (type << 8) + index, 0, buf, size, 1000);
+}
+
+int
+rusbemu_get_descriptor(usb_dev_handle *dev, unsigned char type, unsigned char index, void *buf, int size)
+{
+  return rusbemu_get_descriptor_by_endpoint(dev, 0, type, index, buf, size);
+}
+
+int
+rusbemu_set_configuration(usb_dev_handle *dev, int configuration)
+{
+  return rusbemu_control_msg(dev, USB_ENDPOINT_OUT, USB_REQ_SET_CONFIGURATION,
+                             configuration, 0, NULL, 0, 1000);
+}
+
+/* an interface is claimed by one handle at a time, as usbfs does. */
+int
+rusbemu_claim_interface(usb_dev_handle *dev, int interface)
+{
+  rusbemu_device_t *e = dev->device;
+  unsigned int bit;
+  int r = 0;
+  if (interface < 0 || 31 < interface)
+    return -EINVAL;
+  bit = 1U << interface;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  if (!e->plugged)
+    r = -ENODEV;
+  else if ((e->claimed & bit) && !(dev->claimed & bit))
+    r = -EBUSY;
+  else {
+    e->claimed |= bit;
+    dev->claimed |= bit;
+    dev->last_claimed_interface = interface;
+  }
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return r;
+}
+
+int
+rusbemu_release_interface(usb_dev_handle *dev, int interface)
+{
+  unsigned int bit;
+  if (interface < 0 || 31 < interface || !(dev->claimed & (1U << interface)))
+    return -EINVAL;
+  bit = 1U << interface;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  dev->device->claimed &= ~bit;
+  dev->claimed &= ~bit;
+  if (dev->last_claimed_interface == interface)
+    dev->last_claimed_interface = -1;
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return 0;
+}
+
+/* libusb-0.1 sets the alternate setting of the last claimed interface. */
+int
+rusbemu_set_altinterface(usb_dev_handle *dev, int alternate)
+{
+  if (dev->last_claimed_interface < 0)
+    return -EINVAL;
+  return rusbemu_control_msg(dev, USB_ENDPOINT_OUT | USB_RECIP_INTERFACE, USB_REQ_SET_INTERFACE,
+                             alternate, dev->last_claimed_interface, NULL, 0, 1000);
+}
+
+int
+rusbemu_clear_halt(usb_dev_handle *dev, unsigned int ep)
+{
+  rusbemu_device_t *e = dev->device;
+  int r = 0;
+  rb_nativethread_lock_lock(&rusbemu_lock);
+  if (!e->plugged)
+    r = -ENODEV;
+  else if (!e->eps[RUSBEMU_EP_INDEX(ep)].present)
+    r = -EINVAL;
+  rb_nativethread_lock_unlock(&rusbemu_lock);
+  return r;
+}
+
+int
+rusbemu_reset(usb_dev_handle *dev)
+{
+  return dev->device->plugged ? 0 : -ENODEV;
+}
+
+/* no kernel driver is bound to an emulated device. */
+int
+rusbemu_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned int namelen)
+{
+  return -ENODATA;
+}
+
+int
+rusbemu_detach_kernel_driver_np(usb_dev_handle *dev, int interface)
+{
+  return -ENODATA;
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+   usbemu.h - libusb-0.1 API on emulated devices
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, write to the Free Software
+   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * The emulator backend, selected by "ruby extconf.rb --enable-emulator",
+ * provides the libusb-0.1 API of usb0.h on devices emulated in the process,
+ * so that the library is tested and benchmarked without USB devices
+ * and without libusb.
+ *
+ * The devices are plugged and unplugged by rusbemu_plug and rusbemu_unplug.
+ * The changes are seen by the next rusbemu_find_busses and
+ * rusbemu_find_devices, as libusb-0.1 sees the devices attached and
+ * detached meanwhile.
+ *
+ * A device answers the standard requests for its descriptors and
+ * configuration.  The vendor and class control requests read back the
+ * data written by the last OUT request.
+ * A bulk or interrupt IN endpoint returns a byte pattern or, with
+ * loopback, the bytes written to the OUT endpoint of the same number.
+ * Each endpoint has a latency, a bandwidth and an error injected at
+ * every n-th transfer.
+ */
+
+#ifndef RUSB_USBEMU_H
+#define RUSB_USBEMU_H
+
+#include "usb0.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIBUSB_HAS_GET_DRIVER_NP 1
+#define LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP 1
+
+/* the behavior of an endpoint. address 0 is the control endpoint. */
+typedef struct {
+  int address;
+  unsigned long latency_us;    /* added to each transfer */
+  unsigned long bytes_per_sec; /* 0 for unlimited */
+  unsigned long error_every;   /* fails every n-th transfer, 0 for never */
+  int error;                   /* errno of the failures */
+  int loopback;                /* IN returns the bytes written to OUT */
+} rusbemu_endpoint_t;
+
+int rusbemu_plug(int busnum, int devnum, int parent, int port,
+                 const unsigned char *descriptors, int length,
+                 const unsigned char **strings, const int *string_lengths, int nstrings,
+                 const rusbemu_endpoint_t *endpoints, int nendpoints);
+int rusbemu_unplug(int busnum, int devnum);
+void rusbemu_unplug_all(void);
+int rusbemu_get_port_numbers(void *dev, uint8_t *ports, int len);
+
+void rusbemu_init(void);
+int rusbemu_find_busses(void);
+int rusbemu_find_devices(void);
+struct usb_bus *rusbemu_get_busses(void);
+usb_dev_handle *rusbemu_open(struct usb_device *dev);
+int rusbemu_close(usb_dev_handle *dev);
+int rusbemu_get_string(usb_dev_handle *dev, int index, int langid, char *buf, size_t buflen);
+int rusbemu_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t buflen);
+int rusbemu_get_descriptor_by_endpoint(usb_dev_handle *dev, int ep, unsigned char type, unsigned char index, void *buf, int size);
+int rusbemu_get_descriptor(usb_dev_handle *dev, unsigned char type, unsigned char index, void *buf, int size);
+int rusbemu_bulk_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusbemu_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusbemu_interrupt_write(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusbemu_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int rusbemu_control_msg(usb_dev_handle *dev, int requesttype, int request, int value, int index, char *bytes, int size, int timeout);
+int rusbemu_set_configuration(usb_dev_handle *dev, int configuration);
+int rusbemu_claim_interface(usb_dev_handle *dev, int interface);
+int rusbemu_release_interface(usb_dev_handle *dev, int interface);
+int rusbemu_set_altinterface(usb_dev_handle *dev, int alternate);
+int rusbemu_clear_halt(usb_dev_handle *dev, unsigned int ep);
+int rusbemu_reset(usb_dev_handle *dev);
+int rusbemu_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned int namelen);
+int rusbemu_detach_kernel_driver_np(usb_dev_handle *dev, int interface);
+
+#define usb_init rusbemu_init
+#define usb_find_busses rusbemu_find_busses
+#define usb_find_devices rusbemu_find_devices
+#define usb_get_busses rusbemu_get_busses
+#define usb_open rusbemu_open
+#define usb_close rusbemu_close
+#define usb_get_string rusbemu_get_string
+#define usb_get_string_simple rusbemu_get_string_simple
+#define usb_get_descriptor_by_endpoint rusbemu_get_descriptor_by_endpoint
+#define usb_get_descriptor rusbemu_get_descriptor
+#define usb_bulk_write rusbemu_bulk_write
+#define usb_bulk_read rusbemu_bulk_read
+#define usb_interrupt_write rusbemu_interrupt_write
+#define usb_interrupt_read rusbemu_interrupt_read
+#define usb_control_msg rusbemu_control_msg
+#define usb_set_configuration rusbemu_set_configuration
+#define usb_claim_interface rusbemu_claim_interface
+#define usb_release_interface rusbemu_release_interface
+#define usb_set_altinterface rusbemu_set_altinterface
+#define usb_clear_halt rusbemu_clear_halt
+#define usb_reset rusbemu_reset
+#define usb_get_driver_np rusbemu_get_driver_np
+#define usb_detach_kernel_driver_np rusbemu_detach_kernel_driver_np
+
+/* Device#port_path and USB.find_device_by_port_path work on the topology. */
+#define libusb_get_port_numbers rusbemu_get_port_numbers
+#ifndef HAVE_LIBUSB_GET_PORT_NUMBERS
+# define HAVE_LIBUSB_GET_PORT_NUMBERS 1
+#endif
+
+#endif